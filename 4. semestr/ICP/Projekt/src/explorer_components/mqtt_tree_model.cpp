@@ -16,14 +16,11 @@
 TreeItem::TreeItem(std::string topic, unsigned int limit, TreeItem *parent):
         limit(limit), history(MessageHistory(limit)), parentItem(parent) {
     topicComponent = topic;
-    fullTopic = topic;
-    // Construct the whole topic
-    if (parent != nullptr) {
-        TreeItem *current = parent;
-        while (current->parent() != nullptr) {
-            fullTopic = current->getComponent() + '/' + fullTopic;
-            current = current->parent();
-        }
+    // Construct the whole topic (the root is not a part of it)
+    if (parent == nullptr || parent->parent() == nullptr) {
+        fullTopic = topic;
+    } else {
+        fullTopic = parent->getTopic() + '/' + topic;
     }
 }
 
@@ -34,13 +31,22 @@ TreeItem *TreeItem::child(int index) const {
     return children.at(index);
 }
 
-void TreeItem::insertChild(std::string topic) {
-    children.push_back(new TreeItem(topic, limit, this));
+TreeItem *TreeItem::findChild(std::string_view component) const {
+    auto it = childIndex.find(component);
+    return it == childIndex.end() ? nullptr : it->second;
+}
+
+TreeItem *TreeItem::insertChild(std::string topic) {
+    auto *child = new TreeItem(std::move(topic), limit, this);
+    child->row = children.size();
+    children.push_back(child);
+    childIndex.emplace(child->getComponent(), child);
+    return child;
 }
 
 int TreeItem::childNumber() const {
     if (parentItem) {
-        return parentItem->children.indexOf(const_cast<TreeItem*>(this));
+        return row;
     }
     return -1;
 }
@@ -144,15 +150,21 @@ QModelIndex MqttTreeModel::parent(const QModelIndex &index) const {
     return createIndex(parent->childNumber(), 0, parent);
 }
 
+QModelIndex MqttTreeModel::itemIndex(TreeItem *item) const {
+    if (item == rootItem) {
+        return QModelIndex();
+    }
+    return createIndex(item->childNumber(), 0, item);
+}
+
 void MqttTreeModel::insertTopic(const QModelIndex &parent, std::string topicName) {
     TreeItem *item = getItem(parent);
-    for (int i = 0; i < item->childCount(); i++) {
-        if (item->child(i)->getComponent() == topicName) {
-            return;
-        }
+    if (item->findChild(topicName) != nullptr) {
+        return;
     }
-    beginInsertRows(parent, 0, 0);
-    item->insertChild(topicName);
+    // The child is appended after the existing ones
+    beginInsertRows(parent, item->childCount(), item->childCount());
+    item->insertChild(std::move(topicName));
     endInsertRows();
 }
 
@@ -183,50 +195,34 @@ void MqttTreeModel::message_arrived(mqtt::const_message_ptr msg) {
     insertMessage(msg->get_topic(), messageCopy, Message::direction::INCOMING);
 }
 
-/**
- * @brief Splits topic into components.
- * @param components The result vector.
- * @param topic The topic to split.
- */
-static void split_into_components(std::vector<std::string> &components, const std::string &topic) {
-    std::string component;
-    for (auto character: topic) {
-        if (character == '/') {
-            components.push_back(component);
-            component = "";
-        } else {
-            component += character;
-        }
-    }
-    // The last one hasn't been added yet
-    components.push_back(component);
-}
-
 void MqttTreeModel::insertMessage(const std::string &messageTopic, std::string &message,
                                   Message::direction direction) {
-    std::vector<std::string> components;
-    split_into_components(components, messageTopic);
+    TreeItem *current;
+    auto cached = topicItems.find(messageTopic);
+    if (cached != topicItems.end()) {
+        current = cached->second;
+    } else {
+        // Walk down the components of the topic, create the ones that don't exist yet
+        current = rootItem;
+        std::string_view rest = messageTopic;
+        while (true) {
+            auto separator = rest.find('/');
+            auto component = rest.substr(0, separator);
+            TreeItem *child = current->findChild(component);
+            if (child == nullptr) {
+                // Must insert the component
+                beginInsertRows(itemIndex(current), current->childCount(), current->childCount());
+                child = current->insertChild(std::string(component));
+                endInsertRows();
+            }
+            current = child;
 
-    int currentComponent = 0;
-    TreeItem *current = rootItem;
-    QModelIndex currentIndex = QModelIndex();
-    while (currentComponent < components.size()) {
-        bool found = false;
-        for (int i = 0; i < current->childCount(); i++) {
-            if (current->child(i)->getComponent() == components[currentComponent]) {
-                // Found on this level, continue in the branch.
-                currentIndex = index(i, 0, currentIndex);
-                current = current->child(i);
-                found = true;
+            if (separator == std::string_view::npos) {
+                break;
             }
+            rest.remove_prefix(separator + 1);
         }
-        if (!found) {
-            // Must insert the component
-            insertTopic(currentIndex, components[currentComponent]) ;
-            currentIndex = index(current->childCount() - 1, 0, currentIndex);
-            current = current->child(current->childCount() - 1);
-        }
-        currentComponent++;
+        topicItems.emplace(messageTopic, current);
     }
     current->addMessage(message, direction);
     emit newMessage();
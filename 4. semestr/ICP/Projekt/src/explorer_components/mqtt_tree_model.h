@@ -13,6 +13,8 @@
 #include <QVector>
 #include <QVariant>
 #include <QAbstractItemModel>
+#include <string_view>
+#include <unordered_map>
 #include <mqtt/async_client.h>
 #include <mqtt/callback.h>
 #include "../message.h"
@@ -70,10 +72,18 @@ public:
     };
 
     /**
-     * @brief Inserts a new child.
+     * @brief Finds a child by the last component of its topic.
+     * @param component The topic component to look for.
+     * @return The child, nullptr if there is no such child.
+     */
+    TreeItem *findChild(std::string_view component) const;
+
+    /**
+     * @brief Inserts a new child (at the end of the children).
      * @param topic The new topic to insert.
+     * @return The inserted child.
      */
-    void insertChild(std::string topic);
+    TreeItem *insertChild(std::string topic);
 
     /**
      * @brief Gets the parent of this item.
@@ -132,6 +142,9 @@ public:
 private:
 
     QVector<TreeItem *> children; /**< Vector of children items. */
+    /** The children indexed by their topic components (the keys point to the components stored in the children). */
+    std::unordered_map<std::string_view, TreeItem *> childIndex;
+    int row = -1; /**< The index of this node in the parent's list of children. */
     std::string fullTopic; /**< The topic that the node represents, full path (and address). */
     std::string topicComponent; /**< The last component of the topic that is showed on this level. */
     MessageHistory history; /**< The history of the topic. */
@@ -324,7 +337,16 @@ private:
      */
     void insertMessage(const std::string &messageTopic, std::string &message, Message::direction direction);
 
+    /**
+     * @brief Creates an index of the given item.
+     * @param item The item.
+     * @return The index of the item, empty for the root node.
+     */
+    QModelIndex itemIndex(TreeItem *item) const;
+
     TreeItem *rootItem; /**< Pointer to the root of the tree. */
+    /** The items of the topics of the inserted messages, so that the repeated topics are not looked up again. */
+    std::unordered_map<std::string, TreeItem *> topicItems;
     mqtt::async_client *client; /**< Pointer to the MQTT client instance. */
     mqtt::connect_options opts; /**< MQTT connection options. */
     std::string topic = "#"; /**< MQTT topic to subscribe to. */
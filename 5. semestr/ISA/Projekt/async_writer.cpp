@@ -0,0 +1,198 @@
+// async_writer.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "async_writer.h"
+#include "common.h"
+#include "errors.h"
+
+AsyncWriter::AsyncWriter(int fd, uint64_t size) : fd(fd), preallocate(size == 0) {
+    // Reserve the space at once so that the blocks written in any order don't fragment the file
+    if (size != 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0) {
+        allocated = size;
+    }
+
+    thread = std::thread(&AsyncWriter::write_loop, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    submit();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    queued_cv.notify_one();
+    thread.join();
+    close(fd);
+}
+
+void AsyncWriter::write(uint64_t pos, const uint8_t *data, size_t len) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        check_error();
+    }
+
+    while (len > 0) {
+        if (current != nullptr && current->pos + current->len != pos) {
+            submit();
+        }
+
+        if (current == nullptr) {
+            current = acquire();
+            current->pos = pos;
+        }
+
+        // A run ends at a multiple of the buffer size so that the blocks written are aligned
+        auto run_end = (current->pos / R_WRITE_BUFFER_SIZE + 1) * R_WRITE_BUFFER_SIZE;
+        auto to_copy = std::min<uint64_t>(len, run_end - pos);
+        memcpy(current->data.get() + current->len, data, to_copy);
+        current->len += to_copy;
+        pos += to_copy;
+        data += to_copy;
+        len -= to_copy;
+
+        if (pos == run_end) {
+            submit();
+        }
+    }
+}
+
+void AsyncWriter::read(uint64_t pos, uint8_t *data, size_t len) {
+    flush();
+
+    while (len > 0) {
+        auto ret = pread(fd, data, len, static_cast<off_t>(pos));
+        if (ret == -1) {
+            THROW_ERRNO_W("Cannot read the output file");
+        }
+
+        if (ret == 0) {
+            throw std::system_error(EIO, std::generic_category(), "Cannot read the output file");
+        }
+
+        pos += ret;
+        data += ret;
+        len -= ret;
+    }
+}
+
+void AsyncWriter::flush() {
+    submit();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    written_cv.wait(lock, [this] { return (queued.empty() && !writing) || error; });
+    check_error();
+}
+
+void AsyncWriter::truncate(uint64_t size) {
+    flush();
+
+    if (ftruncate(fd, static_cast<off_t>(size)) == -1) {
+        THROW_ERRNO_W("Cannot truncate the output file");
+    }
+}
+
+void AsyncWriter::write_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        queued_cv.wait(lock, [this] { return !queued.empty() || stopping; });
+        if (queued.empty()) {
+            return;
+        }
+
+        auto run = queued.front();
+        queued.pop_front();
+        writing = true;
+
+        // Don't write anymore after an error, just return the runs
+        if (!error) {
+            lock.unlock();
+            try {
+                write_run(*run);
+            } catch (...) {
+                lock.lock();
+                error = std::current_exception();
+                lock.unlock();
+            }
+            lock.lock();
+        }
+
+        run->len = 0;
+        free_runs.push_back(run);
+        writing = false;
+        written_cv.notify_all();
+    }
+}
+
+void AsyncWriter::write_run(const Run &run) {
+    auto end = run.pos + run.len;
+    if (preallocate && end > allocated) {
+        auto new_allocated = (end / R_WRITE_PREALLOCATE_STEP + 1) * R_WRITE_PREALLOCATE_STEP;
+
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(allocated),
+                      static_cast<off_t>(new_allocated - allocated)) == 0) {
+            allocated = new_allocated;
+        } else if (errno == EOPNOTSUPP) {
+            preallocate = false;
+        }
+    }
+
+    size_t written = 0;
+    while (written < run.len) {
+        auto ret = pwrite(fd, run.data.get() + written, run.len - written, static_cast<off_t>(run.pos + written));
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            THROW_ERRNO_W("Cannot write to the output file");
+        }
+
+        written += ret;
+    }
+}
+
+void AsyncWriter::submit() {
+    if (current == nullptr) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued.push_back(current);
+    }
+
+    current = nullptr;
+    queued_cv.notify_one();
+}
+
+AsyncWriter::Run *AsyncWriter::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (free_runs.empty() && runs.size() < R_WRITE_BUFFERS) {
+        auto run = std::make_unique<Run>();
+        run->data = std::make_unique<uint8_t[]>(R_WRITE_BUFFER_SIZE);
+        runs.push_back(std::move(run));
+        return runs.back().get();
+    }
+
+    written_cv.wait(lock, [this] { return !free_runs.empty() || error; });
+    check_error();
+
+    auto run = free_runs.back();
+    free_runs.pop_back();
+    return run;
+}
+
+void AsyncWriter::check_error() {
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
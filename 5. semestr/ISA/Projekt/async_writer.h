@@ -0,0 +1,146 @@
+// async_writer.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_ASYNC_WRITER_H
+#define ISA_ASYNC_WRITER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Writes the received data to a file in a background thread, so that receiving the packets doesn't wait for the disk
+ * (used by the receiver when the output file cannot be memory-mapped, e.g. when its length is not known).
+ *
+ * The adjacent data are gathered in runs of up to R_WRITE_BUFFER_SIZE bytes that end at the multiples of
+ * R_WRITE_BUFFER_SIZE, so the data received in order are written in large aligned blocks. At most R_WRITE_BUFFERS
+ * runs are allocated; when all of them are waiting to be written, write() waits for the disk.
+ *
+ * The space of the file is preallocated using fallocate() without changing the file size: all at once if the size
+ * is known, otherwise in steps of R_WRITE_PREALLOCATE_STEP bytes ahead of the written data. File systems that don't
+ * support it are just written to.
+ *
+ * @remark The errors of the background writes are reported by the following call of write(), read() or flush().
+ */
+class AsyncWriter {
+public:
+    /**
+     * Creates an AsyncWriter and starts its thread.
+     *
+     * @param [in] fd The file descriptor of the output file (opened for reading and writing). The writer takes
+     * ownership of it.
+     * @param [in] size The expected size of the file; zero if it's not known.
+     */
+    AsyncWriter(int fd, uint64_t size);
+
+    /**
+     * Writes the remaining data (the errors are ignored, call flush() first to handle them), stops the thread
+     * and closes the file.
+     */
+    ~AsyncWriter();
+
+    AsyncWriter(const AsyncWriter &) = delete;
+
+    AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+    /**
+     * Queues data to be written (copies them).
+     *
+     * @param [in] pos The position in the file.
+     * @param [in] data The data.
+     * @param [in] len Length of the data.
+     * @throws std::system_error Thrown when a previous write has failed.
+     */
+    void write(uint64_t pos, const uint8_t *data, size_t len);
+
+    /**
+     * Reads written data back from the file. Waits for the queued data to be written first.
+     *
+     * @param [in] pos The position in the file.
+     * @param [out] data A buffer to read the data to.
+     * @param [in] len Length of the data.
+     * @throws std::system_error Thrown when a write has failed or when the data cannot be read.
+     */
+    void read(uint64_t pos, uint8_t *data, size_t len);
+
+    /**
+     * Waits until all the queued data are written.
+     *
+     * @throws std::system_error Thrown when a write has failed.
+     */
+    void flush();
+
+    /**
+     * Waits until all the queued data are written and truncates (or extends) the file. Frees the space preallocated
+     * past the end.
+     *
+     * @param [in] size The new size of the file.
+     * @throws std::system_error Thrown when a write has failed or when the file cannot be truncated.
+     */
+    void truncate(uint64_t size);
+
+private:
+    /** Adjacent data waiting to be written. */
+    struct Run {
+        uint64_t pos = 0; /**< The position in the file. */
+        size_t len = 0; /**< Length of the data. */
+        std::unique_ptr<uint8_t[]> data; /**< A buffer of R_WRITE_BUFFER_SIZE bytes. */
+    };
+
+    int fd; /**< The file descriptor of the output file. */
+    uint64_t allocated = 0; /**< The preallocated size of the file (only accessed by the thread). */
+    bool preallocate; /**< Signalises if the space should be preallocated ahead of the written data. */
+
+    std::vector<std::unique_ptr<Run>> runs; /**< All the allocated runs. */
+    Run *current = nullptr; /**< The run the adjacent data are gathered in; nullptr if none. */
+
+    std::mutex mutex; /**< Guards the members below. */
+    std::condition_variable queued_cv; /**< Signalised when a run is queued or when the thread should stop. */
+    std::condition_variable written_cv; /**< Signalised when a run has been written. */
+    std::deque<Run *> queued; /**< The runs waiting to be written. */
+    std::vector<Run *> free_runs; /**< The runs that may be used for new data. */
+    bool writing = false; /**< Signalises that the thread is writing a run. */
+    bool stopping = false; /**< Signalises that the thread should stop. */
+    std::exception_ptr error; /**< The first error of the thread. */
+
+    std::thread thread; /**< The writer thread. */
+
+    /**
+     * The thread: writes the queued runs.
+     */
+    void write_loop();
+
+    /**
+     * Writes a run to the file (preallocates the space ahead of it first).
+     *
+     * @param [in] run The run.
+     * @throws std::system_error Thrown when the data cannot be written.
+     */
+    void write_run(const Run &run);
+
+    /**
+     * Queues the current run (if any).
+     */
+    void submit();
+
+    /**
+     * Takes a free run, allocates a new one or waits for one to be written.
+     *
+     * @return The run (empty).
+     * @throws std::system_error Thrown when a write has failed.
+     */
+    Run *acquire();
+
+    /**
+     * Re-throws the error of the thread (if any). Must be called with @a mutex locked.
+     */
+    void check_error();
+};
+
+#endif //ISA_ASYNC_WRITER_H
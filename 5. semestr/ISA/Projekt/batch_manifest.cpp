@@ -0,0 +1,272 @@
+// batch_manifest.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+#include <cstring>
+#include <endian.h>
+#include <filesystem>
+#include <stdexcept>
+
+#include "batch_manifest.h"
+
+namespace fs = std::filesystem;
+
+/** The length of the manifest header and of the fixed part of a file record. */
+#define MANIFEST_HEADER_LEN sizeof(uint32_t)
+#define MANIFEST_RECORD_LEN (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t))
+
+BatchManifest BatchManifest::scan(const std::vector<std::string> &paths) {
+    BatchManifest manifest;
+
+    for (const auto &path: paths) {
+        // Directories are stored under their name (even if specified as "dir/" or ".")
+        auto item = fs::absolute(path).lexically_normal();
+        if (!item.has_filename()) {
+            item = item.parent_path();
+        }
+
+        if (!fs::is_directory(item)) {
+            if (fs::is_regular_file(item)) {
+                manifest.add(item.filename().string(), fs::file_size(item),
+                             static_cast<uint32_t>(fs::status(item).permissions() & fs::perms::all),
+                             item.string());
+            }
+            continue;
+        }
+
+        // The order of the iteration is unspecified, sort the files so that the stream is always the same
+        std::vector<fs::path> files;
+        for (const auto &entry: fs::recursive_directory_iterator(item)) {
+            if (entry.is_regular_file()) {
+                files.push_back(entry.path());
+            }
+        }
+
+        std::sort(files.begin(), files.end());
+        for (const auto &file: files) {
+            manifest.add(file.lexically_relative(item.parent_path()).generic_string(), fs::file_size(file),
+                         static_cast<uint32_t>(fs::status(file).permissions() & fs::perms::all),
+                         file.string());
+        }
+    }
+
+    if (manifest.files.size() > PROTO_BATCH_MAX_FILES) {
+        throw std::runtime_error("Too many files to send");
+    }
+
+    return manifest;
+}
+
+void BatchManifest::add(std::string path, uint64_t size, uint32_t mode, std::string source) {
+    if (path.empty() || path.size() > UINT16_MAX) {
+        throw std::runtime_error("Cannot send file '" + source + "': invalid path length");
+    }
+
+    files.push_back(BatchEntry{std::move(path), size, mode, total_size, std::move(source)});
+    total_size += size;
+}
+
+std::vector<uint8_t> BatchManifest::encode() const {
+    size_t len = MANIFEST_HEADER_LEN;
+    for (const auto &file: files) {
+        len += MANIFEST_RECORD_LEN + file.path.size();
+    }
+
+    if (len > PROTO_BATCH_MAX_MANIFEST_LEN) {
+        throw std::runtime_error("The list of the files to send is too long");
+    }
+
+    std::vector<uint8_t> data(len);
+    auto dest = data.data();
+
+    uint32_t count_be = htobe32(static_cast<uint32_t>(files.size()));
+    memcpy(dest, &count_be, sizeof(uint32_t));
+    dest += sizeof(uint32_t);
+
+    for (const auto &file: files) {
+        uint64_t size_be = htobe64(file.size);
+        uint32_t mode_be = htobe32(file.mode);
+        uint16_t path_len_be = htobe16(static_cast<uint16_t>(file.path.size()));
+
+        memcpy(dest, &size_be, sizeof(uint64_t));
+        memcpy(dest + sizeof(uint64_t), &mode_be, sizeof(uint32_t));
+        memcpy(dest + sizeof(uint64_t) + sizeof(uint32_t), &path_len_be, sizeof(uint16_t));
+        memcpy(dest + MANIFEST_RECORD_LEN, file.path.data(), file.path.size());
+        dest += MANIFEST_RECORD_LEN + file.path.size();
+    }
+
+    return data;
+}
+
+/**
+ * @return True if the path is relative and contains no empty, "." or ".." components (so it cannot point outside
+ * the working directory).
+ */
+static bool is_safe_path(const std::string &path) {
+    if (path.empty() || path.find('\0') != std::string::npos) {
+        return false;
+    }
+
+    size_t begin = 0;
+    while (true) {
+        auto end = path.find('/', begin);
+        auto component = path.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+
+        if (end == std::string::npos) {
+            return true;
+        }
+
+        begin = end + 1;
+    }
+}
+
+bool BatchManifest::decode(const uint8_t *data, size_t data_len, BatchManifest &manifest) {
+    manifest = BatchManifest();
+    if (data_len < MANIFEST_HEADER_LEN) {
+        return false;
+    }
+
+    uint32_t count;
+    memcpy(&count, data, sizeof(uint32_t));
+    count = be32toh(count);
+
+    // Each record takes at least MANIFEST_RECORD_LEN + 1 bytes; don't let the count make us allocate much memory
+    if (count > PROTO_BATCH_MAX_FILES || count > (data_len - MANIFEST_HEADER_LEN) / (MANIFEST_RECORD_LEN + 1)) {
+        return false;
+    }
+
+    manifest.files.reserve(count);
+    size_t pos = MANIFEST_HEADER_LEN;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (data_len - pos < MANIFEST_RECORD_LEN) {
+            return false;
+        }
+
+        uint64_t size;
+        uint32_t mode;
+        uint16_t path_len;
+        memcpy(&size, data + pos, sizeof(uint64_t));
+        memcpy(&mode, data + pos + sizeof(uint64_t), sizeof(uint32_t));
+        memcpy(&path_len, data + pos + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint16_t));
+        size = be64toh(size);
+        mode = be32toh(mode);
+        path_len = be16toh(path_len);
+        pos += MANIFEST_RECORD_LEN;
+
+        if (data_len - pos < path_len || size > UINT64_MAX - manifest.total_size) {
+            return false;
+        }
+
+        std::string path(reinterpret_cast<const char *>(data + pos), path_len);
+        pos += path_len;
+
+        if (!is_safe_path(path)) {
+            return false;
+        }
+
+        // Only the rwx bits are kept: the receiver runs as root and must not create e.g. setuid files
+        manifest.add(std::move(path), size, mode & static_cast<uint32_t>(fs::perms::all));
+    }
+
+    return pos == data_len;
+}
+
+size_t BatchManifest::find(uint64_t pos) const {
+    if (pos >= total_size) {
+        return files.size();
+    }
+
+    // The last file that starts at or before the position; the empty files that start there precede it
+    auto it = std::upper_bound(files.begin(), files.end(), pos, [](uint64_t value, const BatchEntry &file) {
+        return value < file.offset;
+    });
+
+    return static_cast<size_t>(it - files.begin()) - 1;
+}
+
+BatchStreamBuf::BatchStreamBuf(const BatchManifest &manifest)
+        : manifest(manifest), manifest_data(manifest.encode()), buffer(S_BATCH_READ_BUFFER_SIZE) {
+}
+
+BatchStreamBuf::int_type BatchStreamBuf::underflow() {
+    // Continue after the data in the buffer (there are none after a seek)
+    uint64_t pos = buffer_pos + (egptr() - eback());
+    size_t len;
+
+    if (pos < manifest_data.size()) {
+        len = std::min<uint64_t>(buffer.size(), manifest_data.size() - pos);
+        memcpy(buffer.data(), manifest_data.data() + pos, len);
+    } else {
+        auto data_pos = pos - manifest_data.size();
+        auto index = manifest.find(data_pos);
+        if (index == manifest.entries().size()) {
+            return traits_type::eof();
+        }
+
+        const auto &entry = manifest.entries()[index];
+        if (index != file_index) {
+            file.close();
+            file.clear();
+            file.open(entry.source, std::ios_base::in | std::ios_base::binary);
+            if (!file.is_open()) {
+                throw std::runtime_error("Cannot open file '" + entry.source + "'");
+            }
+
+            file_index = index;
+        }
+
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(data_pos - entry.offset), std::ios_base::beg);
+        file.read(buffer.data(), static_cast<std::streamsize>(
+                std::min<uint64_t>(buffer.size(), entry.offset + entry.size - data_pos)));
+
+        len = file.gcount();
+        if (len == 0) {
+            throw std::runtime_error("The file '" + entry.source + "' has changed during the transmission");
+        }
+    }
+
+    buffer_pos = pos;
+    setg(buffer.data(), buffer.data(), buffer.data() + len);
+    return traits_type::to_int_type(buffer[0]);
+}
+
+BatchStreamBuf::pos_type BatchStreamBuf::seekoff(off_type off, std::ios_base::seekdir dir,
+                                                 std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in)) {
+        return pos_type(off_type(-1));
+    }
+
+    off_type base;
+    if (dir == std::ios_base::beg) {
+        base = 0;
+    } else if (dir == std::ios_base::cur) {
+        base = static_cast<off_type>(buffer_pos + (gptr() - eback()));
+    } else {
+        base = static_cast<off_type>(stream_len());
+    }
+
+    auto target = base + off;
+    if (target < 0 || static_cast<uint64_t>(target) > stream_len()) {
+        return pos_type(off_type(-1));
+    }
+
+    auto target_pos = static_cast<uint64_t>(target);
+    if (target_pos >= buffer_pos && target_pos <= buffer_pos + (egptr() - eback())) {
+        // Keep the buffered data
+        setg(eback(), eback() + (target_pos - buffer_pos), egptr());
+    } else {
+        setg(nullptr, nullptr, nullptr);
+        buffer_pos = target_pos;
+    }
+
+    return pos_type(target);
+}
+
+BatchStreamBuf::pos_type BatchStreamBuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
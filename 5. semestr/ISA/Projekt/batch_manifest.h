@@ -0,0 +1,129 @@
+// batch_manifest.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_BATCH_MANIFEST_H
+#define ISA_BATCH_MANIFEST_H
+
+#include <cstdint>
+#include <fstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+/*
+ * A batch transfers multiple files in one transmission (protocol version 2). The files are sent as a single stream:
+ * the manifest (the list of the files) followed by the contents of all the files, back to back. The stream is split
+ * into chunks as usual, so the small files share chunks. The receiver decodes the manifest from the first chunks
+ * and then writes each chunk to the files it covers.
+ *
+ * The manifest: [u32 number of files] and for each file [u64 size][u32 mode][u16 path length][path] (big endian).
+ * The paths are relative and use '/' as the separator.
+ */
+
+/**
+ * A file in a batch.
+ */
+struct BatchEntry {
+    std::string path; /**< The path of the file on the receiver side (relative). */
+    uint64_t size; /**< The file size. */
+    uint32_t mode; /**< The permission bits of the file (rwx only, no setuid, setgid or sticky bits). */
+    uint64_t offset; /**< The position of the file contents in the batch stream (after the manifest). */
+    std::string source; /**< The path of the file on the sender side (not transferred). */
+};
+
+/**
+ * The list of files in a batch.
+ */
+class BatchManifest {
+public:
+    /**
+     * Makes a manifest of the specified files and directories. A file is stored under its name; a directory is
+     * searched recursively and its files are stored under the directory name. Only regular files are included.
+     *
+     * @param [in] paths The paths to the files and directories.
+     * @return The manifest.
+     * @throws std::runtime_error Thrown when there are too many files or when a path cannot be stored.
+     * @throws std::filesystem::filesystem_error Thrown when a directory cannot be searched.
+     */
+    static BatchManifest scan(const std::vector<std::string> &paths);
+
+    /**
+     * Decodes a received manifest and checks that the paths don't point outside the working directory.
+     *
+     * @param [in] data The encoded manifest.
+     * @param [in] data_len Length of the encoded manifest.
+     * @param [out] manifest The decoded manifest.
+     * @return False if the manifest is malformed or if it contains an unsafe path.
+     */
+    static bool decode(const uint8_t *data, size_t data_len, BatchManifest &manifest);
+
+    /**
+     * @return The encoded manifest.
+     */
+    [[nodiscard]] std::vector<uint8_t> encode() const;
+
+    /**
+     * Finds the file that contains a position in the contents part of the stream.
+     *
+     * @param [in] pos The position (relative to the end of the manifest).
+     * @return The index of the file; the number of files if the position is past the end.
+     */
+    [[nodiscard]] size_t find(uint64_t pos) const;
+
+    /** @return The files. */
+    [[nodiscard]] const std::vector<BatchEntry> &entries() const { return files; }
+
+    /** @return The total size of the files. */
+    [[nodiscard]] uint64_t data_len() const { return total_size; }
+
+private:
+    std::vector<BatchEntry> files; /**< The files, in the order of their contents in the stream. */
+    uint64_t total_size = 0; /**< The total size of the files. */
+
+    /**
+     * Adds a file at the end of the stream.
+     */
+    void add(std::string path, uint64_t size, uint32_t mode, std::string source = {});
+};
+
+/**
+ * A read-only stream buffer that reads the batch stream (the encoded manifest and the contents of the files)
+ * on the sender side. It's seekable, so it can be used by the SendPipeline to read the chunks to be resent.
+ * Only one file is kept open at a time.
+ */
+class BatchStreamBuf : public std::streambuf {
+public:
+    /**
+     * Creates a BatchStreamBuf.
+     *
+     * @param [in] manifest The manifest of the batch. Must outlive the buffer.
+     */
+    explicit BatchStreamBuf(const BatchManifest &manifest);
+
+    /** @return The length of the encoded manifest (the position of the first file's contents). */
+    [[nodiscard]] uint64_t manifest_len() const { return manifest_data.size(); }
+
+    /** @return The length of the whole stream. */
+    [[nodiscard]] uint64_t stream_len() const { return manifest_data.size() + manifest.data_len(); }
+
+protected:
+    int_type underflow() override;
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+    const BatchManifest &manifest; /**< The manifest. */
+    std::vector<uint8_t> manifest_data; /**< The encoded manifest. */
+    std::vector<char> buffer; /**< The read buffer. */
+    uint64_t buffer_pos = 0; /**< The position of the beginning of the buffer in the stream. */
+
+    std::ifstream file; /**< The currently open file. */
+    size_t file_index = SIZE_MAX; /**< The index of the currently open file. */
+};
+
+#endif //ISA_BATCH_MANIFEST_H
@@ -0,0 +1,207 @@
+// batch_writer.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/stat.h>
+
+#include "batch_writer.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+BatchWriter::BatchWriter(BatchManifest manifest, bool enable_overwrite, bool resume)
+        : manifest(std::move(manifest)), fds(this->manifest.entries().size(), -1) {
+    const auto &entries = this->manifest.entries();
+
+    // Don't create anything if a file would be overwritten
+    if (!enable_overwrite && !resume) {
+        for (const auto &entry: entries) {
+            if (fs::exists(entry.path)) {
+                throw std::runtime_error("An existing file '" + entry.path + "' would be overwritten");
+            }
+        }
+    }
+
+    remaining.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        const auto &entry = entries[i];
+        remaining.push_back(entry.size);
+
+        auto parent = fs::path(entry.path).parent_path();
+        if (!parent.empty()) {
+            fs::create_directories(parent);
+        }
+
+        // The permissions are set when the file is complete (they may not allow writing)
+        // When resuming, the received contents are kept; the files are marked as written by skip()
+        int fd = open(entry.path.c_str(), O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0600);
+        if (fd == -1 && resume && errno == EACCES) {
+            // Completed in the previous transfer
+            fd = open(entry.path.c_str(), O_RDONLY);
+        }
+
+        if (fd == -1) {
+            THROW_ERRNO_W("Cannot open file " + entry.path + " for writing");
+        }
+
+        if (entry.size == 0) {
+            fchmod(fd, entry.mode);
+            close(fd);
+        } else if (open_count >= R_BATCH_MAX_OPEN_FILES || resume) {
+            close(fd);
+        } else {
+            // The files are mostly written in order, keep the first ones open
+            fds[i] = fd;
+            open_order.push_back(i);
+            open_count++;
+        }
+    }
+}
+
+BatchWriter::~BatchWriter() {
+    for (auto fd: fds) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+}
+
+template<typename Function>
+void BatchWriter::for_each_part(uint64_t pos, size_t len, Function function) {
+    const auto &entries = manifest.entries();
+    size_t done = 0;
+
+    for (auto index = manifest.find(pos); done < len && index < entries.size(); index++) {
+        const auto &entry = entries[index];
+        if (entry.size == 0) {
+            continue;
+        }
+
+        auto part_len = static_cast<size_t>(std::min<uint64_t>(len - done, entry.offset + entry.size - pos));
+        function(index, pos - entry.offset, done, part_len);
+        pos += part_len;
+        done += part_len;
+    }
+}
+
+void BatchWriter::write(uint64_t pos, const uint8_t *data, size_t len) {
+    for_each_part(pos, len, [&](size_t index, uint64_t file_pos, size_t offset, size_t part_len) {
+        int fd = open_file(index);
+
+        for (size_t written = 0; written < part_len;) {
+            auto res = pwrite(fd, data + offset + written, part_len - written,
+                              static_cast<off_t>(file_pos + written));
+            if (res == -1) {
+                THROW_ERRNO_W("Cannot write to file " + manifest.entries()[index].path);
+            }
+
+            written += res;
+        }
+
+        mark_written(index, part_len);
+    });
+}
+
+void BatchWriter::skip(uint64_t pos, size_t len) {
+    for_each_part(pos, len, [&](size_t index, uint64_t, size_t, size_t part_len) {
+        mark_written(index, part_len);
+    });
+}
+
+void BatchWriter::mark_written(size_t index, size_t len) {
+    if (remaining[index] == 0) {
+        return;
+    }
+
+    remaining[index] -= std::min<uint64_t>(remaining[index], len);
+    if (remaining[index] == 0) {
+        const auto &entry = manifest.entries()[index];
+        log_verbose("Received file " << entry.path);
+
+        if (fds[index] != -1) {
+            fchmod(fds[index], entry.mode);
+            close_file(index);
+        } else {
+            chmod(entry.path.c_str(), entry.mode);
+        }
+    }
+}
+
+void BatchWriter::read(uint64_t pos, uint8_t *data, size_t len) {
+    for_each_part(pos, len, [&](size_t index, uint64_t file_pos, size_t offset, size_t part_len) {
+        int fd = open_file(index);
+
+        for (size_t read = 0; read < part_len;) {
+            auto res = pread(fd, data + offset + read, part_len - read, static_cast<off_t>(file_pos + read));
+            if (res == -1) {
+                THROW_ERRNO_W("Cannot read from file " + manifest.entries()[index].path);
+            }
+
+            if (res == 0) {
+                // Not written yet (the file is sparse)
+                std::fill(data + offset + read, data + offset + part_len, 0);
+                break;
+            }
+
+            read += res;
+        }
+    });
+}
+
+size_t BatchWriter::finish() {
+    size_t incomplete = 0;
+    for (size_t i = 0; i < remaining.size(); i++) {
+        if (remaining[i] != 0) {
+            log_verbose("The file " << manifest.entries()[i].path << " has not been received completely");
+            incomplete++;
+        }
+
+        close_file(i);
+    }
+
+    open_order.clear();
+    return incomplete;
+}
+
+int BatchWriter::open_file(size_t index) {
+    if (fds[index] != -1) {
+        return fds[index];
+    }
+
+    // Forget the files that have already been closed
+    while (!open_order.empty() && fds[open_order.front()] == -1) {
+        open_order.pop_front();
+    }
+
+    if (open_count >= R_BATCH_MAX_OPEN_FILES) {
+        // Close the file opened first
+        close_file(open_order.front());
+        open_order.pop_front();
+    }
+
+    const auto &path = manifest.entries()[index].path;
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd == -1 && errno == EACCES && remaining[index] == 0) {
+        // Complete, only reading is needed (and may be allowed)
+        fd = open(path.c_str(), O_RDONLY);
+    }
+
+    if (fd == -1) {
+        THROW_ERRNO_W("Cannot open file " + path);
+    }
+
+    fds[index] = fd;
+    open_order.push_back(index);
+    open_count++;
+    return fd;
+}
+
+void BatchWriter::close_file(size_t index) {
+    if (fds[index] != -1) {
+        close(fds[index]);
+        fds[index] = -1;
+        open_count--;
+    }
+}
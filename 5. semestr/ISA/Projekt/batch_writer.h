@@ -0,0 +1,129 @@
+// batch_writer.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_BATCH_WRITER_H
+#define ISA_BATCH_WRITER_H
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "batch_manifest.h"
+
+/**
+ * Writes the received contents of the files of a batch (see batch_manifest.h) on the receiver side. A chunk may cover
+ * parts of multiple files; the chunks may arrive in any order, so all the files are created at once and the data are
+ * written to them as they arrive.
+ *
+ * At most R_BATCH_MAX_OPEN_FILES files are kept open; when more are needed, the one opened first is closed (and opened
+ * again when needed). A file is closed and gets its permissions when all its contents have been written.
+ *
+ * @remark The writer doesn't check for duplicates: each part of the contents must be written (or skipped) only once.
+ */
+class BatchWriter {
+public:
+    /**
+     * Creates a BatchWriter. Creates the files of the batch (and their directories) in the working directory.
+     *
+     * @param [in] manifest The manifest of the batch (the paths are expected to be safe, see BatchManifest::decode()).
+     * @param [in] enable_overwrite Signalises if existing files may be overwritten.
+     * @param [in] resume If true, a previous transfer of the batch is resumed: the existing files are kept (only
+     * the missing ones are created) and the contents received before must be marked using skip().
+     * @throws std::runtime_error Thrown when a file exists and it may not be overwritten.
+     * @throws std::system_error Thrown when a file or a directory cannot be created.
+     */
+    BatchWriter(BatchManifest manifest, bool enable_overwrite, bool resume = false);
+
+    /**
+     * Closes the open files.
+     */
+    ~BatchWriter();
+
+    BatchWriter(const BatchWriter &) = delete;
+
+    BatchWriter &operator=(const BatchWriter &) = delete;
+
+    /**
+     * Writes a part of the contents.
+     *
+     * @param [in] pos The position in the contents part of the stream.
+     * @param [in] data The data.
+     * @param [in] len Length of the data. The data must not extend past the end of the contents.
+     * @throws std::system_error Thrown when the data cannot be written.
+     */
+    void write(uint64_t pos, const uint8_t *data, size_t len);
+
+    /**
+     * Marks a part of the contents as written (received in a previous transfer that is being resumed).
+     *
+     * @param [in] pos The position in the contents part of the stream.
+     * @param [in] len Length of the part.
+     */
+    void skip(uint64_t pos, size_t len);
+
+    /**
+     * Reads back a part of the written contents.
+     *
+     * @param [in] pos The position in the contents part of the stream.
+     * @param [out] data A buffer to read the data to.
+     * @param [in] len Length of the data. The data must not extend past the end of the contents.
+     * @throws std::system_error Thrown when the data cannot be read.
+     */
+    void read(uint64_t pos, uint8_t *data, size_t len);
+
+    /**
+     * Closes the open files and reports the files that have not been received completely.
+     *
+     * @return The number of the incomplete files.
+     */
+    size_t finish();
+
+    /** @return The manifest. */
+    [[nodiscard]] const BatchManifest &files() const { return manifest; }
+
+private:
+    BatchManifest manifest; /**< The manifest of the batch. */
+    std::vector<int> fds; /**< The file descriptors of the open files by file index; -1 if the file is closed. */
+    std::vector<uint64_t> remaining; /**< The number of bytes of each file that have not been written yet. */
+    std::deque<size_t> open_order; /**< The indices of the open files in the order of opening (may contain stale ones). */
+    size_t open_count = 0; /**< The number of open files. */
+
+    /**
+     * Opens a file (if it's not open), closes the file opened first if there are too many open files.
+     *
+     * @param [in] index The file index.
+     * @return The file descriptor.
+     * @throws std::system_error Thrown when the file cannot be opened.
+     */
+    int open_file(size_t index);
+
+    /**
+     * Closes a file if it's open.
+     *
+     * @param [in] index The file index.
+     */
+    void close_file(size_t index);
+
+    /**
+     * Decreases the number of bytes of a file that have not been written yet. When the file is complete, sets its
+     * permissions and closes it.
+     *
+     * @param [in] index The file index.
+     * @param [in] len The number of bytes written.
+     */
+    void mark_written(size_t index, size_t len);
+
+    /**
+     * Calls a function for each part of a range of the contents that belongs to one file.
+     *
+     * @param [in] pos The position in the contents part of the stream.
+     * @param [in] len Length of the range.
+     * @param [in] function The function, called with the file index, the position in the file, the offset
+     * in the range and the length of the part.
+     */
+    template<typename Function>
+    void for_each_part(uint64_t pos, size_t len, Function function);
+};
+
+#endif //ISA_BATCH_WRITER_H
@@ -0,0 +1,146 @@
+#!/bin/bash
+# bench.sh
+# Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+#
+# Measures the transfer performance on one machine: the sender and the receiver run in two network namespaces
+# connected by a veth pair, the link is emulated using tc netem (loss, delay, reordering). Requires root, ip and tc.
+#
+# Usage: ./bench.sh [profile...]   (all profiles by default)
+# Environment:
+#   BENCH_SIZE     the number of bytes to transfer (default 20000000)
+#   BENCH_FLAGS    additional sender options (e.g. "-f 8:2" or "-z")
+#   BENCH_TIMEOUT  the time limit of one transfer in seconds (default 120)
+#   BENCH_BIN      the binary to measure (default ./secret)
+#
+# Reported for each profile:
+#   goodput   the file size divided by the time the sender ran (MB/s)
+#   cpu/MB    the processor time (user + system) of the sender and of the receiver per megabyte transferred (ms)
+#   retrans   the chunks retransmitted by the sliding window (not acknowledged in time)
+#   resent    the chunks the receiver asked to resend
+#   ttfb      the time from starting the sender to the first data chunk written by the receiver (ms)
+
+SIZE=${BENCH_SIZE:-20000000}
+TIMEOUT=${BENCH_TIMEOUT:-120}
+BIN=$(realpath "${BENCH_BIN:-./secret}")
+
+NS_S=secret_bench_s
+NS_R=secret_bench_r
+ADDR_S=10.77.0.1
+ADDR_R=10.77.0.2
+
+# The netem parameters of each profile, applied to both directions
+declare -A PROFILES=(
+    [clean]=""
+    [lan]="delay 1ms"
+    [wan]="delay 20ms 2ms rate 100mbit loss 0.5%"
+    [lossy]="delay 10ms loss 5%"
+    [reorder]="delay 10ms reorder 25% 50%"
+)
+PROFILE_ORDER="clean lan wan lossy reorder"
+
+if [ "$(id -u)" != 0 ] || ! command -v ip >/dev/null || ! command -v tc >/dev/null; then
+    echo "The benchmark must be run as root and requires ip and tc" >&2
+    exit 1
+fi
+
+if [ ! -x "$BIN" ]; then
+    echo "Cannot find the binary $BIN (run make first)" >&2
+    exit 1
+fi
+
+selected=${*:-$PROFILE_ORDER}
+for profile in $selected; do
+    if [ -z "${PROFILES[$profile]+set}" ]; then
+        echo "Unknown profile '$profile' (available: $PROFILE_ORDER)" >&2
+        exit 1
+    fi
+done
+
+work=$(mktemp -d)
+
+cleanup() {
+    ip netns del $NS_S 2>/dev/null
+    ip netns del $NS_R 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+setup_link() {
+    ip netns del $NS_S 2>/dev/null
+    ip netns del $NS_R 2>/dev/null
+    ip netns add $NS_S
+    ip netns add $NS_R
+    ip link add bench_s netns $NS_S type veth peer name bench_r netns $NS_R
+    ip -n $NS_S addr add $ADDR_S/24 dev bench_s
+    ip -n $NS_R addr add $ADDR_R/24 dev bench_r
+    ip -n $NS_S link set bench_s up
+    ip -n $NS_R link set bench_r up
+    ip -n $NS_S link set lo up
+    ip -n $NS_R link set lo up
+
+    if [ -n "$1" ]; then
+        ip netns exec $NS_S tc qdisc add dev bench_s root netem $1 \
+            && ip netns exec $NS_R tc qdisc add dev bench_r root netem $1
+    fi
+}
+
+# Prefixes each line with the wall-clock time
+stamp() {
+    while IFS= read -r line; do
+        echo "$(date +%s.%N) $line"
+    done
+}
+
+head -c "$SIZE" /dev/urandom > "$work/in.bin"
+mb=$(awk -v size="$SIZE" 'BEGIN { print size / 1000000 }')
+
+echo "Transferring $SIZE bytes${BENCH_FLAGS:+ (sender options: $BENCH_FLAGS)}"
+printf "%-8s %10s %12s %12s %8s %8s %8s  %s\n" profile "goodput" "snd cpu/MB" "rcv cpu/MB" retrans resent ttfb result
+printf "%-8s %10s %12s %12s %8s %8s %8s\n" "" "(MB/s)" "(ms)" "(ms)" "" "" "(ms)"
+
+for profile in $selected; do
+    if ! setup_link "${PROFILES[$profile]}" 2> "$work/setup.log"; then
+        printf "%-8s %s\n" "$profile" "cannot emulate the link: $(head -n 1 "$work/setup.log") (is sch_netem available?)"
+        continue
+    fi
+
+    rm -rf "$work/r" && mkdir "$work/r"
+
+    # The receiver writes to its own directory; its processor time is reported by the time keyword
+    (
+        cd "$work/r" || exit
+        TIMEFORMAT="%U %S"
+        { time ip netns exec $NS_R timeout "$TIMEOUT" "$BIN" -l -o -v 2>&1; } 2> "$work/recv.cpu" | stamp > "$work/recv.log"
+    ) &
+    receiver=$!
+    sleep 0.5
+
+    start=$(date +%s.%N)
+    (
+        cd "$work" || exit
+        TIMEFORMAT="%R %U %S"
+        # shellcheck disable=SC2086
+        { time ip netns exec $NS_S timeout "$TIMEOUT" "$BIN" -r in.bin -s $ADDR_R -v $BENCH_FLAGS > send.log 2>&1; } 2> send.cpu
+    )
+    wait $receiver
+
+    if cmp -s "$work/in.bin" "$work/r/in.bin"; then
+        result=OK
+    else
+        result=FAILED
+    fi
+
+    read -r wall snd_user snd_sys < "$work/send.cpu"
+    read -r rcv_user rcv_sys < "$work/recv.cpu"
+    first=$(awk '/First data chunk received/ { print $1; exit }' "$work/recv.log")
+    retrans=$(sed -n 's/.*All chunks acknowledged (\([0-9]*\) retransmissions.*/\1/p' "$work/send.log" | awk '{ s += $1 } END { print s + 0 }')
+    resent=$(sed -n 's/.*Resending \([0-9]*\) chunks.*/\1/p' "$work/send.log" | awk '{ s += $1 } END { print s + 0 }')
+
+    awk -v profile="$profile" -v mb="$mb" -v wall="$wall" -v su="$snd_user" -v ss="$snd_sys" -v ru="$rcv_user" \
+        -v rs="$rcv_sys" -v retrans="$retrans" -v resent="$resent" -v start="$start" -v first="$first" \
+        -v result="$result" 'BEGIN {
+            ttfb = first == "" ? "-" : sprintf("%.0f", (first - start) * 1000)
+            printf "%-8s %10.2f %12.1f %12.1f %8d %8d %8s  %s\n", profile, mb / wall, (su + ss) * 1000 / mb,
+                   (ru + rs) * 1000 / mb, retrans, resent, ttfb, result
+        }'
+done
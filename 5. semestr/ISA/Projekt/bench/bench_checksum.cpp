@@ -0,0 +1,191 @@
+// bench_checksum.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+//
+// Compares the internet checksum implementations of checksum.cpp with the original routine (inet_checksum() before
+// it was replaced): first checks that all of them compute the same checksums for random data, lengths, alignments
+// and split sums (and that checksum_adjust() matches a full recomputation), then measures the time per buffer.
+//
+// Usage: make bench_checksum   (or bench/bench_checksum [cases])
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// The kernels are static, include them directly so that each of them can be measured
+#include "../checksum.cpp"
+
+/*
+ * The original routine.
+ * Author: P. D. Buchan (pdbuchan@yahoo.com)
+ * Source: https://www.pdbuchan.com/rawsock/icmp4.c
+ * Distributed under the GNU GPL.
+ */
+static uint16_t old_checksum(uint16_t *value, int len) {
+    int count = len;
+    uint32_t sum = 0;
+
+    while (count > 1) {
+        sum += *(value++);
+        count -= 2;
+    }
+
+    if (count > 0) {
+        sum += *(uint8_t *) value;
+    }
+
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return static_cast<uint16_t>(~sum);
+}
+
+/** A kernel to compare. */
+struct Kernel {
+    uint64_t (*sum)(const uint8_t *, size_t, uint64_t); /**< Sums the data. */
+    const char *name; /**< The name of the kernel. */
+};
+
+/** The largest ICMP payload, the longest buffer checked and measured. */
+static const size_t MAX_LEN = 65507;
+
+/** The buffer sizes measured: a small packet, a 1500 B packet's payload, a jumbo frame and the largest payload. */
+static const size_t BENCH_SIZES[] = {64, 1472, 9000, MAX_LEN};
+
+/**
+ * @return The kernels supported by this CPU.
+ */
+static std::vector<Kernel> kernels() {
+    std::vector<Kernel> result{{sum_scalar, "scalar"}};
+#if defined(__x86_64__)
+    result.push_back({sum_sse2, "SSE2"});
+    if (__builtin_cpu_supports("avx2")) {
+        result.push_back({sum_avx2, "AVX2"});
+    }
+#endif
+    return result;
+}
+
+/**
+ * Checks the kernels and checksum_adjust() against the original routine.
+ *
+ * @param [in] impls The kernels to check.
+ * @param [in] cases The number of random cases.
+ * @return The number of mismatches.
+ */
+static unsigned long verify(const std::vector<Kernel> &impls, unsigned long cases) {
+    std::mt19937_64 rng(1071);
+    // Extra space for the misalignment; the original routine reads 16-bit words, so it's given an aligned copy
+    std::vector<uint8_t> buffer(MAX_LEN + 64);
+    std::vector<uint16_t> aligned(MAX_LEN / 2 + 1);
+    unsigned long mismatches = 0;
+
+    for (unsigned long i = 0; i < cases; i++) {
+        // Mostly packet-sized lengths, sometimes up to the largest payload
+        size_t len = rng() % 4 == 0 ? rng() % (MAX_LEN + 1) : rng() % 2049;
+        size_t offset = rng() % 64;
+        uint8_t *data = buffer.data() + offset;
+        for (size_t j = 0; j < len; j++) {
+            data[j] = static_cast<uint8_t>(rng());
+        }
+
+        memcpy(aligned.data(), data, len);
+        auto expected = old_checksum(aligned.data(), static_cast<int>(len));
+
+        // All parts except the last one must have an even length
+        size_t split = len == 0 ? 0 : (rng() % (len + 1)) & ~size_t(1);
+        for (const auto &kernel: impls) {
+            auto whole = checksum_fold(kernel.sum(data, len, 0));
+            auto parts = checksum_fold(kernel.sum(data + split, len - split, kernel.sum(data, split, 0)));
+            if (whole != expected || parts != expected) {
+                fprintf(stderr, "%s: length %zu, offset %zu, split %zu: %04x/%04x, expected %04x\n", kernel.name,
+                        len, offset, split, whole, parts, expected);
+                mismatches++;
+            }
+        }
+
+        if (len >= 2) {
+            size_t word_pos = (rng() % (len / 2)) * 2;
+            uint16_t old_word, new_word = static_cast<uint16_t>(rng());
+            memcpy(&old_word, data + word_pos, sizeof(uint16_t));
+            memcpy(data + word_pos, &new_word, sizeof(uint16_t));
+
+            auto adjusted = checksum_adjust(expected, old_word, new_word);
+            auto recomputed = checksum_fold(checksum_add(data, len));
+            if (adjusted != recomputed) {
+                fprintf(stderr, "checksum_adjust: length %zu, word at %zu: %04x, expected %04x\n", len, word_pos,
+                        adjusted, recomputed);
+                mismatches++;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+/**
+ * Measures the time a function takes to checksum a buffer.
+ *
+ * @param [in] len Length of the buffer.
+ * @param [in] checksum Computes the checksum of the buffer.
+ * @return Nanoseconds per buffer (the best of several runs).
+ */
+template<typename F>
+static double measure(size_t len, F checksum) {
+    // Roughly 256 MB per run, at least a thousand iterations
+    size_t iterations = std::max<size_t>(1000, (256u << 20) / len);
+    volatile uint16_t sink = 0;
+    double best = 0;
+
+    for (int run = 0; run < 5; run++) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            sink = sink + checksum();
+        }
+
+        auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        auto per_buffer = elapsed / static_cast<double>(iterations);
+        if (run == 0 || per_buffer < best) {
+            best = per_buffer;
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long cases = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+    auto impls = kernels();
+
+    auto mismatches = verify(impls, cases);
+    printf("Checked %lu random cases: %lu mismatches\n\n", cases, mismatches);
+
+    std::vector<uint16_t> buffer(MAX_LEN / 2 + 1);
+    std::mt19937 rng(1624);
+    for (auto &word: buffer) {
+        word = static_cast<uint16_t>(rng());
+    }
+
+    auto data = reinterpret_cast<const uint8_t *>(buffer.data());
+    printf("%-10s %12s", "size", "old");
+    for (const auto &kernel: impls) {
+        printf(" %12s", kernel.name);
+    }
+    printf("\n");
+
+    for (auto len: BENCH_SIZES) {
+        printf("%-10zu %9.1f ns", len, measure(len, [&]() {
+            return old_checksum(buffer.data(), static_cast<int>(len));
+        }));
+
+        for (const auto &kernel: impls) {
+            printf(" %9.1f ns", measure(len, [&]() { return checksum_fold(kernel.sum(data, len, 0)); }));
+        }
+        printf("\n");
+    }
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,12 +1,15 @@
 // channel.cpp
 // Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
 
+#include <algorithm>
 #include <poll.h>
 #include <unistd.h>
 
+#include "common.h"
 #include "errors.h"
 #include "utils.h"
 #include "channel.h"
+#include "packet_utils.h"
 
 using std::string;
 
@@ -54,8 +57,8 @@ Channel::Channel(sockaddr *dst, sockaddr *src, const string &if_name, unsigned i
     fill_address_data(dst, src);
 }
 
-Channel::Channel(sockaddr *dst, sockaddr *src, int socket_fd)
-        : dst_addr(), src_addr(), addr_len() {
+Channel::Channel(sockaddr *dst, sockaddr *src, int socket_fd, bool owns_socket)
+        : dst_addr(), src_addr(), addr_len(), owns_socket(owns_socket) {
     this->socket_fd = socket_fd;
 
     if (src->sa_family == AF_INET) {
@@ -81,7 +84,7 @@ void Channel::set_receive_timeout(unsigned int timeout_ms) {
 }
 
 Channel::~Channel() {
-    if (socket_fd >= 0) {
+    if (owns_socket && socket_fd >= 0) {
         close(socket_fd);
         socket_fd = -1;
     }
@@ -100,6 +103,94 @@ ssize_t Channel::sendto_poll(const void *buf, size_t size, int flags) const {
     return ::sendto(socket_fd, buf, size, flags, &dst_addr.sock, addr_len);
 }
 
+bool Channel::poll_in(int64_t timeout_us) const {
+    pollfd poll_opts[1] = {{.fd = socket_fd, .events = POLLIN, .revents = 0}};
+    timespec timeout{.tv_sec = timeout_us / 1000000, .tv_nsec = (timeout_us % 1000000) * 1000};
+    int res = ppoll(poll_opts, 1, timeout_us < 0 ? nullptr : &timeout, nullptr);
+    if (res == -1) {
+        if (errno == EINTR) {
+            return false;
+        }
+
+        THROW_ERRNO();
+    }
+
+    return res > 0;
+}
+
+int Channel::send_batch(SendBatch &batch, int flags) const {
+    unsigned int sent = 0;
+    useconds_t backoff_us = S_NOBUFS_BACKOFF_US;
+    batch.queue_full = 0;
+
+    while (sent < batch.count) {
+        pollfd poll_opts[1] = {{.fd = socket_fd, .events = POLLOUT, .revents = 0}};
+        if (poll(poll_opts, 1, -1) == -1) {
+            THROW_ERRNO();
+        }
+
+        for (unsigned int i = sent; i < batch.count; i++) {
+            batch.messages[i].msg_hdr.msg_name = const_cast<sockaddr *>(&dst_addr.sock);
+            batch.messages[i].msg_hdr.msg_namelen = addr_len;
+        }
+
+        int res = sendmmsg(socket_fd, batch.messages.data() + sent, batch.count - sent, flags);
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+
+            // The socket stays writable while the queue of the interface is full, poll() would return immediately
+            if (errno == ENOBUFS) {
+                if (batch.queue_full == 0) {
+                    batch.queue_full = batch.count - sent;
+                }
+                usleep(backoff_us);
+                backoff_us = std::min<useconds_t>(2 * backoff_us, S_NOBUFS_BACKOFF_MAX_US);
+                continue;
+            }
+
+            return -1;
+        }
+
+        backoff_us = S_NOBUFS_BACKOFF_US;
+        sent += res;
+    }
+
+    return static_cast<int>(sent);
+}
+
+int Channel::recv_batch(RecvBatch &batch, int flags) const {
+    auto capacity = static_cast<unsigned int>(batch.messages.size());
+
+    for (unsigned int i = 0; i < capacity; i++) {
+        auto &hdr = batch.messages[i].msg_hdr;
+        hdr.msg_name = &batch.results[i].address.sock;
+        hdr.msg_namelen = sizeof(AnyIPAddress);
+        hdr.msg_iov = &batch.iovecs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = nullptr;
+        hdr.msg_controllen = 0;
+        hdr.msg_flags = 0;
+    }
+
+    int res = recvmmsg(socket_fd, batch.messages.data(), capacity, flags | MSG_WAITFORONE, nullptr);
+    if (res == -1) {
+        batch.count = 0;
+        return -1;
+    }
+
+    batch.count = res;
+    for (int i = 0; i < res; i++) {
+        RecvResult &result = batch.results[i];
+        result.size = batch.messages[i].msg_len;
+        result.address_len = batch.messages[i].msg_hdr.msg_namelen;
+        result.is_channel_address = sockaddr_eq(&dst_addr.sock, &result.address.sock);
+    }
+
+    return res;
+}
+
 ssize_t Channel::recvfrom(void *buf, size_t size, int flags, AnyIPAddress &recv_addr, socklen_t &recv_addr_len) const {
     return ::recvfrom(socket_fd, buf, size, flags, &recv_addr.sock, &recv_addr_len);
 }
@@ -115,6 +206,49 @@ RecvResult Channel::recvfrom(void *buf, size_t size, int flags) const {
     return result;
 }
 
+void set_receive_buffer_size(int socket_fd, int size) {
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == -1
+        && setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1) {
+        log_warn("Cannot set the socket receive buffer size");
+    }
+}
+
+void SendBatch::add(const void *packet, size_t len) {
+    iovecs[2 * count] = {.iov_base = const_cast<void *>(packet), .iov_len = len};
+
+    msghdr &hdr = messages[count].msg_hdr;
+    hdr = {};
+    hdr.msg_iov = &iovecs[2 * count];
+    hdr.msg_iovlen = 1;
+
+    count++;
+}
+
+void SendBatch::add(const void *header, size_t header_len, const void *data, size_t data_len) {
+    iovecs[2 * count] = {.iov_base = const_cast<void *>(header), .iov_len = header_len};
+    iovecs[2 * count + 1] = {.iov_base = const_cast<void *>(data), .iov_len = data_len};
+
+    msghdr &hdr = messages[count].msg_hdr;
+    hdr = {};
+    hdr.msg_iov = &iovecs[2 * count];
+    hdr.msg_iovlen = 2;
+
+    count++;
+}
+
+RecvBatch::RecvBatch(unsigned int capacity, size_t buffer_size)
+        : messages(capacity), iovecs(capacity), results(capacity), buffer_size(buffer_size) {
+    buffers = new uint8_t[capacity * buffer_size];
+
+    for (unsigned int i = 0; i < capacity; i++) {
+        iovecs[i] = {.iov_base = buffer(i), .iov_len = buffer_size};
+    }
+}
+
+RecvBatch::~RecvBatch() {
+    delete[] buffers;
+}
+
 void Channel::fill_address_data(sockaddr *dst, sockaddr *src) {
     if (src->sa_family == AF_INET) {
         in_addr src_addr_p = reinterpret_cast<sockaddr_in *>(src)->sin_addr;
@@ -141,4 +275,6 @@ void Channel::fill_address_data(sockaddr *dst, sockaddr *src) {
 
         addr_len = sizeof(sockaddr_in6);
     }
+
+    make_echo_header_template(header_template, &dst_addr.sock, &src_addr.sock);
 }
@@ -6,6 +6,10 @@
 #define ISA_CHANNEL_H
 
 #include <netdb.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "utils.h"
 
 union AnyIPAddress {
     sa_family_t family;
@@ -26,11 +30,93 @@ struct RecvResult {
     [[nodiscard]] bool success() const { return size != -1; }
 };
 
+/**
+ * Prebuilt headers of the Echo Request packets sent through a Channel. Only the fields that differ between packets
+ * are filled in when a packet is sent (see make_echo_header()).
+ */
+struct EchoHeaderTemplate {
+    /** The IPv4 header (only in IPv4) followed by the ICMP(v6) Echo Request header. */
+    uint8_t data[IP4_HEADER_LEN + ICMP_HEADER_LEN];
+    uint8_t len; /**< Length of the headers. */
+    uint16_t ip_checksum; /**< The IPv4 header checksum computed with a zero Total Length. */
+};
+
+/**
+ * A batch of packets to send using a single sendmmsg() call.
+ * The batch only stores pointers to the packet data; the data must be valid until the batch is sent.
+ */
+struct SendBatch {
+    /**
+     * Creates an empty SendBatch.
+     * @param [in] capacity The maximum number of packets in the batch.
+     */
+    explicit SendBatch(unsigned int capacity) : messages(capacity), iovecs(2 * capacity) {}
+
+    /**
+     * Adds a packet to the batch.
+     * @param [in] packet A pointer to the packet data.
+     * @param [in] len Length of the packet data.
+     */
+    void add(const void *packet, size_t len);
+
+    /**
+     * Adds a packet consisting of two separate parts to the batch (the parts are gathered by the kernel,
+     * they aren't copied to a single buffer).
+     * @param [in] header A pointer to the packet headers.
+     * @param [in] header_len Length of the packet headers.
+     * @param [in] data A pointer to the packet data that follow the headers.
+     * @param [in] data_len Length of the packet data.
+     */
+    void add(const void *header, size_t header_len, const void *data, size_t data_len);
+
+    [[nodiscard]] bool full() const { return count == messages.size(); }
+
+    [[nodiscard]] unsigned int size() const { return count; }
+
+    void clear() { count = 0; }
+
+    std::vector<mmsghdr> messages; /**< Message headers for sendmmsg(). */
+    std::vector<iovec> iovecs; /**< Packet data descriptors referenced by the message headers (two per packet). */
+    unsigned int count = 0; /**< Number of packets in the batch. */
+    /** Number of packets of the last send_batch() that had to wait because the interface's output queue was full. */
+    unsigned int queue_full = 0;
+};
+
+/**
+ * Buffers for receiving a batch of packets using a single recvmmsg() call.
+ */
+struct RecvBatch {
+    /**
+     * Allocates buffers for a RecvBatch.
+     * @param [in] capacity The maximum number of packets to receive at once.
+     * @param [in] buffer_size The size of the buffer for each packet.
+     */
+    RecvBatch(unsigned int capacity, size_t buffer_size);
+
+    ~RecvBatch();
+
+    RecvBatch(const RecvBatch &) = delete;
+
+    RecvBatch &operator=(const RecvBatch &) = delete;
+
+    /** @return A pointer to the buffer that holds the i-th received packet. */
+    [[nodiscard]] uint8_t *buffer(unsigned int i) const { return buffers + i * buffer_size; }
+
+    std::vector<mmsghdr> messages; /**< Message headers for recvmmsg(). */
+    std::vector<iovec> iovecs; /**< Buffer descriptors referenced by the message headers. */
+    std::vector<RecvResult> results; /**< Results for the received packets (valid for the first @a count items). */
+    uint8_t *buffers; /**< Memory for all the packet buffers. */
+    size_t buffer_size; /**< The size of the buffer for one packet. */
+    unsigned int count = 0; /**< Number of packets received by the last call of Channel::recv_batch(). */
+};
+
 struct Channel {
     int socket_fd; /**< File descriptor of the open RAW/ICMP socket. */
     union AnyIPAddress dst_addr; /**< Describes the destination IP address. */
     union AnyIPAddress src_addr; /**< Describes the source (interface) IP address. */
     socklen_t addr_len; /**< The length of the addresses in bytes. */
+    bool owns_socket = true; /**< If true, the socket is closed when the Channel is destroyed. */
+    EchoHeaderTemplate header_template{}; /**< Prebuilt headers of the packets sent to the destination. */
 
     /**
      * Opens a socket for communicating on the ICMP(v6) over IPv4 or IPv6, based on the family specified in
@@ -49,8 +135,10 @@ struct Channel {
      * @param [in] dst A pointer to a sockaddr that contains the destination IP address.
      * @param [in] src A pointer to a sockaddr that contains the source (interface) IP address.
      * @param socket_fd The socket file descriptor.
+     * @param owns_socket If false, the socket is not closed when the Channel is destroyed (it may be shared by
+     * multiple Channels).
      */
-    Channel(sockaddr *dst, sockaddr *src, int socket_fd);
+    Channel(sockaddr *dst, sockaddr *src, int socket_fd, bool owns_socket = true);
 
     /**
      * Sets the receive timeout for the socket (modified the SO_RCVTIMEO option).
@@ -69,6 +157,17 @@ struct Channel {
      */
     ssize_t sendto_poll(const void *buf, size_t size, int flags) const;
 
+    /**
+     * Waits until the socket is ready to send data, then sends all packets in a batch to the destination address
+     * of this Channel. Uses as few sendmmsg() calls as possible (usually one).
+     * @remark poll() is used to wait for the POLLOUT event. When the output queue of the interface is full (ENOBUFS,
+     * POLLOUT doesn't wait for it), sleeps with an exponential backoff and counts the waiting packets in SendBatch::queue_full.
+     * @param [in] batch The batch of packets to send.
+     * @param [in] flags sendmmsg() flags.
+     * @return Returns the number of packets sent, or -1 for errors.
+     */
+    int send_batch(SendBatch &batch, int flags) const;
+
     /**
      * Sends data from an input buffer to the destination address of this Channel.
      * @param [in] buf The input buffer.
@@ -103,7 +202,25 @@ struct Channel {
     RecvResult recvfrom(void *buf, size_t size, int flags) const;
 
     /**
-     * Closes the socket descriptor associated with this Channel.
+     * Receives a batch of packets from the socket's receive buffer using a single recvmmsg() call.
+     * Waits (at most for the socket's receive timeout) for the first packet, the following ones are only received
+     * if they are already waiting in the receive buffer. Checks if the received addresses match the destination
+     * address of this channel.
+     * @param [in,out] batch The batch to receive the packets to. Its @a count and @a results are updated.
+     * @param [in] flags recvmmsg() flags (MSG_WAITFORONE is always added).
+     * @return Returns the number of received packets; or -1 for errors.
+     */
+    int recv_batch(RecvBatch &batch, int flags) const;
+
+    /**
+     * Waits until there is data to read from the socket.
+     * @param [in] timeout_us Maximum time to wait in microseconds. Negative value means infinite timeout.
+     * @return True if data can be read from the socket; false if the timeout expired.
+     */
+    bool poll_in(int64_t timeout_us) const;
+
+    /**
+     * Closes the socket descriptor associated with this Channel (unless it doesn't own it).
      */
     ~Channel();
 
@@ -116,4 +233,12 @@ private:
     void fill_address_data(sockaddr *dst, sockaddr *src);
 };
 
+/**
+ * Sets the size of a socket's receive buffer (the SO_RCVBUF option). Attempts to exceed the system limit
+ * using SO_RCVBUFFORCE first (this requires the CAP_NET_ADMIN capability).
+ * @param [in] socket_fd The socket file descriptor.
+ * @param [in] size The requested size in bytes.
+ */
+void set_receive_buffer_size(int socket_fd, int size);
+
 #endif //ISA_CHANNEL_H
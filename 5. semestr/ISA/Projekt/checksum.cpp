@@ -0,0 +1,135 @@
+// checksum.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "checksum.h"
+
+/**
+ * Sums the data as 32-bit words (and the remaining bytes) into a 64-bit accumulator.
+ */
+static uint64_t sum_scalar(const uint8_t *data, size_t len, uint64_t sum) {
+    while (len >= 16) {
+        uint32_t words[4];
+        memcpy(words, data, sizeof(words));
+        sum += uint64_t(words[0]) + words[1] + words[2] + words[3];
+        data += 16;
+        len -= 16;
+    }
+
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        uint16_t word;
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += 2;
+        len -= 2;
+    }
+
+    if (len > 0) {
+        // The left-over byte is padded with a zero byte (in the memory order)
+        uint16_t word = 0;
+        memcpy(&word, data, 1);
+        sum += word;
+    }
+
+    return sum;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * Sums 32 bytes at a time: the 32-bit words are zero-extended to 64 bits and added to two accumulators.
+ */
+static uint64_t sum_sse2(const uint8_t *data, size_t len, uint64_t sum) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc_a = _mm_setzero_si128();
+    __m128i acc_b = _mm_setzero_si128();
+
+    while (len >= 32) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16));
+        acc_a = _mm_add_epi64(acc_a, _mm_unpacklo_epi32(a, zero));
+        acc_b = _mm_add_epi64(acc_b, _mm_unpackhi_epi32(a, zero));
+        acc_a = _mm_add_epi64(acc_a, _mm_unpacklo_epi32(b, zero));
+        acc_b = _mm_add_epi64(acc_b, _mm_unpackhi_epi32(b, zero));
+        data += 32;
+        len -= 32;
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_add_epi64(acc_a, acc_b));
+    return sum_scalar(data, len, sum + lanes[0] + lanes[1]);
+}
+
+/**
+ * Sums 64 bytes at a time in the same way as sum_sse2(), using 256-bit accumulators.
+ */
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *data, size_t len, uint64_t sum) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc_a = _mm256_setzero_si256();
+    __m256i acc_b = _mm256_setzero_si256();
+
+    while (len >= 64) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32));
+        acc_a = _mm256_add_epi64(acc_a, _mm256_unpacklo_epi32(a, zero));
+        acc_b = _mm256_add_epi64(acc_b, _mm256_unpackhi_epi32(a, zero));
+        acc_a = _mm256_add_epi64(acc_a, _mm256_unpacklo_epi32(b, zero));
+        acc_b = _mm256_add_epi64(acc_b, _mm256_unpackhi_epi32(b, zero));
+        data += 64;
+        len -= 64;
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), _mm256_add_epi64(acc_a, acc_b));
+    return sum_sse2(data, len, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+#endif
+
+/** A checksum implementation. */
+struct ChecksumImpl {
+    uint64_t (*sum)(const uint8_t *, size_t, uint64_t); /**< Sums the data. */
+    const char *name; /**< The name of the implementation. */
+};
+
+/**
+ * @return The fastest implementation supported by the CPU (decided on the first call).
+ */
+static const ChecksumImpl &impl() {
+    static const ChecksumImpl chosen = []() {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) {
+            return ChecksumImpl{sum_avx2, "AVX2"};
+        }
+
+        // SSE2 is always available on x86-64
+        return ChecksumImpl{sum_sse2, "SSE2"};
+#else
+        return ChecksumImpl{sum_scalar, "scalar"};
+#endif
+    }();
+
+    return chosen;
+}
+
+uint64_t checksum_add(const void *data, size_t len, uint64_t sum) {
+    return impl().sum(static_cast<const uint8_t *>(data), len, sum);
+}
+
+const char *checksum_impl_name() {
+    return impl().name;
+}
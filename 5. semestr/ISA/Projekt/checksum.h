@@ -0,0 +1,64 @@
+// checksum.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_CHECKSUM_H
+#define ISA_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * The internet checksum (RFC 1071) is the one's complement of the one's complement sum of the 16-bit words
+ * of the data. The sum doesn't depend on the byte order and it can be computed over wider words, as long as the carries
+ * are added back when folding the sum to 16 bits. The data are summed as 32-bit words into a 64-bit accumulator
+ * (using SSE2 or AVX2 when the CPU supports it; the implementation is chosen at runtime). The accumulator cannot
+ * overflow for any data shorter than 16 GiB.
+ */
+
+/**
+ * Adds data to a partial internet checksum sum.
+ *
+ * @param [in] data The data.
+ * @param [in] len Length of the data in bytes. All parts except the last one must have an even length.
+ * @param [in] sum The partial sum of the previous parts of the data.
+ * @return The partial sum (not folded).
+ */
+uint64_t checksum_add(const void *data, size_t len, uint64_t sum = 0);
+
+/**
+ * Folds a partial sum to 16 bits and complements it.
+ *
+ * @param [in] sum The partial sum.
+ * @return The internet checksum (in network byte order when the data were in network byte order).
+ */
+inline uint16_t checksum_fold(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+}
+
+/**
+ * Updates a checksum after a 16-bit word of the data has changed, without summing the data again
+ * (RFC 1624, equation 3: HC' = ~(~HC + ~m + m')).
+ *
+ * @param [in] checksum The checksum of the original data.
+ * @param [in] old_word The original value of the word (as it's stored in the data).
+ * @param [in] new_word The new value of the word (as it's stored in the data).
+ * @return The checksum of the updated data.
+ */
+inline uint16_t checksum_adjust(uint16_t checksum, uint16_t old_word, uint16_t new_word) {
+    uint32_t sum = static_cast<uint16_t>(~checksum) + static_cast<uint16_t>(~old_word) + new_word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+}
+
+/**
+ * @return The name of the checksum implementation chosen for this CPU.
+ */
+const char *checksum_impl_name();
+
+#endif //ISA_CHECKSUM_H
@@ -0,0 +1,169 @@
+// chunk_tracker.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+
+#include "chunk_tracker.h"
+
+bool ChunkTracker::mark(uint64_t index) {
+    auto word = index / 64;
+    auto bit = uint64_t(1) << (index % 64);
+
+    if (word >= bits.size()) {
+        bits.resize(std::max<size_t>(word + 1, bits.size() * 2), 0);
+    }
+
+    if (bits[word] & bit) {
+        return false;
+    }
+
+    bits[word] |= bit;
+    marked_count++;
+    seen_count = std::max(seen_count, index + 1);
+    return true;
+}
+
+bool ChunkTracker::received(uint64_t index) const {
+    auto word = index / 64;
+    return word < bits.size() && (bits[word] & (uint64_t(1) << (index % 64))) != 0;
+}
+
+void ChunkTracker::restore(std::vector<uint64_t> words) {
+    bits = std::move(words);
+    marked_count = 0;
+    seen_count = 0;
+
+    for (size_t word = 0; word < bits.size(); word++) {
+        if (bits[word] != 0) {
+            marked_count += __builtin_popcountll(bits[word]);
+            seen_count = word * 64 + (64 - __builtin_clzll(bits[word]));
+        }
+    }
+}
+
+std::vector<ChunkRange> ChunkTracker::missing_ranges(uint64_t limit, size_t max_ranges) const {
+    std::vector<ChunkRange> ranges;
+    uint64_t index = 0;
+
+    while (index < limit && ranges.size() < max_ranges) {
+        // Find the next missing chunk, skipping whole words of received chunks
+        while (index < limit && received(index)) {
+            if (index % 64 == 0 && index / 64 < bits.size() && bits[index / 64] == UINT64_MAX) {
+                index += 64;
+            } else {
+                index++;
+            }
+        }
+
+        if (index >= limit) {
+            break;
+        }
+
+        // Find the end of the gap, skipping whole words of missing chunks
+        uint64_t first = index;
+        while (index < limit && !received(index)) {
+            if (index % 64 == 0 && (index / 64 >= bits.size() || bits[index / 64] == 0)) {
+                index += 64;
+            } else {
+                index++;
+            }
+        }
+
+        index = std::min(index, limit);
+        ranges.push_back(ChunkRange{first, index - first});
+    }
+
+    return ranges;
+}
+
+/**
+ * Writes a variable-length integer.
+ * @return The number of bytes written; zero if it doesn't fit.
+ */
+static size_t put_varint(uint64_t value, uint8_t *dest, size_t capacity) {
+    size_t len = 0;
+    do {
+        if (len == capacity) {
+            return 0;
+        }
+
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        dest[len++] = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+
+    return len;
+}
+
+/**
+ * Reads a variable-length integer.
+ * @return False if the data end before the integer does or if it's longer than 64 bits.
+ */
+static bool get_varint(const uint8_t *data, size_t data_len, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (pos >= data_len) {
+            return false;
+        }
+
+        uint8_t byte = data[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t encode_ranges(const std::vector<ChunkRange> &ranges, size_t from, uint8_t *dest, size_t capacity,
+                     size_t &dest_len) {
+    uint64_t prev_end = 0;
+    dest_len = 0;
+
+    size_t i;
+    for (i = from; i < ranges.size(); i++) {
+        // The first range in a message is relative to zero so that the messages can be decoded independently
+        auto gap_len = put_varint(ranges[i].first - prev_end, dest + dest_len, capacity - dest_len);
+        if (gap_len == 0) {
+            break;
+        }
+
+        auto count_len = put_varint(ranges[i].count, dest + dest_len + gap_len, capacity - dest_len - gap_len);
+        if (count_len == 0) {
+            break;
+        }
+
+        dest_len += gap_len + count_len;
+        prev_end = ranges[i].first + ranges[i].count;
+    }
+
+    return i;
+}
+
+bool decode_ranges(const uint8_t *data, size_t data_len, uint64_t limit, std::vector<ChunkRange> &ranges) {
+    uint64_t prev_end = 0;
+    size_t pos = 0;
+
+    while (pos < data_len) {
+        uint64_t gap, count;
+        if (!get_varint(data, data_len, pos, gap) || !get_varint(data, data_len, pos, count)) {
+            return false;
+        }
+
+        if (gap > limit - prev_end) {
+            // Starts above the limit (compared this way so that it cannot overflow)
+            return true;
+        }
+
+        uint64_t first = prev_end + gap;
+        count = std::min(count, limit - first);
+        if (count > 0) {
+            ranges.push_back(ChunkRange{first, count});
+        }
+
+        prev_end = first + count;
+    }
+
+    return true;
+}
@@ -0,0 +1,115 @@
+// chunk_tracker.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_CHUNK_TRACKER_H
+#define ISA_CHUNK_TRACKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * A range of chunk indices.
+ */
+struct ChunkRange {
+    uint64_t first; /**< The first index in the range. */
+    uint64_t count; /**< The number of indices in the range. */
+};
+
+/**
+ * Keeps track of the received chunks using a bitmap indexed by the chunk index. Marking and checking a chunk
+ * is O(1); the missing chunks are reported as ranges.
+ */
+class ChunkTracker {
+public:
+    /**
+     * Marks a chunk as received.
+     *
+     * @param [in] index The chunk index.
+     * @return True if the chunk hasn't been received before.
+     */
+    bool mark(uint64_t index);
+
+    /**
+     * @param [in] index The chunk index.
+     * @return True if the chunk has been received.
+     */
+    [[nodiscard]] bool received(uint64_t index) const;
+
+    /**
+     * Sets the total number of chunks (when the sender announces it).
+     *
+     * @param [in] count The number of chunks.
+     */
+    void expect(uint64_t count) {
+        expected_count = count;
+        has_expected = true;
+    }
+
+    /** @return True if the total number of chunks is known. */
+    [[nodiscard]] bool expected_known() const { return has_expected; }
+
+    /** @return The total number of chunks announced by the sender. */
+    [[nodiscard]] uint64_t expected() const { return expected_count; }
+
+    /** @return The number of chunks up to and including the highest received one. */
+    [[nodiscard]] uint64_t seen() const { return seen_count; }
+
+    /** @return The number of received chunks. */
+    [[nodiscard]] uint64_t received_count() const { return marked_count; }
+
+    /**
+     * Finds the chunks below a limit that haven't been received.
+     *
+     * @param [in] limit The number of chunks to check (the indices 0 to limit - 1).
+     * @param [in] max_ranges The maximum number of ranges to return.
+     * @return The missing ranges in ascending order.
+     */
+    [[nodiscard]] std::vector<ChunkRange> missing_ranges(uint64_t limit, size_t max_ranges) const;
+
+    /** @return The bitmap (see TransferJournal). */
+    [[nodiscard]] const std::vector<uint64_t> &words() const { return bits; }
+
+    /**
+     * Replaces the received chunks with a saved bitmap (see TransferJournal). The announced total is kept.
+     *
+     * @param [in] words The bitmap returned by words().
+     */
+    void restore(std::vector<uint64_t> words);
+
+private:
+    std::vector<uint64_t> bits; /**< The bitmap; bit i of word w describes the chunk 64 * w + i. */
+    uint64_t marked_count = 0; /**< The number of received chunks. */
+    uint64_t seen_count = 0; /**< The highest received index + 1. */
+    uint64_t expected_count = 0; /**< The total number of chunks announced by the sender. */
+    bool has_expected = false; /**< Signalises if the total number of chunks is known. */
+};
+
+/**
+ * Encodes ranges for a 'Request Resend Ranges' protocol message. Each range is encoded as two variable-length
+ * integers (7 bits per byte, the most significant bit signalises a following byte): the distance of its first index
+ * from the end of the previous range (or from zero) and its length.
+ *
+ * @param [in] ranges The ranges in ascending order, not overlapping.
+ * @param [in] from The index of the first range to encode.
+ * @param [out] dest A buffer to save the encoded ranges to.
+ * @param [in] capacity Size of the buffer.
+ * @param [out] dest_len The number of bytes written.
+ * @return The index of the first range that hasn't been encoded (because it doesn't fit).
+ */
+size_t encode_ranges(const std::vector<ChunkRange> &ranges, size_t from, uint8_t *dest, size_t capacity,
+                     size_t &dest_len);
+
+/**
+ * Decodes the ranges encoded by encode_ranges().
+ *
+ * @param [in] data The encoded ranges.
+ * @param [in] data_len Length of the encoded ranges.
+ * @param [in] limit The number of valid indices; the parts of the ranges above it are dropped.
+ * @param [out] ranges A vector to append the decoded ranges to.
+ * @return False if the data are malformed.
+ */
+bool decode_ranges(const uint8_t *data, size_t data_len, uint64_t limit, std::vector<ChunkRange> &ranges);
+
+#endif //ISA_CHUNK_TRACKER_H
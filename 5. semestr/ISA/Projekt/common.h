@@ -35,6 +35,22 @@ enum TransmissionMode {
  */
 #define CRYPTO_KEY_DERIVATION_ITERATIONS 2048
 
+/** The number of keys derived from passwords kept in memory (see KeyCache). */
+#define CRYPTO_KEY_CACHE_SIZE 64
+
+/** The PBKDF2 salt for the master key of protocol version 2 (the per-transfer keys are derived from it). */
+#define CRYPTO_MASTER_KEY_SALT "xondry02 secret v2"
+
+/**
+ * The length of the random salt of a transfer (sent in 'Hello' in protocol version 4), from which the keys
+ * of the transfer are derived (see ChunkCrypto).
+ */
+#define CRYPTO_TRANSFER_SALT_LEN 16
+
+/** Length of the nonce (4 zero bytes, 8 B of chunk index) and of the authentication tag of a chunk (ChunkCrypto). */
+#define CRYPTO_NONCE_LEN 12
+#define CRYPTO_TAG_LEN 16
+
 /**
  * The initial (maximum) value for maximum packet size search.
  */
@@ -46,20 +62,87 @@ enum TransmissionMode {
  */
 #define MPS_SEARCH_THRESHOLD 8
 
-/** Time to wait for a ping reply when finding the maximum packet size. */
+/** Time to wait for the ping replies in one round of the maximum packet size search. */
 #define MPS_RECV_TIMEOUT_MS 500
 
+/**
+ * Packet sizes probed in the first round of the maximum packet size search (together with STARTING_MPS): the path MTUs
+ * commonly found on the Internet (PPPoE, tunnels, the IPv6 minimum, the IPv4 minimum reassembly size).
+ */
+#define MPS_PROBE_LADDER {1492, 1480, 1460, 1420, 1400, 1280, 1024, 576}
+
+/** The number of packet sizes probed at once in the following rounds of the maximum packet size search. */
+#define MPS_PROBE_COUNT 16
+
+/**
+ * The number of seconds a discovered maximum packet size is cached for (see MPSCache). Zero disables the cache.
+ */
+#define MPS_CACHE_TTL_S 600
+
+/** The name of the maximum packet size cache file in the user's cache directory. */
+#define MPS_CACHE_FILE_NAME "secret_mps"
+
+/** The maximum number of entries in the maximum packet size cache. */
+#define MPS_CACHE_MAX_ENTRIES 64
+
+/**
+ * Size of the socket receive buffers in bytes. On the receiver side, it should be able to hold the chunks in flight
+ * (the sender's window, see S_WINDOW_MAX). On the sender side, it holds the Echo Replies.
+ */
+#define SOCKET_BUFFER_SIZE (8 * 1024 * 1024)
+
+/** The maximum number of packets sent or received using a single sendmmsg() or recvmmsg() call. */
+#define BATCH_SIZE 32
+
 /** Default encryption password (key) to use if the user doesn't specify a custom one. */
 #define DEFAULT_PASSWORD "xondry02"
 
 /* ------ Sender options ------ */
 
-/** When set to 1, sender will wait for the Echo Reply message for each sent chunk. */
-#define S_WAIT_FOR_DATA_REPLIES 0
+/**
+ * When set to 1, the sender keeps a sliding window of chunks in flight. The chunks are acknowledged by the Echo Reply
+ * messages generated by the receiver's system and retransmitted when no reply arrives in time.
+ * When set to 0 (or when no Echo Replies arrive at all), the chunks are sent blindly, with the delays specified below.
+ */
+#define S_WINDOW_MODE 1
+
+/** The initial, minimal and maximal number of chunks in flight. */
+#define S_WINDOW_INITIAL 16
+#define S_WINDOW_MIN 2
+#define S_WINDOW_MAX 4096
 
 /**
- * The sender will insert a delay of S_DELAY_US microseconds after each S_DELAY_AFTER_SENT_CHUNKS
- * sent chunks. Set to 0 to disable this behaviour. */
+ * The congestion window stops growing when the smoothed round-trip time exceeds the lowest measured one
+ * S_WINDOW_RTT_INFLATION times plus S_WINDOW_RTT_SLACK_US microseconds.
+ */
+#define S_WINDOW_RTT_INFLATION 2
+#define S_WINDOW_RTT_SLACK_US 5000
+
+/** The initial, minimal and maximal retransmission timeout in microseconds. */
+#define S_RTO_INITIAL_US 250000
+#define S_RTO_MIN_US 10000
+#define S_RTO_MAX_US 2000000
+
+/** The number of transmissions of a chunk after which the sender gives up and leaves it to the resend protocol. */
+#define S_MAX_TRANSMISSIONS 8
+
+/**
+ * The number of expired retransmission timers after which the sender switches to blind sending
+ * if no Echo Reply has been received at all (e.g. when the receiver's system ignores Echo Requests).
+ */
+#define S_WINDOW_NO_REPLY_LIMIT 32
+
+/**
+ * The number of consecutive chunks lost (with no acknowledgement in between) after which the sender probes
+ * the maximum packet size again in the background, as the path MTU may have dropped.
+ */
+#define S_MPS_REPROBE_LOSSES 64
+
+/**
+ * In the fixed pacing mode (RATE_FIXED), the sender will insert a delay of S_DELAY_US microseconds after each
+ * S_DELAY_AFTER_SENT_CHUNKS sent chunks. Set to 0 to disable this behaviour.
+ * In the adaptive mode (RATE_AIMD), these values determine the initial sending rate (unless specified by the user).
+ */
 #define S_DELAY_AFTER_SENT_CHUNKS 16
 #define S_DELAY_US 1000
 
@@ -67,12 +150,82 @@ enum TransmissionMode {
 #define S_RESEND_DELAY_AFTER_SENT_CHUNKS 1
 #define S_RESEND_DELAY_US 1000
 
-/** Time in microseconds to wait before sending an 'All Data Sent' packet. */
+/** The minimal sending rate of the adaptive rate control in bytes per second. */
+#define S_RATE_MIN 16384
+
+/** The number of packets that may be sent in a burst after an idle period. */
+#define S_RATE_BURST BATCH_SIZE
+
+/** The minimal length of the rate control measurement interval in microseconds. */
+#define S_RATE_INTERVAL_MIN_US 50000
+
+/** The ratio of lost packets in a measurement interval that is still tolerated without decreasing the rate. */
+#define S_RATE_LOSS_TOLERANCE 0.02
+
+/** The sending rate is multiplied by this factor when a loss is detected. */
+#define S_RATE_DECREASE_FACTOR 0.7
+
+/** After a decrease, the rate grows by 1/S_RATE_INCREASE_DIVISOR of the decreased rate in each interval. */
+#define S_RATE_INCREASE_DIVISOR 16
+
+/**
+ * The initial and the maximum time in microseconds to wait before sending again when the output queue of the network
+ * interface is full (ENOBUFS). The time doubles with each consecutive failure.
+ */
+#define S_NOBUFS_BACKOFF_US 50
+#define S_NOBUFS_BACKOFF_MAX_US 5000
+
+/**
+ * The number of chunks the sender reads and encrypts ahead of sending them (see SendPipeline).
+ * Each of them occupies two buffers of the chunk size. When sending with a sliding window, S_WINDOW_MAX more chunks
+ * (for each path) are allocated as the chunks in flight keep their buffers until they're acknowledged.
+ */
+#define S_PIPELINE_DEPTH 256
+
+/**
+ * A thread waiting for another stage of the SendPipeline yields the processor S_PIPELINE_SPIN_LIMIT times, then it
+ * sleeps for S_PIPELINE_SLEEP_US microseconds between the attempts.
+ */
+#define S_PIPELINE_SPIN_LIMIT 256
+#define S_PIPELINE_SLEEP_US 50
+
+/**
+ * The maximum number of threads encrypting the chunks in protocol version 2 (limited by the number of processors).
+ * In protocol version 1, the chunks are always encrypted by a single thread.
+ */
+#define S_ENCRYPTION_WORKERS 4
+
+/** The zlib compression level of the data chunks (see compression.h); the fastest one by default. */
+#define S_COMPRESSION_LEVEL 1
+
+/** The minimum number of bytes a chunk must shrink by to be sent compressed. */
+#define S_COMPRESSION_MIN_SAVING 16
+
+/** The size of the buffer for reading the files sent in a batch (see BatchStreamBuf). */
+#define S_BATCH_READ_BUFFER_SIZE (64 * 1024)
+
+/** Time in microseconds to wait before sending an 'All Data Sent' packet after sending blindly. */
 #define S_CONFIRMATION_DELAY_US 100000
 
 /** Time for the sender to wait for an incoming packet (confirmation protocol message). */
 #define S_RECV_TIMEOUT_MS 10000
 
+/** Time for the sender to wait for the receiver's answer to the 'File Information' of a resumable transfer. */
+#define S_RESUME_TIMEOUT_MS 1000
+
+/** Time for the sender to wait for the remaining parts of a 'Request Resend Ranges' message. */
+#define S_RESEND_PARTS_TIMEOUT_MS 200
+
+/** The maximum number of paths a multipath transfer stripes the chunks across (see SenderOptions::multipath). */
+#define S_MAX_PATHS 8
+
+/**
+ * The number of 'Join' messages sent over an additional path of a multipath transfer and the time in milliseconds
+ * to wait for the receiver's answers after each of them. The paths that don't join are not used.
+ */
+#define S_JOIN_ATTEMPTS 3
+#define S_JOIN_TIMEOUT_MS 300
+
 /* ------ Receiver options ------ */
 
 /** Time for the receiver to wait for an incoming packet. */
@@ -85,19 +238,131 @@ enum TransmissionMode {
 #define R_FILE_INFO_TIMEOUT_MS 1000
 
 /**
- * Defines whether the receiver should save received data to a temporary file.
- * When set to 0, memory will be allocated to store all the data.
+ * The maximum number of bytes of the chunks received out of order the receiver keeps in memory
+ * (protocol version 1). The chunks that don't fit are saved to a temporary file.
+ * In protocol version 2, the limit applies to the data of a batch received before its manifest.
  */
-#define R_USE_TEMP_FILE 0
+#define R_REORDER_MEMORY_LIMIT (16 * 1024 * 1024)
+
+/**
+ * The number of consecutive resend rounds in which no data arrive after which the receiver gives up the transmission
+ * (so that a session of a sender that has gone away doesn't stay open forever).
+ */
+#define R_MAX_EMPTY_PASSES 5
+
+/**
+ * The maximum length of the data of a resend request. 1 + 730 seqs in protocol version 1 fill one 1500 B IP packet
+ * and leave a bit of space just for sure.
+ */
+#define R_RESEND_MESSAGE_LEN 1461
+
+/** The maximum number of 'Request Resend Ranges' packets sent at once (protocol version 2). */
+#define R_RESEND_PACKETS 8
+
+/** The maximum number of missing ranges the receiver looks for when requesting resending. */
+#define R_RESEND_MAX_RANGES (R_RESEND_PACKETS * R_RESEND_MESSAGE_LEN / 2)
+
+/**
+ * The maximum number of files of a batch the receiver keeps open at once. The files are opened again when needed.
+ */
+#define R_BATCH_MAX_OPEN_FILES 64
+
+/** The suffix of the name of the journal of a resumable transfer (see TransferJournal). */
+#define R_JOURNAL_SUFFIX ".journal"
+
+/** The interval between saving the journal of a resumable transfer in milliseconds. */
+#define R_JOURNAL_INTERVAL_MS 2000
+
+/** The maximum number of transmissions the receiver handles at once in the daemon mode. */
+#define R_MAX_SESSIONS 64
+
+/**
+ * The size of a block written at once by the background writer used when the output file cannot be memory-mapped
+ * (see AsyncWriter) and the maximum number of blocks waiting to be written. When all of them are waiting,
+ * receiving waits for the disk.
+ */
+#define R_WRITE_BUFFER_SIZE (1024 * 1024)
+#define R_WRITE_BUFFERS 16
+
+/** The number of bytes the background writer preallocates ahead of the data when the file size is not known. */
+#define R_WRITE_PREALLOCATE_STEP (64 * 1024 * 1024)
 
 /* ------ Protocol constants ------ */
 
+/**
+ * Protocol versions. In version 1, the whole file is encrypted as one AES-256-CBC stream. In version 2, each chunk
+ * is encrypted and authenticated independently using AES-256-GCM (see ChunkCrypto). Version 3 is version 2 in which
+ * the chunks may be compressed (see compression.h). In version 4, the keys are derived from a random salt the sender
+ * sends in 'Hello' (CRYPTO_TRANSFER_SALT_LEN bytes after the version).
+ * The version is sent as the fifth byte of 'Hello' and 'Hello Back'; a four-byte 'Hello' means version 1.
+ * Versions 2 and 3 derived the keys from the transaction ID only, so they're not used anymore: a 'Hello' without
+ * the salt gets version 1.
+ */
+#define PROTO_VERSION_STREAM 1
+#define PROTO_VERSION_CHUNKED 2
+#define PROTO_VERSION_COMPRESSION 3
+#define PROTO_VERSION_SALTED 4
+/** The highest supported protocol version. */
+#define PROTO_VERSION PROTO_VERSION_SALTED
+
 #define PROTO_HELLO { 0x01, 0x10, 0x01, 0x10 }
 #define PROTO_HELLO_BACK { 0x10, 0x01, 0x10, 0x01 }
 #define PROTO_OK 0x1
 #define PROTO_ERROR 0x2
 #define PROTO_INVALID_KEY 0x3
 #define PROTO_REQUEST_RESEND 0x4
+/** Protocol version 2: the missing chunks as ranges of chunk indices, possibly split into multiple packets. */
+#define PROTO_REQUEST_RESEND_RANGES 0x5
+/** Protocol version 2: the answer to a resumable 'File Information' when there's nothing to resume. */
+#define PROTO_RESUME_NONE 0x6
+/** Protocol version 2: the answer to a valid 'Join' message, followed by the number of the path. */
+#define PROTO_JOINED 0x7
+
+/**
+ * Protocol version 2: 'Join' – sent by the sender over an additional path of a multipath transfer (an Echo Request
+ * with seq 0 on the transaction ID, from another source address). The magic is followed by the number of the path
+ * and by the source address of the path (4 or 16 bytes) encrypted as the chunk with the index of the path number
+ * under the join key of the transfer. Nobody else can add a path to the transfer, and the message is only valid
+ * when sent from that address, so it cannot be replayed from another one. In two-way mode, the receiver then accepts
+ * the data packets from the path's address too and answers with PROTO_JOINED on the primary path (the control
+ * messages are only sent there). Each path number may only join from one address.
+ */
+#define PROTO_JOIN { 0x01, 0x10, 0x01, 0x11 }
+
+/**
+ * Protocol version 2: the flag in the chunk size field of the 'File Information' message that marks a batch of files
+ * (see batch_manifest.h). The chunk size is followed by the length of the manifest. Older receivers reject the chunk
+ * size as invalid.
+ */
+#define PROTO_FILE_INFO_BATCH 0x8000
+
+/**
+ * Protocol version 2: the flag in the chunk size field of the 'File Information' message that asks for a resumable
+ * transfer. The other fields are followed by the identity of the transfer (a SHA-256 hash of the sent stream,
+ * see TransferJournal). In two-way mode, the receiver answers the 'File Information' with a 'Request Resend Ranges'
+ * message with the chunks it's missing (when it has a journal of the transfer) or with PROTO_RESUME_NONE.
+ */
+#define PROTO_FILE_INFO_RESUMABLE 0x4000
+#define PROTO_IDENTITY_LEN 32
+
+/**
+ * Protocol version 2: the flag in the chunk size field of the 'File Information' message that announces a stream
+ * of unknown length (read from a pipe). The file length field is zero; the stream ends with the first chunk that
+ * doesn't fill the chunk size (possibly an empty one), so the length is authenticated by that chunk. The sender cannot
+ * resend the chunks, the receiver only reports them as missing (in two-way mode) and finishes.
+ */
+#define PROTO_FILE_INFO_STREAMING 0x2000
+
+/** The maximum number of files in a batch and the maximum length of the encoded manifest. */
+#define PROTO_BATCH_MAX_FILES 1000000
+#define PROTO_BATCH_MAX_MANIFEST_LEN (64 * 1024 * 1024)
+
+/**
+ * The number of seqs available for the data chunks (seq 0 and 1 are used by the handshake and the file information,
+ * UINT16_MAX by the 'All Data Sent' packet). In protocol version 1, this limits the number of chunks. In version 2,
+ * the seqs wrap around; the chunk index is determined by the chunk's position in the file.
+ */
+#define PROTO_DATA_SEQ_COUNT (UINT16_MAX - 2)
 
 // The maximum packet size must not be higher than the receive buffer size
 static_assert(STARTING_MPS <= R_RECV_BUFFER_SIZE, "The maximum packet size must not be higher than the receive buffer size.");
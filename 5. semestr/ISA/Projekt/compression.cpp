@@ -0,0 +1,63 @@
+// compression.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <stdexcept>
+
+#include "common.h"
+#include "compression.h"
+
+ChunkCompressor::ChunkCompressor(size_t chunk_size) : buffer(chunk_size) {
+    // Negative window bits: raw DEFLATE without the zlib header and checksum (the chunks are authenticated)
+    if (deflateInit2(&stream, S_COMPRESSION_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("Cannot initialise compression");
+    }
+}
+
+ChunkCompressor::~ChunkCompressor() {
+    deflateEnd(&stream);
+}
+
+size_t ChunkCompressor::compress(const uint8_t *plain, size_t plain_len) {
+    if (plain_len <= S_COMPRESSION_MIN_SAVING || plain_len > buffer.size()) {
+        return 0;
+    }
+
+    // Only leave space for the output that saves enough; if it doesn't fit, the chunk is sent uncompressed
+    auto limit = plain_len - S_COMPRESSION_MIN_SAVING;
+    deflateReset(&stream);
+    stream.next_in = const_cast<Bytef *>(plain);
+    stream.avail_in = static_cast<uInt>(plain_len);
+    stream.next_out = buffer.data();
+    stream.avail_out = static_cast<uInt>(limit);
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+
+    return limit - stream.avail_out;
+}
+
+ChunkDecompressor::ChunkDecompressor() {
+    if (inflateInit2(&stream, -15) != Z_OK) {
+        throw std::runtime_error("Cannot initialise decompression");
+    }
+}
+
+ChunkDecompressor::~ChunkDecompressor() {
+    inflateEnd(&stream);
+}
+
+bool ChunkDecompressor::decompress(const uint8_t *data, size_t data_len, uint8_t *plain, size_t &plain_len) {
+    inflateReset(&stream);
+    stream.next_in = const_cast<Bytef *>(data);
+    stream.avail_in = static_cast<uInt>(data_len);
+    stream.next_out = plain;
+    stream.avail_out = static_cast<uInt>(plain_len);
+
+    if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_in != 0) {
+        return false;
+    }
+
+    plain_len -= stream.avail_out;
+    return true;
+}
@@ -0,0 +1,100 @@
+// compression.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_COMPRESSION_H
+#define ISA_COMPRESSION_H
+
+#include <cstdint>
+#include <vector>
+#include <zlib.h>
+
+/*
+ * Compression of the data chunks (protocol version 3). Each chunk is compressed independently (raw DEFLATE,
+ * RFC 1951) before it's encrypted, so the chunks can still be decrypted, decompressed and written in any order.
+ * A chunk is only sent compressed if it gets smaller by at least S_COMPRESSION_MIN_SAVING bytes; otherwise, it's
+ * sent as is.
+ *
+ * A compressed chunk carries COMPRESSION_FLAG in the position field of its data packet; the same value is used
+ * as the chunk index for encryption, so the flag is authenticated together with the data.
+ */
+
+/** The flag in the position field of a data packet that marks a compressed chunk. */
+#define COMPRESSION_FLAG (uint64_t(1) << 62)
+
+/**
+ * Compresses the data chunks on the sender side. Each encryption worker has its own instance.
+ */
+class ChunkCompressor {
+public:
+    /**
+     * Creates a ChunkCompressor.
+     *
+     * @param [in] chunk_size The maximum length of a chunk.
+     * @throws std::runtime_error Thrown when the compressor cannot be initialised.
+     */
+    explicit ChunkCompressor(size_t chunk_size);
+
+    /**
+     * Frees the compressor state.
+     */
+    ~ChunkCompressor();
+
+    ChunkCompressor(const ChunkCompressor &) = delete;
+
+    ChunkCompressor &operator=(const ChunkCompressor &) = delete;
+
+    /**
+     * Compresses a chunk to the internal buffer (see data()).
+     *
+     * @param [in] plain The chunk data.
+     * @param [in] plain_len Length of the chunk data.
+     * @return Length of the compressed data; zero if the chunk should be sent uncompressed.
+     */
+    size_t compress(const uint8_t *plain, size_t plain_len);
+
+    /** @return The data compressed by the last call to compress(). */
+    [[nodiscard]] const uint8_t *data() const { return buffer.data(); }
+
+private:
+    z_stream stream{}; /**< The zlib state (reset for each chunk). */
+    std::vector<uint8_t> buffer; /**< The compressed data. */
+};
+
+/**
+ * Decompresses the data chunks on the receiver side.
+ */
+class ChunkDecompressor {
+public:
+    /**
+     * Creates a ChunkDecompressor.
+     *
+     * @throws std::runtime_error Thrown when the decompressor cannot be initialised.
+     */
+    ChunkDecompressor();
+
+    /**
+     * Frees the decompressor state.
+     */
+    ~ChunkDecompressor();
+
+    ChunkDecompressor(const ChunkDecompressor &) = delete;
+
+    ChunkDecompressor &operator=(const ChunkDecompressor &) = delete;
+
+    /**
+     * Decompresses a chunk.
+     *
+     * @param [in] data The compressed data.
+     * @param [in] data_len Length of the compressed data.
+     * @param [out] plain A buffer to save the chunk to.
+     * @param [in,out] plain_len The size of @a plain; set to the length of the decompressed chunk.
+     * @return True if the data are valid and the whole chunk fits into @a plain.
+     */
+    bool decompress(const uint8_t *data, size_t data_len, uint8_t *plain, size_t &plain_len);
+
+private:
+    z_stream stream{}; /**< The zlib state (reset for each chunk). */
+};
+
+#endif //ISA_COMPRESSION_H
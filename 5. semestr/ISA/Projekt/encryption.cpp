@@ -6,46 +6,56 @@
 // - https://wiki.openssl.org/index.php/EVP_Symmetric_Encryption_and_Decryption (OpenSSL wiki)
 
 #include <openssl/aes.h>
+#include <openssl/kdf.h>
+#include <endian.h>
+#include <cstring>
 #include <limits>
 #include <system_error>
 
 #include "common.h"
 #include "encryption.h"
 #include "secure_string.h"
+#include "key_cache.h"
 
 
 Crypto::Crypto(const secure_string &password, uint32_t salt) {
-    EVP_add_cipher(EVP_aes_256_cbc());
-
-    auto salt_ptr = reinterpret_cast<const unsigned char *>(&salt);
-
-    int key_len = EVP_CIPHER_key_length(EVP_aes_256_cbc());
-    int iv_len = EVP_CIPHER_iv_length(EVP_aes_256_cbc());
-    int key_iv_len = key_len + iv_len;
-
-    unsigned char key_iv[key_iv_len];
-
-    if (!PKCS5_PBKDF2_HMAC_SHA1(password.c_str(), static_cast<int>(password.length()), salt_ptr, sizeof(salt),
-                                CRYPTO_KEY_DERIVATION_ITERATIONS, key_iv_len, key_iv)) {
-        throw std::runtime_error("Cannot create encryption parameters.");
-    }
-
     encrypt_ctx = EVP_CIPHER_CTX_new();
     decrypt_ctx = EVP_CIPHER_CTX_new();
 
     if (encrypt_ctx == nullptr || decrypt_ctx == nullptr) {
+        EVP_CIPHER_CTX_free(encrypt_ctx);
+        EVP_CIPHER_CTX_free(decrypt_ctx);
         throw std::runtime_error("Cannot initialize OpenSSL contexts.");
     }
 
-    int success = 1;
+    try {
+        rekey(password, salt);
+    } catch (...) {
+        EVP_CIPHER_CTX_free(encrypt_ctx);
+        EVP_CIPHER_CTX_free(decrypt_ctx);
+        throw;
+    }
+}
+
+void Crypto::rekey(const secure_string &password, uint32_t salt) {
+    auto salt_ptr = reinterpret_cast<const unsigned char *>(&salt);
 
-    success &= EVP_CIPHER_CTX_reset(encrypt_ctx);
-    success &= EVP_CIPHER_CTX_reset(decrypt_ctx);
+    int key_len = EVP_CIPHER_key_length(EVP_aes_256_cbc());
+    int iv_len = EVP_CIPHER_iv_length(EVP_aes_256_cbc());
 
-    success &= EVP_EncryptInit_ex(encrypt_ctx, EVP_aes_256_cbc(), nullptr, key_iv, key_iv + key_len);
-    success &= EVP_DecryptInit_ex(decrypt_ctx, EVP_aes_256_cbc(), nullptr, key_iv, key_iv + key_len);
+    key_iv.resize(key_len + iv_len);
+    KeyCache::shared().derive(password, salt_ptr, sizeof(salt), EVP_sha1(), key_iv.data(),
+                              static_cast<int>(key_iv.size()));
+    reset();
+}
 
-    OPENSSL_cleanse(key_iv, key_iv_len);
+void Crypto::reset() {
+    int key_len = EVP_CIPHER_key_length(EVP_aes_256_cbc());
+    int success = 1;
+
+    // Reinitialising the contexts discards the state of the previous stream but keeps the allocated memory
+    success &= EVP_EncryptInit_ex(encrypt_ctx, EVP_aes_256_cbc(), nullptr, key_iv.data(), key_iv.data() + key_len);
+    success &= EVP_DecryptInit_ex(decrypt_ctx, EVP_aes_256_cbc(), nullptr, key_iv.data(), key_iv.data() + key_len);
 
     if (!success) {
         throw std::runtime_error("Cannot initialize OpenSSL contexts.");
@@ -106,3 +116,149 @@ size_t Crypto::encrypted_len(size_t input_len) {
     // a whole new block is needed for padding
     return (input_len / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
 }
+
+ChunkCrypto::ChunkCrypto(const secure_string &password, const TransferSalt &salt, KeyPurpose purpose) {
+    encrypt_ctx = EVP_CIPHER_CTX_new();
+    decrypt_ctx = EVP_CIPHER_CTX_new();
+
+    if (encrypt_ctx == nullptr || decrypt_ctx == nullptr) {
+        EVP_CIPHER_CTX_free(encrypt_ctx);
+        EVP_CIPHER_CTX_free(decrypt_ctx);
+        throw std::runtime_error("Cannot initialize OpenSSL contexts.");
+    }
+
+    try {
+        rekey(password, salt, purpose);
+    } catch (...) {
+        EVP_CIPHER_CTX_free(encrypt_ctx);
+        EVP_CIPHER_CTX_free(decrypt_ctx);
+        throw;
+    }
+}
+
+void ChunkCrypto::rekey(const secure_string &password, const TransferSalt &salt, KeyPurpose purpose) {
+    const char *label;
+    switch (purpose) {
+        case KeyPurpose::FILE_INFO:
+            label = "xondry02 file info";
+            break;
+        case KeyPurpose::DATA:
+            label = "xondry02 data";
+            break;
+        case KeyPurpose::JOIN:
+        default:
+            label = "xondry02 join";
+            break;
+    }
+
+    int key_len = EVP_CIPHER_key_length(EVP_aes_256_gcm());
+    unsigned char master_key[key_len];
+    unsigned char key[key_len];
+
+    // The expensive derivation from the password doesn't depend on the salt, so it is only done once per password
+    // (the result is cached); the key for the purpose and the salt is derived from it using HKDF
+    auto master_salt = reinterpret_cast<const unsigned char *>(CRYPTO_MASTER_KEY_SALT);
+    KeyCache::shared().derive(password, master_salt, sizeof(CRYPTO_MASTER_KEY_SALT) - 1, EVP_sha256(), master_key,
+                              key_len);
+
+    EVP_PKEY_CTX *kdf_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    size_t derived_len = key_len;
+    bool derived = kdf_ctx != nullptr
+                   && EVP_PKEY_derive_init(kdf_ctx) > 0
+                   && EVP_PKEY_CTX_set_hkdf_md(kdf_ctx, EVP_sha256()) > 0
+                   && EVP_PKEY_CTX_set1_hkdf_key(kdf_ctx, master_key, key_len) > 0
+                   && EVP_PKEY_CTX_add1_hkdf_info(kdf_ctx, reinterpret_cast<const unsigned char *>(label),
+                                                  static_cast<int>(strlen(label))) > 0
+                   && EVP_PKEY_CTX_add1_hkdf_info(kdf_ctx, salt.data(), static_cast<int>(salt.size())) > 0
+                   && EVP_PKEY_derive(kdf_ctx, key, &derived_len) > 0;
+
+    EVP_PKEY_CTX_free(kdf_ctx);
+    OPENSSL_cleanse(master_key, key_len);
+
+    if (!derived) {
+        throw std::runtime_error("Cannot create encryption parameters.");
+    }
+
+    // Set the key once, the nonce is set for each chunk
+    int success = 1;
+    success &= EVP_EncryptInit_ex(encrypt_ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+    success &= EVP_CIPHER_CTX_ctrl(encrypt_ctx, EVP_CTRL_GCM_SET_IVLEN, CRYPTO_NONCE_LEN, nullptr);
+    success &= EVP_EncryptInit_ex(encrypt_ctx, nullptr, nullptr, key, nullptr);
+    success &= EVP_DecryptInit_ex(decrypt_ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+    success &= EVP_CIPHER_CTX_ctrl(decrypt_ctx, EVP_CTRL_GCM_SET_IVLEN, CRYPTO_NONCE_LEN, nullptr);
+    success &= EVP_DecryptInit_ex(decrypt_ctx, nullptr, nullptr, key, nullptr);
+
+    OPENSSL_cleanse(key, key_len);
+
+    if (!success) {
+        throw std::runtime_error("Cannot initialize OpenSSL contexts.");
+    }
+}
+
+size_t ChunkCrypto::encrypt(uint64_t index, unsigned char *dest, const unsigned char *input_plain, size_t input_len) {
+    unsigned char nonce[CRYPTO_NONCE_LEN];
+    make_nonce(index, nonce);
+
+    int out_len = 0;
+    int final_len = 0;
+
+    if (!EVP_EncryptInit_ex(encrypt_ctx, nullptr, nullptr, nullptr, nonce)
+        || !EVP_EncryptUpdate(encrypt_ctx, dest, &out_len, input_plain, static_cast<int>(input_len))
+        || !EVP_EncryptFinal_ex(encrypt_ctx, dest + out_len, &final_len)
+        || !EVP_CIPHER_CTX_ctrl(encrypt_ctx, EVP_CTRL_GCM_GET_TAG, CRYPTO_TAG_LEN, dest + out_len + final_len)) {
+        throw std::runtime_error("Cannot encrypt data.");
+    }
+
+    return out_len + final_len + CRYPTO_TAG_LEN;
+}
+
+bool ChunkCrypto::decrypt(uint64_t index, unsigned char *dest, const unsigned char *input_ciphertext,
+                          size_t input_len, size_t &output_len) {
+    if (input_len < CRYPTO_TAG_LEN) {
+        return false;
+    }
+
+    unsigned char nonce[CRYPTO_NONCE_LEN];
+    make_nonce(index, nonce);
+
+    auto data_len = static_cast<int>(input_len - CRYPTO_TAG_LEN);
+    unsigned char tag[CRYPTO_TAG_LEN];
+    memcpy(tag, input_ciphertext + data_len, CRYPTO_TAG_LEN);
+
+    int out_len = 0;
+    int final_len = 0;
+
+    if (!EVP_DecryptInit_ex(decrypt_ctx, nullptr, nullptr, nullptr, nonce)
+        || !EVP_DecryptUpdate(decrypt_ctx, dest, &out_len, input_ciphertext, data_len)
+        || !EVP_CIPHER_CTX_ctrl(decrypt_ctx, EVP_CTRL_GCM_SET_TAG, CRYPTO_TAG_LEN, tag)) {
+        throw std::runtime_error("Cannot decrypt data");
+    }
+
+    // Fails if the tag doesn't match
+    if (EVP_DecryptFinal_ex(decrypt_ctx, dest + out_len, &final_len) <= 0) {
+        return false;
+    }
+
+    output_len = out_len + final_len;
+    return true;
+}
+
+ChunkCrypto::~ChunkCrypto() {
+    EVP_CIPHER_CTX_free(encrypt_ctx);
+    EVP_CIPHER_CTX_free(decrypt_ctx);
+}
+
+void ChunkCrypto::make_nonce(uint64_t index, unsigned char *nonce) {
+    uint64_t index_be = htobe64(index);
+    memset(nonce, 0, sizeof(uint32_t));
+    memcpy(nonce + sizeof(uint32_t), &index_be, sizeof(uint64_t));
+}
+
+size_t ChunkCrypto::encrypted_len(size_t input_len) {
+    // GCM doesn't pad the data
+    return input_len + CRYPTO_TAG_LEN;
+}
+
+size_t ChunkCrypto::max_plain_len_to_fit(size_t limit_len) {
+    return limit_len - CRYPTO_TAG_LEN;
+}
@@ -5,10 +5,13 @@
 #ifndef ISA_ENCRYPTION_H
 #define ISA_ENCRYPTION_H
 
+#include <array>
 #include <string>
 #include <openssl/evp.h>
 
+#include "common.h"
 #include "secure_string.h"
+#include "key_cache.h"
 
 using std::string;
 
@@ -23,6 +26,7 @@ public:
      * Initializes both the encryption and decryption context.
      *
      * @remark Both the password and salt must be known to the other side.
+     * @remark The derived parameters are cached (see KeyCache).
      * @param password A password to generate the encryption password and IV from.
      * @param salt A salt to bring out the flavours of the encryption password and IV.
      */
@@ -33,6 +37,24 @@ public:
      */
     ~Crypto();
 
+    Crypto(const Crypto &) = delete;
+
+    Crypto &operator=(const Crypto &) = delete;
+
+    /**
+     * Restarts both the encryption and decryption of a new stream with the same parameters (e.g. to encrypt
+     * the same data again). Reuses the OpenSSL contexts.
+     */
+    void reset();
+
+    /**
+     * Generates new encryption parameters based on the provided password and salt and calls reset().
+     *
+     * @param password A password to generate the encryption password and IV from.
+     * @param salt A salt to bring out the flavours of the encryption password and IV.
+     */
+    void rekey(const secure_string &password, uint32_t salt);
+
     /**
      * Encrypts a chunk of data.
      * @remark Successive calls to encrypt() encrypt successive chunks of a single data stream.
@@ -77,10 +99,108 @@ public:
      */
     static size_t max_plain_len_to_fit(size_t limit_len);
 
+private:
+    EVP_CIPHER_CTX *encrypt_ctx; /**< Encryption context. */
+    EVP_CIPHER_CTX *decrypt_ctx; /**< Decryption context. */
+    secure_bytes key_iv; /**< The encryption key followed by the IV. */
+};
+
+/** The random salt of a transfer (protocol version 4). */
+using TransferSalt = std::array<uint8_t, CRYPTO_TRANSFER_SALT_LEN>;
+
+/** The data a ChunkCrypto key is used for; each of them has its own key, so their nonces cannot collide. */
+enum class KeyPurpose {
+    FILE_INFO, /**< The 'File Information' message (the only chunk has index 0). */
+    DATA, /**< The data and parity chunks. */
+    JOIN /**< The 'Join' messages of a multipath transfer (the chunk index is the path number). */
+};
+
+/**
+ * A ChunkCrypto instance is used to encrypt or decrypt independent chunks of a single logical unit of data using
+ * the AES_256_GCM cipher. Each chunk is identified by its index and authenticated with its own tag.
+ *
+ * @remark The nonce of a chunk is the chunk index, so the chunks may be processed in any order (and by multiple
+ * ChunkCrypto instances in parallel). An index must never be used for two different chunks.
+ * @remark The key is derived from a master key using HKDF with the label of the purpose and the random salt of the
+ * transfer as the context, so each transfer and each purpose has its own key. The master key is derived from the
+ * password using PBKDF2 with a fixed salt, so it is computed only once for each password (see KeyCache).
+ */
+class ChunkCrypto {
+public:
+    /**
+     * Creates a ChunkCrypto instance. Generates the encryption key based on the provided password and salt.
+     *
+     * @remark Both the password and salt must be known to the other side.
+     * @param password A password to generate the encryption key from.
+     * @param salt The random salt of the transfer.
+     * @param purpose The data the key is used for.
+     */
+    ChunkCrypto(const secure_string &password, const TransferSalt &salt, KeyPurpose purpose);
+
+    /**
+     * Frees resources used by this ChunkCrypto instance.
+     */
+    ~ChunkCrypto();
+
+    ChunkCrypto(const ChunkCrypto &) = delete;
+
+    ChunkCrypto &operator=(const ChunkCrypto &) = delete;
+
+    /**
+     * Generates a new encryption key based on the provided password and salt. Reuses the OpenSSL contexts.
+     *
+     * @param password A password to generate the encryption key from.
+     * @param salt The random salt of the transfer.
+     * @param purpose The data the key is used for.
+     */
+    void rekey(const secure_string &password, const TransferSalt &salt, KeyPurpose purpose);
+
+    /**
+     * Encrypts a chunk of data and appends the authentication tag.
+     * @param [in] index The chunk index.
+     * @param [out] dest A pointer to a buffer to save the encrypted data to. Must be able to hold
+     * encrypted_len(input_len) bytes.
+     * @param [in] input_plain A pointer to the input data.
+     * @param [in] input_len Length of the input data.
+     * @return Number of bytes saved to the dest buffer.
+     */
+    size_t encrypt(uint64_t index, unsigned char *dest, const unsigned char *input_plain, size_t input_len);
+
+    /**
+     * Decrypts a chunk of data and verifies its authentication tag.
+     * @param [in] index The chunk index.
+     * @param [out] dest A pointer to a buffer to save the decrypted data to. Must be able to hold
+     * input_len - CRYPTO_TAG_LEN bytes. Its contents are undefined if the chunk is not authentic.
+     * @param [in] input_ciphertext A pointer to the encrypted data followed by the authentication tag.
+     * @param [in] input_len Length of the input data (including the tag).
+     * @param [out] output_len Number of bytes saved to the dest buffer.
+     * @return True if the chunk is authentic; false if it has been corrupted or forged.
+     */
+    bool decrypt(uint64_t index, unsigned char *dest, const unsigned char *input_ciphertext, size_t input_len,
+                 size_t &output_len);
+
+    /**
+     * @param [in] input_len The number of input (plain) bytes.
+     * @return The length of encrypted data (including the authentication tag).
+     */
+    static size_t encrypted_len(size_t input_len);
+
+    /**
+     * @param [in] limit_len The maximum size of the destination buffer in bytes.
+     * @return The maximum possible length of input data so that the encrypted chunk fits into limit_len bytes.
+     */
+    static size_t max_plain_len_to_fit(size_t limit_len);
+
 private:
     EVP_CIPHER_CTX *encrypt_ctx; /**< Encryption context. */
     EVP_CIPHER_CTX *decrypt_ctx; /**< Decryption context. */
 
+    /**
+     * Makes the nonce for a chunk: four zero bytes followed by the chunk index (big endian).
+     * @param [in] index The chunk index.
+     * @param [out] nonce A buffer of CRYPTO_NONCE_LEN bytes.
+     */
+    static void make_nonce(uint64_t index, unsigned char *nonce);
 };
 
 #endif //ISA_ENCRYPTION_H
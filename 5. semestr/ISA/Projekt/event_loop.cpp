@@ -0,0 +1,150 @@
+// event_loop.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event_loop.h"
+#include "errors.h"
+#include "utils.h"
+
+/** The maximum number of events returned by one epoll_wait() call. */
+#define EVENT_LOOP_MAX_EVENTS 16
+
+EventLoop::EventLoop() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        THROW_ERRNO();
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        CLOSE_THROW(epoll_fd);
+    }
+
+    epoll_event event{.events = EPOLLIN, .data = {.fd = timer_fd}};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) == -1) {
+        auto errno_prev = errno;
+        close(timer_fd);
+        close(epoll_fd);
+        throw std::system_error(errno_prev, std::generic_category(), "epoll_ctl");
+    }
+}
+
+EventLoop::~EventLoop() {
+    close(timer_fd);
+    close(epoll_fd);
+}
+
+void EventLoop::add_fd(int fd, std::function<void()> on_readable) {
+    epoll_event event{.events = EPOLLIN, .data = {.fd = fd}};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        THROW_ERRNO_W("epoll_ctl");
+    }
+
+    fd_callbacks[fd] = std::move(on_readable);
+}
+
+EventLoop::TimerId EventLoop::add_timer(uint64_t deadline, std::function<void()> callback) {
+    auto id = next_timer_id++;
+    timers.push(Timer{deadline, id});
+    timer_callbacks[id] = std::move(callback);
+
+    if (armed_deadline == 0 || deadline < armed_deadline) {
+        arm_timer();
+    }
+
+    return id;
+}
+
+void EventLoop::cancel_timer(TimerId id) {
+    // The timer stays in the heap, it's skipped when it expires
+    timer_callbacks.erase(id);
+}
+
+bool EventLoop::run() {
+    epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    stopping = false;
+
+    while (!stopping) {
+        int count = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                return false;
+            }
+
+            THROW_ERRNO_W("epoll_wait");
+        }
+
+        for (int i = 0; i < count && !stopping; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == timer_fd) {
+                uint64_t expirations;
+                while (read(timer_fd, &expirations, sizeof(expirations)) > 0);
+
+                armed_deadline = 0;
+                dispatch_timers();
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                throw std::runtime_error("epoll_wait() reported an error on a socket");
+            }
+
+            auto it = fd_callbacks.find(fd);
+            if (it != fd_callbacks.end()) {
+                it->second();
+            }
+        }
+    }
+
+    return true;
+}
+
+void EventLoop::dispatch_timers() {
+    auto now = now_us();
+
+    while (!timers.empty() && !stopping) {
+        auto timer = timers.top();
+        if (timer.deadline > now) {
+            break;
+        }
+
+        timers.pop();
+
+        auto it = timer_callbacks.find(timer.id);
+        if (it == timer_callbacks.end()) {
+            // Cancelled
+            continue;
+        }
+
+        auto callback = std::move(it->second);
+        timer_callbacks.erase(it);
+        callback();
+    }
+
+    arm_timer();
+}
+
+void EventLoop::arm_timer() {
+    // Drop the cancelled timers so that the timerfd isn't armed for them
+    while (!timers.empty() && timer_callbacks.count(timers.top().id) == 0) {
+        timers.pop();
+    }
+
+    itimerspec spec{};
+    if (timers.empty()) {
+        armed_deadline = 0;
+    } else {
+        armed_deadline = timers.top().deadline;
+        // A zero value would disarm the timer
+        uint64_t deadline = armed_deadline == 0 ? 1 : armed_deadline;
+        spec.it_value.tv_sec = static_cast<time_t>(deadline / 1000000);
+        spec.it_value.tv_nsec = static_cast<long>((deadline % 1000000) * 1000);
+    }
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+        THROW_ERRNO_W("timerfd_settime");
+    }
+}
@@ -0,0 +1,116 @@
+// event_loop.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_EVENT_LOOP_H
+#define ISA_EVENT_LOOP_H
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A single-threaded event loop. Waits for file descriptors to become readable using epoll and for timers using
+ * a timerfd that is always armed for the nearest timer.
+ *
+ * @remark The times are values of the monotonic clock in microseconds (see now_us()).
+ * @remark The callbacks may add and cancel timers and call stop().
+ */
+class EventLoop {
+public:
+    /** Identifies a timer. */
+    typedef uint64_t TimerId;
+
+    /**
+     * Creates the epoll instance and the timerfd.
+     *
+     * @throws std::system_error Thrown when the descriptors cannot be created.
+     */
+    EventLoop();
+
+    /**
+     * Closes the epoll instance and the timerfd. Doesn't close the added file descriptors.
+     */
+    ~EventLoop();
+
+    EventLoop(const EventLoop &) = delete;
+
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    /**
+     * Starts watching a file descriptor.
+     *
+     * @param [in] fd The file descriptor.
+     * @param [in] on_readable Called when there is data to read from the descriptor (level-triggered, so the callback
+     * doesn't have to read everything).
+     * @throws std::system_error Thrown when the descriptor cannot be added.
+     */
+    void add_fd(int fd, std::function<void()> on_readable);
+
+    /**
+     * Adds a one-shot timer.
+     *
+     * @param [in] deadline The time when the timer expires.
+     * @param [in] callback Called after the timer expires.
+     * @return An ID that can be used to cancel the timer.
+     */
+    TimerId add_timer(uint64_t deadline, std::function<void()> callback);
+
+    /**
+     * Cancels a timer. Does nothing if the timer has already expired.
+     *
+     * @param [in] id The timer ID.
+     */
+    void cancel_timer(TimerId id);
+
+    /**
+     * Dispatches the events until stop() is called or until a signal interrupts the waiting.
+     *
+     * @return False if the loop has been interrupted by a signal; true if stop() has been called.
+     * @throws std::system_error Thrown when waiting for the events fails.
+     * @throws std::runtime_error Thrown when a watched descriptor reports an error.
+     */
+    bool run();
+
+    /**
+     * Makes run() return after the current callback.
+     */
+    void stop() { stopping = true; }
+
+private:
+    /** A scheduled timer in the timer heap. */
+    struct Timer {
+        uint64_t deadline; /**< The time when the timer expires. */
+        TimerId id; /**< The timer ID. */
+
+        bool operator>(const Timer &other) const {
+            return deadline > other.deadline || (deadline == other.deadline && id > other.id);
+        }
+    };
+
+    int epoll_fd; /**< The epoll instance. */
+    int timer_fd; /**< The timerfd armed for the nearest timer. */
+    bool stopping = false; /**< Signalises if run() should return. */
+
+    std::unordered_map<int, std::function<void()>> fd_callbacks; /**< Callbacks for the watched descriptors. */
+
+    /** The timers ordered by their deadline. Cancelled timers are only removed when they get to the top. */
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+    std::unordered_map<TimerId, std::function<void()>> timer_callbacks; /**< Callbacks of the pending timers. */
+    TimerId next_timer_id = 1; /**< The ID of the next added timer. */
+    uint64_t armed_deadline = 0; /**< The deadline the timerfd is armed for; zero if disarmed. */
+
+    /**
+     * Arms the timerfd for the nearest pending timer (or disarms it if there is none).
+     */
+    void arm_timer();
+
+    /**
+     * Calls the callbacks of the expired timers.
+     */
+    void dispatch_timers();
+};
+
+#endif //ISA_EVENT_LOOP_H
@@ -0,0 +1,170 @@
+// fec.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <cstring>
+
+#include "fec.h"
+
+/**
+ * Multiplication and inversion tables for GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D).
+ */
+struct GaloisTables {
+    uint8_t mul[256][256]; /**< mul[a][b] = a * b */
+    uint8_t inv[256]; /**< inv[a] = 1 / a (inv[0] is unused) */
+
+    GaloisTables() : mul(), inv() {
+        uint8_t exp[512];
+        uint8_t log[256]{};
+
+        unsigned int x = 1;
+        for (unsigned int i = 0; i < 255; i++) {
+            exp[i] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11D;
+            }
+        }
+
+        for (unsigned int i = 255; i < 512; i++) {
+            exp[i] = exp[i - 255];
+        }
+
+        for (unsigned int a = 1; a < 256; a++) {
+            for (unsigned int b = 1; b < 256; b++) {
+                mul[a][b] = exp[log[a] + log[b]];
+            }
+
+            inv[a] = exp[255 - log[a]];
+        }
+    }
+};
+
+static const GaloisTables &gf() {
+    static const GaloisTables tables;
+    return tables;
+}
+
+/**
+ * @return The coefficient of the chunk i in the parity chunk j.
+ */
+static uint8_t cauchy(uint8_t group_size, uint8_t parity_index, uint8_t position) {
+    // Addition is XOR in GF(2^8); K + j and i are always different
+    return gf().inv[static_cast<uint8_t>((group_size + parity_index) ^ position)];
+}
+
+/**
+ * Adds coef * src to dest.
+ */
+static void mul_add(uint8_t *dest, const uint8_t *src, uint8_t coef, size_t len) {
+    const uint8_t *row = gf().mul[coef];
+    for (size_t i = 0; i < len; i++) {
+        dest[i] ^= row[src[i]];
+    }
+}
+
+FecEncoder::FecEncoder(uint8_t group_size, uint8_t parity_count, size_t chunk_len)
+        : data_count(group_size), length(chunk_len), parity_data(parity_count, std::vector<uint8_t>(chunk_len, 0)) {
+}
+
+void FecEncoder::add(uint8_t position, const uint8_t *data, size_t len) {
+    for (size_t j = 0; j < parity_data.size(); j++) {
+        mul_add(parity_data[j].data(), data, cauchy(data_count, j, position), len);
+    }
+}
+
+void FecEncoder::reset() {
+    for (auto &p: parity_data) {
+        std::fill(p.begin(), p.end(), 0);
+    }
+}
+
+bool fec_recover(uint8_t group_size, std::vector<uint8_t *> &chunks, const std::vector<bool> &present,
+                 const std::vector<std::pair<uint8_t, const uint8_t *>> &parity, size_t len) {
+    std::vector<uint8_t> missing;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (!present[i]) {
+            missing.push_back(i);
+        }
+    }
+
+    auto e = missing.size();
+    if (e == 0) {
+        return true;
+    }
+
+    if (parity.size() < e) {
+        return false;
+    }
+
+    // For the first e parity chunks: sum over missing i of C(j, i) * chunk i = parity j + sum over present i of ...
+    std::vector<std::vector<uint8_t>> rhs(e);
+    std::vector<std::vector<uint8_t>> matrix(e, std::vector<uint8_t>(e));
+
+    for (size_t r = 0; r < e; r++) {
+        auto j = parity[r].first;
+        rhs[r].assign(parity[r].second, parity[r].second + len);
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (present[i]) {
+                mul_add(rhs[r].data(), chunks[i], cauchy(group_size, j, i), len);
+            }
+        }
+
+        for (size_t c = 0; c < e; c++) {
+            matrix[r][c] = cauchy(group_size, j, missing[c]);
+        }
+    }
+
+    // Invert the matrix (Gauss-Jordan elimination); a Cauchy matrix is always invertible
+    const auto &tables = gf();
+    std::vector<std::vector<uint8_t>> inverse(e, std::vector<uint8_t>(e, 0));
+    for (size_t r = 0; r < e; r++) {
+        inverse[r][r] = 1;
+    }
+
+    for (size_t c = 0; c < e; c++) {
+        size_t pivot = c;
+        while (pivot < e && matrix[pivot][c] == 0) {
+            pivot++;
+        }
+
+        if (pivot == e) {
+            return false;
+        }
+
+        std::swap(matrix[c], matrix[pivot]);
+        std::swap(inverse[c], inverse[pivot]);
+
+        auto pivot_inv = tables.inv[matrix[c][c]];
+        for (size_t k = 0; k < e; k++) {
+            matrix[c][k] = tables.mul[pivot_inv][matrix[c][k]];
+            inverse[c][k] = tables.mul[pivot_inv][inverse[c][k]];
+        }
+
+        for (size_t r = 0; r < e; r++) {
+            auto factor = matrix[r][c];
+            if (r == c || factor == 0) {
+                continue;
+            }
+
+            for (size_t k = 0; k < e; k++) {
+                matrix[r][k] ^= tables.mul[factor][matrix[c][k]];
+                inverse[r][k] ^= tables.mul[factor][inverse[c][k]];
+            }
+        }
+    }
+
+    for (size_t c = 0; c < e; c++) {
+        auto dest = chunks[missing[c]];
+        memset(dest, 0, len);
+
+        for (size_t r = 0; r < e; r++) {
+            if (inverse[c][r] != 0) {
+                mul_add(dest, rhs[r].data(), inverse[c][r], len);
+            }
+        }
+    }
+
+    return true;
+}
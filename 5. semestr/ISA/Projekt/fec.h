@@ -0,0 +1,121 @@
+// fec.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_FEC_H
+#define ISA_FEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+ * Forward error correction using a systematic Reed-Solomon code over GF(2^8) (protocol version 2).
+ *
+ * The chunks are split into groups of K consecutive chunks (the last group may be smaller). For each group, M parity
+ * chunks are computed from the plain data of the chunks (padded with zeros to the chunk size) using a Cauchy matrix:
+ * parity j = sum over i of C(j, i) * chunk i, where C(j, i) = 1 / ((K + j) + i). Any square submatrix of a Cauchy
+ * matrix is invertible, so any M lost chunks of a group can be reconstructed from the other chunks and M parity chunks.
+ *
+ * The parity chunks are encrypted like the data chunks and sent in data packets. Instead of the position, they carry
+ * FEC_FLAG | K << 55 | j << 47 | group number; the same value is used as the chunk index for encryption.
+ */
+
+/** The flag in the position field of a data packet that marks a parity chunk. */
+#define FEC_FLAG (uint64_t(1) << 63)
+
+/** The maximum number of chunks in a group plus the number of parity chunks. */
+#define FEC_MAX_CHUNKS 255
+
+/**
+ * Makes the value of the position field of a parity chunk.
+ *
+ * @param [in] group_size The number of chunks in a group (K).
+ * @param [in] parity_index The index of the parity chunk in the group (j).
+ * @param [in] group The group number.
+ * @return The value.
+ */
+inline uint64_t fec_make_pos(uint8_t group_size, uint8_t parity_index, uint64_t group) {
+    return FEC_FLAG | (uint64_t(group_size) << 55) | (uint64_t(parity_index) << 47)
+           | (group & ((uint64_t(1) << 47) - 1));
+}
+
+/**
+ * Parses the value of the position field of a parity chunk.
+ *
+ * @param [in] pos The value.
+ * @param [out] group_size The number of chunks in a group (K).
+ * @param [out] parity_index The index of the parity chunk in the group (j).
+ * @param [out] group The group number.
+ */
+inline void fec_parse_pos(uint64_t pos, uint8_t &group_size, uint8_t &parity_index, uint64_t &group) {
+    group_size = static_cast<uint8_t>(pos >> 55);
+    parity_index = static_cast<uint8_t>(pos >> 47);
+    group = pos & ((uint64_t(1) << 47) - 1);
+}
+
+/**
+ * Computes the parity chunks of one group at a time. The chunks of a group are added one by one.
+ */
+class FecEncoder {
+public:
+    /**
+     * Creates a FecEncoder.
+     *
+     * @param [in] group_size The number of chunks in a group (K).
+     * @param [in] parity_count The number of parity chunks per group (M). K + M must not exceed FEC_MAX_CHUNKS.
+     * @param [in] chunk_len The maximum length of a chunk (the length of the parity chunks).
+     */
+    FecEncoder(uint8_t group_size, uint8_t parity_count, size_t chunk_len);
+
+    /**
+     * Adds a chunk of the current group to the parity chunks.
+     *
+     * @param [in] position The position of the chunk in the group (0 to K - 1).
+     * @param [in] data The chunk data.
+     * @param [in] len Length of the chunk data. At most the chunk length.
+     */
+    void add(uint8_t position, const uint8_t *data, size_t len);
+
+    /**
+     * @param [in] parity_index The index of the parity chunk (j).
+     * @return The parity chunk (of the chunk length).
+     */
+    [[nodiscard]] const uint8_t *parity(uint8_t parity_index) const { return parity_data[parity_index].data(); }
+
+    /**
+     * Clears the parity chunks to start the next group.
+     */
+    void reset();
+
+    /** @return The number of chunks in a group (K). */
+    [[nodiscard]] uint8_t group_size() const { return data_count; }
+
+    /** @return The number of parity chunks per group (M). */
+    [[nodiscard]] uint8_t parity_count() const { return static_cast<uint8_t>(parity_data.size()); }
+
+    /** @return The length of the parity chunks. */
+    [[nodiscard]] size_t chunk_len() const { return length; }
+
+private:
+    uint8_t data_count; /**< The number of chunks in a group (K). */
+    size_t length; /**< The length of the parity chunks. */
+    std::vector<std::vector<uint8_t>> parity_data; /**< The parity chunks of the current group. */
+};
+
+/**
+ * Reconstructs the missing chunks of a group.
+ *
+ * @param [in] group_size The number of chunks in a full group (K) used when encoding.
+ * @param [in,out] chunks Buffers of the chunk length for all chunks of the group (the last group may have less than
+ * K chunks). The missing chunks are written to their buffers.
+ * @param [in] present Signalises which chunks have been received (and are filled in @a chunks).
+ * @param [in] parity The received parity chunks (with their index j).
+ * @param [in] len The chunk length.
+ * @return False if there are not enough parity chunks to reconstruct the missing chunks.
+ */
+bool fec_recover(uint8_t group_size, std::vector<uint8_t *> &chunks, const std::vector<bool> &present,
+                 const std::vector<std::pair<uint8_t, const uint8_t *>> &parity, size_t len);
+
+#endif //ISA_FEC_H
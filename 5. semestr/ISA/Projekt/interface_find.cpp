@@ -13,6 +13,19 @@ bool InterfaceFinder::find_source_interface(addrinfo *target, string &if_name, s
                                             sockaddr *&dst_address) {
     load_interface_list();
 
+    // Try the kernel routing table first
+    for (auto current = target; current != nullptr; current = current->ai_next) {
+        auto src = find_route(current->ai_addr, if_name);
+        if (src != nullptr) {
+            log_verbose("Found source interface " << if_name << " for target address "
+                                                  << addr_to_string(current->ai_addr) << " in the routing table");
+            src_address = src;
+            dst_address = current->ai_addr;
+            return true;
+        }
+    }
+
+    // Fall back to pinging the target from each interface
     while (target != nullptr) {
         log_verbose("Finding source interface for target address "
                             << addr_to_string(target->ai_addr));
@@ -43,6 +56,62 @@ bool InterfaceFinder::find_source_interface(addrinfo *target, string &if_name, s
     return false;
 }
 
+std::vector<InterfaceFinder::Path> InterfaceFinder::find_paths(addrinfo *target) {
+    load_interface_list();
+
+    std::vector<Path> paths;
+    for (auto current = target; current != nullptr; current = current->ai_next) {
+        string if_name;
+        auto src = find_route(current->ai_addr, if_name);
+        if (src != nullptr) {
+            paths.push_back(Path{if_name, src, current->ai_addr});
+        }
+    }
+
+    return paths;
+}
+
+sockaddr *InterfaceFinder::find_interface_address(const sockaddr *address, string &if_name) {
+    for (const auto &item: address->sa_family == AF_INET ? ipv4Ifaces : ipv6Ifaces) {
+        if (sockaddr_eq(item.first, address)) {
+            if_name = item.second;
+            return item.first;
+        }
+    }
+
+    return nullptr;
+}
+
+sockaddr *InterfaceFinder::find_route(const sockaddr *dst, string &if_name) {
+    int socket_fd = socket(dst->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (socket_fd == -1) {
+        return nullptr;
+    }
+
+    // connect() needs a non-zero port; no datagram is sent
+    AnyIPAddress dst_addr{};
+    AnyIPAddress src_addr{};
+    socklen_t addr_len;
+    if (dst->sa_family == AF_INET) {
+        dst_addr.in = *reinterpret_cast<const sockaddr_in *>(dst);
+        dst_addr.in.sin_port = htons(9);
+        addr_len = sizeof(sockaddr_in);
+    } else {
+        dst_addr.in6 = *reinterpret_cast<const sockaddr_in6 *>(dst);
+        dst_addr.in6.sin6_port = htons(9);
+        addr_len = sizeof(sockaddr_in6);
+    }
+
+    socklen_t src_len = addr_len;
+    if (connect(socket_fd, &dst_addr.sock, addr_len) == -1 || getsockname(socket_fd, &src_addr.sock, &src_len) == -1) {
+        close(socket_fd);
+        return nullptr;
+    }
+
+    close(socket_fd);
+    return find_interface_address(&src_addr.sock, if_name);
+}
+
 void InterfaceFinder::load_interface_list() {
     log_verbose("Loading interface list");
 
@@ -51,7 +120,7 @@ void InterfaceFinder::load_interface_list() {
     }
 
     ipv4Ifaces.clear();
-    ipv4Ifaces.clear();
+    ipv6Ifaces.clear();
 
     if (getifaddrs(&addresses) == -1) {
         addresses = nullptr;
@@ -105,7 +174,6 @@ bool InterfaceFinder::send_ping(sockaddr *dst, sockaddr *src, const string &if_n
 
     // Send 'ping'
     if (sendto(socket_fd, packet, total_len, 0, &channel.dst_addr.sock, channel.addr_len) == -1) {
-        close(socket_fd);
         return false;
     }
 
@@ -117,11 +185,10 @@ bool InterfaceFinder::send_ping(sockaddr *dst, sockaddr *src, const string &if_n
         auto received = recvfrom(socket_fd, packet_buffer, packet_len, 0, &recv_addr.sock, &recv_addr_len);
 
         if (received == -1) {
-            close(socket_fd);
             return false;
         }
     }
 
-    close(socket_fd);
+    // The socket is closed by the Channel
     return true;
 }
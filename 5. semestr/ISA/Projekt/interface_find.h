@@ -8,6 +8,7 @@
 #include <map>
 #include <ifaddrs.h>
 #include <string>
+#include <vector>
 #include <netdb.h>
 
 
@@ -19,6 +20,10 @@ public:
      * Walks through an addrinfo linked list of destination IP addresses and attempts to find an interface that
      * reaches them. The first pair of reachable destination IP address and source interface is returned.
      *
+     * @remark For each destination address, the kernel routing table is asked for the source address first
+     * (see find_route()). Only if none of the destination addresses can be resolved this way, the destinations are
+     * pinged from each interface.
+     *
      * @remark The memory pointed to by the returned @a src_address and @a dst_address is deallocated in InterfaceFinder
      * destructor.
      * @param [in] target An addrinfo linked list of destination IP addresses.
@@ -30,6 +35,23 @@ public:
      */
     bool find_source_interface(addrinfo *target, std::string &if_name, sockaddr *&src_address, sockaddr *&dst_address);
 
+    /** A source interface and a destination address that it reaches. */
+    struct Path {
+        std::string if_name; /**< The name of the interface. */
+        sockaddr *src_address; /**< The source (interface) IP address. */
+        sockaddr *dst_address; /**< The destination IP address. */
+    };
+
+    /**
+     * Finds the routes to all destination IP addresses in an addrinfo linked list (used by multipath transfers).
+     * Only the kernel routing table is used, the destinations are not pinged.
+     *
+     * @remark The memory pointed to by the returned addresses is deallocated in InterfaceFinder destructor.
+     * @param [in] target An addrinfo linked list of destination IP addresses.
+     * @return The paths to the destination addresses that have a route, in the order of @a target.
+     */
+    std::vector<Path> find_paths(addrinfo *target);
+
     /**
      * Deletes the structures allocated and returned to the caller by find_source_interface().
      */
@@ -48,6 +70,25 @@ private:
      */
     void load_interface_list();
 
+    /**
+     * Finds a loaded interface address.
+     *
+     * @param [in] address The IP address.
+     * @param [out] if_name The name of the interface that has the address.
+     * @return A pointer to the interface address in the loaded list; nullptr if no interface has the address.
+     */
+    sockaddr *find_interface_address(const sockaddr *address, std::string &if_name);
+
+    /**
+     * Asks the kernel for the source address it would use to reach a destination: connects a UDP socket
+     * to the destination (which doesn't send anything) and reads its local address using getsockname().
+     *
+     * @param [in] dst The destination address.
+     * @param [out] if_name The name of the interface with the source address.
+     * @return A pointer to the source address in the loaded list; nullptr if there's no route to the destination.
+     */
+    sockaddr *find_route(const sockaddr *dst, std::string &if_name);
+
     /**
      * Attempts to ping a destination using an interface and its IP address (either IPv4 or IPv6).
      *
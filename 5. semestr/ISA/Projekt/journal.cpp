@@ -0,0 +1,118 @@
+// journal.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <fstream>
+#include <unistd.h>
+
+#include "journal.h"
+#include "utils.h"
+
+/** The magic bytes at the beginning of a journal file. */
+#define JOURNAL_MAGIC "SECRETJ1"
+#define JOURNAL_MAGIC_LEN 8
+/** The length of the journal header. */
+#define JOURNAL_HEADER_LEN (JOURNAL_MAGIC_LEN + PROTO_IDENTITY_LEN + 3 * sizeof(uint64_t) + sizeof(uint16_t))
+
+TransferJournal::TransferJournal(const std::string &file_name, const JournalInfo &info)
+        : path(file_name + R_JOURNAL_SUFFIX), info(info) {
+}
+
+std::vector<uint8_t> TransferJournal::header(uint64_t word_count) const {
+    std::vector<uint8_t> data(JOURNAL_HEADER_LEN);
+    auto dest = data.data();
+
+    uint64_t file_len_be = htobe64(info.file_len);
+    uint16_t chunk_size_be = htobe16(info.chunk_size);
+    uint64_t manifest_len_be = htobe64(info.manifest_len);
+    uint64_t word_count_be = htobe64(word_count);
+
+    memcpy(dest, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+    dest += JOURNAL_MAGIC_LEN;
+    memcpy(dest, info.identity, PROTO_IDENTITY_LEN);
+    dest += PROTO_IDENTITY_LEN;
+    memcpy(dest, &file_len_be, sizeof(uint64_t));
+    dest += sizeof(uint64_t);
+    memcpy(dest, &chunk_size_be, sizeof(uint16_t));
+    dest += sizeof(uint16_t);
+    memcpy(dest, &manifest_len_be, sizeof(uint64_t));
+    dest += sizeof(uint64_t);
+    memcpy(dest, &word_count_be, sizeof(uint64_t));
+
+    return data;
+}
+
+bool TransferJournal::load(ChunkTracker &tracker, std::vector<uint8_t> &manifest) const {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    // Everything but the word count must match
+    std::vector<uint8_t> data(JOURNAL_HEADER_LEN);
+    auto expected = header(0);
+    if (!file.read(reinterpret_cast<char *>(data.data()), static_cast<std::streamsize>(data.size()))
+        || memcmp(data.data(), expected.data(), JOURNAL_HEADER_LEN - sizeof(uint64_t)) != 0) {
+        return false;
+    }
+
+    uint64_t word_count;
+    memcpy(&word_count, data.data() + JOURNAL_HEADER_LEN - sizeof(uint64_t), sizeof(uint64_t));
+    word_count = be64toh(word_count);
+
+    auto chunk_count = info.file_len / info.chunk_size + 1;
+    if (word_count > chunk_count / 64 + 1) {
+        return false;
+    }
+
+    std::vector<uint64_t> words(word_count);
+    manifest.resize(info.manifest_len);
+    if (!file.read(reinterpret_cast<char *>(words.data()), static_cast<std::streamsize>(word_count * sizeof(uint64_t)))
+        || !file.read(reinterpret_cast<char *>(manifest.data()), static_cast<std::streamsize>(manifest.size()))
+        || file.peek() != std::ifstream::traits_type::eof()) {
+        return false;
+    }
+
+    for (auto &word: words) {
+        word = be64toh(word);
+    }
+
+    tracker.restore(std::move(words));
+    return true;
+}
+
+void TransferJournal::save(const ChunkTracker &tracker, const std::vector<uint8_t> &manifest) const {
+    std::vector<uint64_t> words = tracker.words();
+    for (auto &word: words) {
+        word = htobe64(word);
+    }
+
+    auto data = header(words.size());
+
+    // Write a temporary file and replace the journal with it so that it's never partial
+    auto temp_path = path + "." + std::to_string(getpid());
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        file.write(reinterpret_cast<const char *>(words.data()),
+                   static_cast<std::streamsize>(words.size() * sizeof(uint64_t)));
+        file.write(reinterpret_cast<const char *>(manifest.data()), static_cast<std::streamsize>(manifest.size()));
+
+        if (!file) {
+            log_warn("Cannot write the journal " << path);
+            std::remove(temp_path.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        log_warn("Cannot write the journal " << path);
+        std::remove(temp_path.c_str());
+    }
+}
+
+void TransferJournal::remove() const {
+    std::remove(path.c_str());
+}
@@ -0,0 +1,83 @@
+// journal.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_JOURNAL_H
+#define ISA_JOURNAL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "chunk_tracker.h"
+
+/**
+ * Identifies a transfer: the journal of a previous transfer may only be used to resume a transfer with the same
+ * identity.
+ */
+struct JournalInfo {
+    uint8_t identity[PROTO_IDENTITY_LEN]; /**< The hash of the contents sent by the sender. */
+    uint64_t file_len; /**< The length of the file (or of the batch stream). */
+    uint16_t chunk_size; /**< The chunk size (the chunk indices depend on it). */
+    uint64_t manifest_len; /**< The length of the manifest of a batch; zero for a single file. */
+};
+
+/**
+ * Keeps the state of a resumable transfer (protocol version 2) on the receiver side in a file next to the output
+ * file: the identity of the transfer, the bitmap of the received chunks and the manifest of a batch. When
+ * the receiver is restarted and the same file is sent again, the journal is loaded and only the missing chunks are
+ * requested.
+ *
+ * @remark The file is replaced atomically (using rename()). The received data are written to the output file before
+ * their chunks are saved to the journal, so the journal stays valid when the process dies (it's not synced to disk,
+ * so it may not survive a crash of the system).
+ * @remark The file: "SECRETJ1", the identity, [u64 file length][u16 chunk size][u64 manifest length][u64 number of
+ * bitmap words], the bitmap words and the manifest (all big endian).
+ */
+class TransferJournal {
+public:
+    /**
+     * Creates a TransferJournal.
+     *
+     * @param [in] file_name The name of the output file (or of the batch); the journal is saved next to it.
+     * @param [in] info The identity of the transfer.
+     */
+    TransferJournal(const std::string &file_name, const JournalInfo &info);
+
+    /**
+     * Loads the journal of a previous transfer with the same identity.
+     *
+     * @param [out] tracker The tracker to restore the received chunks to.
+     * @param [out] manifest A vector to save the manifest of a batch to.
+     * @return False if there's no journal or if it belongs to a different transfer.
+     */
+    bool load(ChunkTracker &tracker, std::vector<uint8_t> &manifest) const;
+
+    /**
+     * Saves the journal. Failures are only reported.
+     *
+     * @param [in] tracker The received chunks.
+     * @param [in] manifest The manifest of a batch (empty for a single file).
+     */
+    void save(const ChunkTracker &tracker, const std::vector<uint8_t> &manifest) const;
+
+    /**
+     * Removes the journal (when the transfer is complete).
+     */
+    void remove() const;
+
+    /** @return The path to the journal file. */
+    [[nodiscard]] const std::string &file_path() const { return path; }
+
+private:
+    std::string path; /**< The path to the journal file. */
+    JournalInfo info; /**< The identity of the transfer. */
+
+    /**
+     * @return The encoded header of the journal.
+     */
+    [[nodiscard]] std::vector<uint8_t> header(uint64_t word_count) const;
+};
+
+#endif //ISA_JOURNAL_H
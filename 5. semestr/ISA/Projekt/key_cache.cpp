@@ -0,0 +1,55 @@
+// key_cache.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <cstring>
+#include <stdexcept>
+
+#include "key_cache.h"
+
+void KeyCache::derive(const secure_string &password, const unsigned char *salt, size_t salt_len,
+                      const EVP_MD *digest, unsigned char *key, int key_len) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+        if (it->digest != digest || it->key.size() != static_cast<size_t>(key_len)
+            || it->salt.size() != salt_len || it->password.size() != password.size()) {
+            continue;
+        }
+
+        if (CRYPTO_memcmp(it->salt.data(), salt, salt_len) != 0
+            || CRYPTO_memcmp(it->password.data(), password.data(), password.size()) != 0) {
+            continue;
+        }
+
+        // Move the entry to the front
+        entries.splice(entries.begin(), entries, it);
+        memcpy(key, it->key.data(), key_len);
+        return;
+    }
+
+    if (!PKCS5_PBKDF2_HMAC(password.c_str(), static_cast<int>(password.length()), salt, static_cast<int>(salt_len),
+                           CRYPTO_KEY_DERIVATION_ITERATIONS, digest, key_len, key)) {
+        throw std::runtime_error("Cannot create encryption parameters.");
+    }
+
+    if (capacity == 0) {
+        return;
+    }
+
+    if (entries.size() >= capacity) {
+        entries.pop_back();
+    }
+
+    entries.push_front(Entry{secure_bytes(password.begin(), password.end()), secure_bytes(salt, salt + salt_len),
+                             digest, secure_bytes(key, key + key_len)});
+}
+
+void KeyCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
+
+KeyCache &KeyCache::shared() {
+    static KeyCache cache(CRYPTO_KEY_CACHE_SIZE);
+    return cache;
+}
@@ -0,0 +1,80 @@
+// key_cache.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_KEY_CACHE_H
+#define ISA_KEY_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <vector>
+#include <openssl/evp.h>
+
+#include "common.h"
+#include "secure_string.h"
+
+/** A byte vector that is wiped when deallocated. */
+typedef std::vector<unsigned char, zeroing_allocator<unsigned char> > secure_bytes;
+
+/**
+ * Caches the results of the password-based key derivation (PBKDF2) so that the same key doesn't have to be derived
+ * again for each Crypto instance. The least recently used entries are evicted when the cache is full.
+ *
+ * @remark The cached passwords and keys are wiped from memory when evicted and when the cache is destroyed.
+ * @remark The cache may be used from multiple threads.
+ */
+class KeyCache {
+public:
+    /**
+     * Creates an empty KeyCache.
+     *
+     * @param [in] capacity The maximum number of cached keys.
+     */
+    explicit KeyCache(size_t capacity) : capacity(capacity) {}
+
+    KeyCache(const KeyCache &) = delete;
+
+    KeyCache &operator=(const KeyCache &) = delete;
+
+    /**
+     * Derives a key using PBKDF2 with CRYPTO_KEY_DERIVATION_ITERATIONS iterations or takes it from the cache.
+     *
+     * @param [in] password The password.
+     * @param [in] salt The salt.
+     * @param [in] salt_len Length of the salt.
+     * @param [in] digest The digest used by PBKDF2.
+     * @param [out] key A buffer to save the key to. The caller should wipe it after use.
+     * @param [in] key_len Length of the key.
+     * @throws std::runtime_error Thrown when the key cannot be derived.
+     */
+    void derive(const secure_string &password, const unsigned char *salt, size_t salt_len, const EVP_MD *digest,
+                unsigned char *key, int key_len);
+
+    /**
+     * Removes (and wipes) all cached keys.
+     */
+    void clear();
+
+    /**
+     * @return The cache shared by all Crypto and ChunkCrypto instances.
+     */
+    static KeyCache &shared();
+
+private:
+    /**
+     * A cached key with the parameters it has been derived from.
+     */
+    struct Entry {
+        secure_bytes password; /**< The password. */
+        secure_bytes salt; /**< The salt. */
+        const EVP_MD *digest; /**< The digest. */
+        secure_bytes key; /**< The derived key. */
+    };
+
+    size_t capacity; /**< The maximum number of cached keys. */
+    std::list<Entry> entries; /**< The cached keys, the most recently used first. */
+    std::mutex mutex; /**< Guards entries. */
+};
+
+#endif //ISA_KEY_CACHE_H
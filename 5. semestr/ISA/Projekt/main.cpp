@@ -1,36 +1,118 @@
 // main.cpp
 // Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
 
-#include <fstream>
+#include <cstring>
 #include <filesystem>
+#include <vector>
 #include <unistd.h>
 
 #include "utils.h"
 #include "sender.h"
 #include "receiver.h"
 #include "secure_string.h"
+#include "metrics.h"
 
 void print_help(char *exe_name) {
-    std::cerr << "Usage: " << exe_name << " [-r filename] [-s ip/hostname] [-l[o]] [-v] [-q] [-k]" << std::endl
+    std::cerr << "Usage: " << exe_name
+              << " [-r filename] [-s ip/hostname] [-l[o][d]] [-v] [-q] [-k] [-p aimd|fixed] [-b rate] [-B rate] [-f K:M] [-c] [-z] [-1] [-M] [-m file]"
+              << std::endl
               << "Specify both -r and -s to send a file." << std::endl
+              << "Specify -r multiple times or a directory to send multiple files in one transmission." << std::endl
+              << "The file may be a pipe (e.g. /dev/stdin), its data are sent as they're read." << std::endl
               << "Use -l to receive a file. Use -o to allow overwriting an existing file. -o can only be used together with -l."
               << std::endl
+              << "Use -d together with -l to keep receiving files (multiple ones at once) until interrupted."
+              << std::endl
               << "-r/-s and -l cannot be combined." << std::endl
               << "Use -v to enable verbose output. Use -q to disable all output on stdout."
               << std::endl
-              << "Use -k to provide a custom encryption key." << std::endl;
+              << "Use -k to provide a custom encryption key." << std::endl
+              << "Use -p to choose the sender's pacing mode: adaptive (aimd, default) or fixed delays (fixed)."
+              << std::endl
+              << "Use -b and -B to set the sender's initial and maximum rate in bytes per second "
+                 "(suffixes k, M, G may be used)." << std::endl
+              << "Use -f K:M to make the sender add M parity chunks to each K data chunks (forward error correction)."
+              << std::endl
+              << "Use -c to make the transfer resumable: when it's interrupted, running the same command again only sends "
+                 "the missing data." << std::endl
+              << "Use -z to make the sender compress the data (useful for text)." << std::endl
+              << "Use -1 to make the sender use protocol version 1 (one encrypted stream, for older receivers)."
+              << std::endl
+              << "Use -M to make the sender use all paths to the receiver at once (IPv4 and IPv6, multiple interfaces)."
+              << std::endl
+              << "Use -m to write the transfer metrics as JSON to a file at exit and when SIGUSR1 is received."
+              << std::endl;
+}
+
+/**
+ * Parses a rate in bytes per second with an optional k, M or G suffix (powers of 1000).
+ * @param [in] value The string to parse.
+ * @param [out] rate The parsed rate.
+ * @return True if the value is a valid non-zero rate.
+ */
+bool parse_rate(const char *value, uint64_t &rate) {
+    char *end;
+    errno = 0;
+    double parsed = strtod(value, &end);
+    if (errno != 0 || end == value || parsed <= 0) {
+        return false;
+    }
+
+    switch (*end) {
+        case 'k':
+            parsed *= 1e3;
+            end++;
+            break;
+        case 'M':
+            parsed *= 1e6;
+            end++;
+            break;
+        case 'G':
+            parsed *= 1e9;
+            end++;
+            break;
+        default:
+            break;
+    }
+
+    rate = static_cast<uint64_t>(parsed);
+    return *end == '\0' && rate > 0;
+}
+
+/**
+ * Parses forward error correction parameters in the K:M format.
+ * @param [in] value The string to parse.
+ * @param [out] group_size The number of data chunks in a group (K).
+ * @param [out] parity_count The number of parity chunks per group (M).
+ * @return True if the values are valid (both non-zero and K + M doesn't exceed FEC_MAX_CHUNKS).
+ */
+bool parse_fec(const char *value, uint8_t &group_size, uint8_t &parity_count) {
+    unsigned int k, m;
+    int end = 0;
+    if (sscanf(value, "%u:%u%n", &k, &m, &end) != 2 || value[end] != '\0' || k == 0 || m == 0
+        || k + m > FEC_MAX_CHUNKS) {
+        return false;
+    }
+
+    group_size = static_cast<uint8_t>(k);
+    parity_count = static_cast<uint8_t>(m);
+    return true;
 }
 
 int main(int argc, char **argv) {
     int opt;
-    std::string file_name, destination;
+    std::string destination;
+    std::vector<std::string> file_names;
     bool is_sender = false, is_receiver = false, quiet = false, enter_password = false, enable_overwrite = false,
-            verbose = false;
+            verbose = false, daemon = false;
+    std::string metrics_path;
+    SenderOptions sender_options;
+    RateOptions &rate_options = sender_options.rate;
 
-    while ((opt = getopt(argc, argv, "r:s:lvqko")) != -1) {
+    while ((opt = getopt(argc, argv, "r:s:lvqkodp:b:B:f:cz1Mm:")) != -1) {
         switch (opt) {
             case 'r':
-                file_name = std::string(optarg);
+                file_names.emplace_back(optarg);
                 is_sender = true;
                 break;
             case 's':
@@ -52,14 +134,60 @@ int main(int argc, char **argv) {
             case 'o':
                 enable_overwrite = true;
                 break;
+            case 'd':
+                daemon = true;
+                break;
+            case 'p':
+                if (strcmp(optarg, "aimd") == 0) {
+                    rate_options.mode = RATE_AIMD;
+                } else if (strcmp(optarg, "fixed") == 0) {
+                    rate_options.mode = RATE_FIXED;
+                } else {
+                    print_help(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                if (!parse_rate(optarg, rate_options.initial_rate)) {
+                    print_help(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                if (!parse_rate(optarg, rate_options.max_rate)) {
+                    print_help(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                if (!parse_fec(optarg, sender_options.fec_group_size, sender_options.fec_parity_count)) {
+                    print_help(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                sender_options.resumable = true;
+                break;
+            case 'z':
+                sender_options.compress = true;
+                break;
+            case '1':
+                sender_options.protocol_version = PROTO_VERSION_STREAM;
+                break;
+            case 'M':
+                sender_options.multipath = true;
+                break;
+            case 'm':
+                metrics_path = std::string(optarg);
+                break;
             default:
                 print_help(argv[0]);
                 return EXIT_FAILURE;
         }
     }
 
-    if ((verbose && quiet) || (is_sender && (is_receiver || file_name.empty() || destination.empty())) ||
-        (!is_sender && !is_receiver)) {
+    if ((verbose && quiet) || (is_sender && (is_receiver || file_names.empty() || destination.empty())) ||
+        (!is_sender && !is_receiver) || (daemon && !is_receiver)) {
         print_help(argv[0]);
         return EXIT_FAILURE;
     }
@@ -77,26 +205,43 @@ int main(int argc, char **argv) {
 
     secure_string password = enter_password ? read_password() : DEFAULT_PASSWORD;
 
+    if (!metrics_path.empty()) {
+        // No other thread has been started yet
+        Metrics::shared().dump_on_signal(metrics_path);
+    }
+
+    int result = EXIT_SUCCESS;
     try {
         if (is_sender) {
-            auto file_path = std::filesystem::path(file_name);
-            if (!std::filesystem::exists(file_path)) {
-                log_err("The specified file doesn't exist");
-                return EXIT_FAILURE;
+            for (const auto &file_name: file_names) {
+                if (!std::filesystem::exists(file_name)) {
+                    log_err("The specified file '" << file_name << "' doesn't exist");
+                    return EXIT_FAILURE;
+                }
             }
 
-            std::fstream fs(file_name, std::fstream::in | std::fstream::binary);
-            Sender sender(destination);
-            sender.send(fs, file_path.filename(), password);
+            Sender sender(destination, sender_options);
+            auto file_path = std::filesystem::path(file_names[0]);
+
+            if (file_names.size() == 1 && !std::filesystem::is_directory(file_path)) {
+                sender.send(file_names[0], file_path.filename(), password);
+            } else {
+                // Multiple files are sent in one transmission
+                sender.send_batch(file_names, password);
+            }
         } else {
-            Receiver receiver(enable_overwrite);
+            Receiver receiver(enable_overwrite, daemon);
             receiver.accept(password);
         }
-
-        return EXIT_SUCCESS;
     } catch (std::exception const &e) {
         log_err(e.what());
-        return EXIT_FAILURE;
+        result = EXIT_FAILURE;
+    }
+
+    if (!metrics_path.empty()) {
+        Metrics::shared().dump(metrics_path);
     }
+
+    return result;
 }
 
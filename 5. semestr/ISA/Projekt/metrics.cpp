@@ -0,0 +1,126 @@
+// metrics.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "utils.h"
+
+void Histogram::record(uint64_t value) {
+    // The bucket is the number of significant bits of the value
+    auto bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    auto current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed));
+}
+
+void Histogram::write_json(std::ostream &out) const {
+    out << "{\"count\": " << count.load(std::memory_order_relaxed)
+        << ", \"sum\": " << sum.load(std::memory_order_relaxed)
+        << ", \"max\": " << max.load(std::memory_order_relaxed) << ", \"buckets\": {";
+
+    bool first = true;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        auto bucket_count = buckets[i].load(std::memory_order_relaxed);
+        if (bucket_count == 0) {
+            continue;
+        }
+
+        // The upper bound of the bucket (inclusive)
+        uint64_t upper = i == 0 ? 0 : (i == 64 ? UINT64_MAX : (uint64_t(1) << i) - 1);
+        out << (first ? "" : ", ") << "\"" << upper << "\": " << bucket_count;
+        first = false;
+    }
+
+    out << "}}";
+}
+
+Metrics::Metrics() : started_us(now_us()) {
+}
+
+void Metrics::write_json(std::ostream &out) const {
+    auto elapsed_s = static_cast<double>(now_us() - started_us) / 1000000.0;
+    auto load = [](const std::atomic<uint64_t> &counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+    auto rate = [elapsed_s](uint64_t bytes) {
+        return elapsed_s > 0 ? static_cast<uint64_t>(static_cast<double>(bytes) / elapsed_s) : 0;
+    };
+
+    out << "{\n"
+        << "  \"elapsed_s\": " << elapsed_s << ",\n"
+        << "  \"sender\": {\n"
+        << "    \"chunks_sent\": " << load(chunks_sent) << ",\n"
+        << "    \"bytes_sent\": " << load(bytes_sent) << ",\n"
+        << "    \"bytes_per_s\": " << rate(load(bytes_sent)) << ",\n"
+        << "    \"chunks_compressed\": " << load(chunks_compressed) << ",\n"
+        << "    \"parity_sent\": " << load(parity_sent) << ",\n"
+        << "    \"retransmissions\": " << load(retransmissions) << ",\n"
+        << "    \"resend_requested\": " << load(resend_requested) << ",\n"
+        << "    \"acks\": " << load(acks) << ",\n"
+        << "    \"rtt_us\": ";
+    rtt_us.write_json(out);
+    out << ",\n    \"encrypt_ns\": ";
+    encrypt_ns.write_json(out);
+
+    out << "\n  },\n"
+        << "  \"receiver\": {\n"
+        << "    \"packets_received\": " << load(packets_received) << ",\n"
+        << "    \"bytes_received\": " << load(bytes_received) << ",\n"
+        << "    \"bytes_per_s\": " << rate(load(bytes_received)) << ",\n"
+        << "    \"chunks_received\": " << load(chunks_received) << ",\n"
+        << "    \"chunks_duplicate\": " << load(chunks_duplicate) << ",\n"
+        << "    \"chunks_invalid\": " << load(chunks_invalid) << ",\n"
+        << "    \"chunks_recovered\": " << load(chunks_recovered) << ",\n"
+        << "    \"resend_requests\": " << load(resend_requests) << ",\n"
+        << "    \"decrypt_ns\": ";
+    decrypt_ns.write_json(out);
+    out << "\n  }\n}\n";
+}
+
+void Metrics::dump(const std::string &path) const {
+    // Write a temporary file and replace the file with it so that a reader never sees a partial one
+    auto temp_path = path + "." + std::to_string(getpid());
+    {
+        std::ofstream file(temp_path, std::ios::trunc);
+        write_json(file);
+
+        if (!file) {
+            log_warn("Cannot write the metrics to " << path);
+            std::remove(temp_path.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        log_warn("Cannot write the metrics to " << path);
+        std::remove(temp_path.c_str());
+    }
+}
+
+void Metrics::dump_on_signal(const std::string &path) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    // The signal is accepted synchronously, so the dump doesn't have to be async-signal-safe
+    std::thread([this, path, set]() {
+        int signal;
+        while (sigwait(&set, &signal) == 0) {
+            dump(path);
+        }
+    }).detach();
+}
+
+Metrics &Metrics::shared() {
+    static Metrics metrics;
+    return metrics;
+}
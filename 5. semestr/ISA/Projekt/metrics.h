@@ -0,0 +1,115 @@
+// metrics.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_METRICS_H
+#define ISA_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/** Adds to a counter in the shared Metrics. */
+#define metric_add(name, value) Metrics::shared().name.fetch_add(value, std::memory_order_relaxed)
+/** Records a value in a histogram in the shared Metrics. */
+#define metric_record(name, value) Metrics::shared().name.record(value)
+
+/**
+ * A histogram of non-negative values with power-of-two buckets: bucket 0 counts zeros, bucket i counts the values
+ * from 2^(i - 1) to 2^i - 1.
+ *
+ * @remark Recording only does relaxed atomic operations, so it may be used on the hot path from any thread.
+ * The values read while others are being recorded may be slightly inconsistent (e.g. the count and the sum).
+ */
+class Histogram {
+public:
+    /**
+     * Records a value.
+     *
+     * @param [in] value The value.
+     */
+    void record(uint64_t value);
+
+    /**
+     * Writes the histogram as a JSON object: the count, the sum, the maximum and the non-empty buckets
+     * (by their upper bounds).
+     *
+     * @param [in,out] out The stream to write to.
+     */
+    void write_json(std::ostream &out) const;
+
+private:
+    std::array<std::atomic<uint64_t>, 65> buckets{}; /**< The counts of the values in the buckets. */
+    std::atomic<uint64_t> count{0}; /**< The number of recorded values. */
+    std::atomic<uint64_t> sum{0}; /**< The sum of the recorded values. */
+    std::atomic<uint64_t> max{0}; /**< The highest recorded value. */
+};
+
+/**
+ * Counters and histograms describing the transfers of the process (both the sender and the receiver side).
+ * They're always collected (updating them is lock-free and doesn't format anything) and they can be written as JSON
+ * when the process exits or when it receives SIGUSR1 (see dump_on_signal()).
+ */
+struct Metrics {
+    /** The time when the metrics started to be collected (see now_us()). */
+    uint64_t started_us;
+
+    // Sender
+    std::atomic<uint64_t> chunks_sent{0}; /**< Data chunks sent (including the retransmitted ones). */
+    std::atomic<uint64_t> bytes_sent{0}; /**< Bytes of the data packets sent. */
+    std::atomic<uint64_t> chunks_compressed{0}; /**< Data chunks sent compressed. */
+    std::atomic<uint64_t> parity_sent{0}; /**< Parity chunks sent. */
+    std::atomic<uint64_t> retransmissions{0}; /**< Chunks retransmitted because they were not acknowledged in time. */
+    std::atomic<uint64_t> resend_requested{0}; /**< Chunks the receiver asked to resend. */
+    std::atomic<uint64_t> acks{0}; /**< Chunks acknowledged by Echo Replies. */
+    Histogram rtt_us; /**< The round-trip time samples in microseconds. */
+    Histogram encrypt_ns; /**< The time to (compress and) encrypt a chunk in nanoseconds. */
+
+    // Receiver
+    std::atomic<uint64_t> packets_received{0}; /**< Data packets received. */
+    std::atomic<uint64_t> bytes_received{0}; /**< Bytes of the data in the received data packets. */
+    std::atomic<uint64_t> chunks_received{0}; /**< New data chunks saved. */
+    std::atomic<uint64_t> chunks_duplicate{0}; /**< Data chunks received again. */
+    std::atomic<uint64_t> chunks_invalid{0}; /**< Data chunks that could not be decrypted or saved. */
+    std::atomic<uint64_t> chunks_recovered{0}; /**< Data chunks reconstructed from the parity chunks. */
+    std::atomic<uint64_t> resend_requests{0}; /**< 'Request Resend' messages sent. */
+    Histogram decrypt_ns; /**< The time to decrypt (and decompress) a chunk in nanoseconds. */
+
+    Metrics();
+
+    Metrics(const Metrics &) = delete;
+
+    Metrics &operator=(const Metrics &) = delete;
+
+    /**
+     * Writes the metrics as a JSON object. The rates are the averages since @a started_us.
+     *
+     * @param [in,out] out The stream to write to.
+     */
+    void write_json(std::ostream &out) const;
+
+    /**
+     * Writes the metrics as JSON to a file (the file is replaced atomically). Failures are only reported.
+     *
+     * @param [in] path The path to the file.
+     */
+    void dump(const std::string &path) const;
+
+    /**
+     * Starts a background thread that dumps the metrics to a file whenever the process receives SIGUSR1.
+     *
+     * @remark Blocks SIGUSR1 in the calling thread, so it must be called before any other thread is started
+     * (the threads inherit the signal mask and the signal is only accepted by the background thread).
+     * @param [in] path The path to the file.
+     */
+    void dump_on_signal(const std::string &path);
+
+    /**
+     * @return The metrics shared by all the components.
+     */
+    static Metrics &shared();
+};
+
+#endif //ISA_METRICS_H
@@ -0,0 +1,140 @@
+// mps_cache.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "mps_cache.h"
+
+bool MPSCache::lookup(const sockaddr *src, const sockaddr *dst, MPSResult &result) const {
+    auto src_str = addr_to_string(src);
+    auto dst_str = addr_to_string(dst);
+
+    for (const auto &entry: load()) {
+        if (entry.src == src_str && entry.dst == dst_str) {
+            result = entry.mps;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void MPSCache::store(const sockaddr *src, const sockaddr *dst, const MPSResult &result) const {
+    if (path.empty()) {
+        return;
+    }
+
+    auto entries = load();
+    Entry new_entry{addr_to_string(src), addr_to_string(dst), result, time(nullptr)};
+
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const Entry &entry) {
+        return entry.src == new_entry.src && entry.dst == new_entry.dst;
+    }), entries.end());
+    entries.push_back(new_entry);
+
+    save(std::move(entries));
+}
+
+void MPSCache::remove(const sockaddr *src, const sockaddr *dst) const {
+    if (path.empty()) {
+        return;
+    }
+
+    auto src_str = addr_to_string(src);
+    auto dst_str = addr_to_string(dst);
+    auto entries = load();
+    auto end = std::remove_if(entries.begin(), entries.end(), [&](const Entry &entry) {
+        return entry.src == src_str && entry.dst == dst_str;
+    });
+
+    if (end != entries.end()) {
+        entries.erase(end, entries.end());
+        save(std::move(entries));
+    }
+}
+
+std::string MPSCache::default_path() {
+    if (MPS_CACHE_TTL_S == 0) {
+        return "";
+    }
+
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home != nullptr && cache_home[0] != '\0') {
+        return std::string(cache_home) + "/" MPS_CACHE_FILE_NAME;
+    }
+
+    const char *home = getenv("HOME");
+    if (home != nullptr && home[0] != '\0') {
+        return std::string(home) + "/.cache/" MPS_CACHE_FILE_NAME;
+    }
+
+    return "";
+}
+
+std::vector<MPSCache::Entry> MPSCache::load() const {
+    std::vector<Entry> entries;
+    if (path.empty()) {
+        return entries;
+    }
+
+    std::ifstream file(path);
+    std::string line;
+    auto now = time(nullptr);
+
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        Entry entry{};
+        long long stored_at;
+
+        // Skip malformed and expired entries
+        if (!(fields >> entry.src >> entry.dst >> entry.mps.packet_size >> entry.mps.data_size >> stored_at)) {
+            continue;
+        }
+
+        entry.stored_at = static_cast<time_t>(stored_at);
+        if (entry.stored_at > now || now - entry.stored_at >= MPS_CACHE_TTL_S) {
+            continue;
+        }
+
+        entries.push_back(entry);
+    }
+
+    return entries;
+}
+
+void MPSCache::save(std::vector<Entry> entries) const {
+    if (entries.size() > MPS_CACHE_MAX_ENTRIES) {
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return a.stored_at > b.stored_at;
+        });
+        entries.resize(MPS_CACHE_MAX_ENTRIES);
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+    // Write a temporary file and replace the cache with it so that the readers never see a partial file
+    auto temp_path = path + "." + std::to_string(getpid());
+    {
+        std::ofstream file(temp_path, std::ios::trunc);
+        for (const auto &entry: entries) {
+            file << entry.src << ' ' << entry.dst << ' ' << entry.mps.packet_size << ' ' << entry.mps.data_size
+                 << ' ' << static_cast<long long>(entry.stored_at) << '\n';
+        }
+
+        if (!file) {
+            log_verbose("Cannot write the maximum packet size cache");
+            std::remove(temp_path.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        log_verbose("Cannot write the maximum packet size cache");
+        std::remove(temp_path.c_str());
+    }
+}
@@ -0,0 +1,89 @@
+// mps_cache.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_MPS_CACHE_H
+#define ISA_MPS_CACHE_H
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "packet_utils.h"
+
+/**
+ * Caches the discovered maximum packet sizes for pairs of source and destination addresses in a file, so that
+ * the search doesn't have to be repeated for each transmission. The entries expire after MPS_CACHE_TTL_S seconds.
+ *
+ * @remark The file is a text file with one entry per line: the source address, the destination address, the maximum
+ * packet size, the maximum data length and the UNIX time the entry was stored at. It's replaced atomically (using
+ * rename()), so multiple processes may use it at once; concurrent updates may get lost, which is harmless.
+ * @remark The cache is best-effort: when the file cannot be read or written, it behaves as if it were empty.
+ */
+class MPSCache {
+public:
+    /**
+     * Creates an MPSCache.
+     *
+     * @param [in] path The path to the cache file; if empty, the cache is disabled.
+     */
+    explicit MPSCache(std::string path = default_path()) : path(std::move(path)) {};
+
+    /**
+     * Finds an unexpired entry.
+     *
+     * @param [in] src The source address.
+     * @param [in] dst The destination address.
+     * @param [out] result The cached maximum packet size.
+     * @return True if the entry has been found.
+     */
+    bool lookup(const sockaddr *src, const sockaddr *dst, MPSResult &result) const;
+
+    /**
+     * Adds or replaces an entry.
+     *
+     * @param [in] src The source address.
+     * @param [in] dst The destination address.
+     * @param [in] result The maximum packet size to store.
+     */
+    void store(const sockaddr *src, const sockaddr *dst, const MPSResult &result) const;
+
+    /**
+     * Removes an entry (if it exists).
+     *
+     * @param [in] src The source address.
+     * @param [in] dst The destination address.
+     */
+    void remove(const sockaddr *src, const sockaddr *dst) const;
+
+    /**
+     * @return The path to the cache file in the user's cache directory ($XDG_CACHE_HOME or ~/.cache); empty if
+     * neither is known or if the cache is disabled (MPS_CACHE_TTL_S is zero).
+     */
+    static std::string default_path();
+
+private:
+    /** A cache entry. */
+    struct Entry {
+        std::string src; /**< The source address. */
+        std::string dst; /**< The destination address. */
+        MPSResult mps; /**< The maximum packet size. */
+        time_t stored_at; /**< The time the entry was stored at. */
+    };
+
+    std::string path; /**< The path to the cache file. */
+
+    /**
+     * @return The unexpired entries stored in the file.
+     */
+    [[nodiscard]] std::vector<Entry> load() const;
+
+    /**
+     * Replaces the file with the specified entries (the newest MPS_CACHE_MAX_ENTRIES ones).
+     *
+     * @param [in] entries The entries.
+     */
+    void save(std::vector<Entry> entries) const;
+};
+
+#endif //ISA_MPS_CACHE_H
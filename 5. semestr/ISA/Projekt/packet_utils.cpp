@@ -25,38 +25,8 @@ struct addrinfo *resolve(const string &hostname) {
     return res;
 }
 
-/*
- * Author: P. D. Buchan (pdbuchan@yahoo.com)
- * Source: https://www.pdbuchan.com/rawsock/icmp4.c
- * Distributed under the GNU GPL.
- */
-uint16_t inet_checksum(uint16_t *value, int len) {
-    int count = len;
-    uint32_t sum = 0;
-    uint16_t answer = 0;
-
-    // Sum up 2-byte values until none or only one byte left.
-    while (count > 1) {
-        sum += *(value++);
-        count -= 2;
-    }
-
-    // Add left-over byte, if any.
-    if (count > 0) {
-        sum += *(uint8_t *) value;
-    }
-
-    // Fold 32-bit sum into 16 bits; we lose information by doing this,
-    // increasing the chances of a collision.
-    // sum = (lower 16 bits) + (upper 16 bits shifted right 16 bits)
-    while (sum >> 16) {
-        sum = (sum & 0xffff) + (sum >> 16);
-    }
-
-    // Checksum is one's complement of sum.
-    answer = ~sum;
-
-    return (answer);
+uint16_t inet_checksum(const void *data, size_t len) {
+    return checksum_fold(checksum_add(data, len));
 }
 
 uint16_t make_icmp4_packet(uint8_t *res_packet, in_addr dst_addr, in_addr src_addr, uint16_t id, uint16_t seq,
@@ -158,119 +128,154 @@ uint16_t make_icmp_packet(uint8_t *res_buffer, uint8_t *&res_packet, Channel *ch
                             data, data_len);
 }
 
-MPSResult find_max_packet_size(Channel &channel, uint16_t init_ceiling) {
-    // Buffer for assembled packets
-    uint8_t packet_buffer[init_ceiling];
-    uint8_t *packet;
+void make_echo_header_template(EchoHeaderTemplate &header_template, const sockaddr *dst, const sockaddr *src) {
+    header_template = {};
 
-    // Header size (always the same)
-    uint16_t header_size = (channel.dst_addr.family == AF_INET ? IP4_HEADER_LEN : IP6_HEADER_LEN)
-                           + ICMP_HEADER_LEN;
+    if (dst->sa_family == AF_INET) {
+        struct ip ip_header{};
+        ip_header.ip_v = 4;
+        ip_header.ip_hl = IP4_HEADER_LEN / 4;
+        ip_header.ip_ttl = 255;
+        ip_header.ip_p = IPPROTO_ICMP;
+        ip_header.ip_src = reinterpret_cast<const sockaddr_in *>(src)->sin_addr;
+        ip_header.ip_dst = reinterpret_cast<const sockaddr_in *>(dst)->sin_addr;
+
+        // The Total Length is added to the checksum for each packet
+        header_template.ip_checksum = inet_checksum(&ip_header, IP4_HEADER_LEN);
+        memcpy(header_template.data, &ip_header, IP4_HEADER_LEN);
+        header_template.data[IP4_HEADER_LEN] = ICMP_ECHO;
+        header_template.len = IP4_HEADER_LEN + ICMP_HEADER_LEN;
+    } else {
+        header_template.data[0] = ICMP6_ECHO_REQUEST;
+        header_template.len = ICMP_HEADER_LEN;
+    }
+}
+
+uint8_t make_echo_header(const EchoHeaderTemplate &header_template, uint8_t *dest, uint16_t id, uint16_t seq,
+                         const void *data, uint16_t data_len) {
+    memcpy(dest, header_template.data, header_template.len);
+
+    auto icmp_header = reinterpret_cast<ICMPEchoHeader *>(dest + header_template.len - ICMP_HEADER_LEN);
+    icmp_header->id = htons(id);
+    icmp_header->seq = htons(seq);
 
-    // Packet size and data size tried in the current step
-    uint16_t current_packet_size = init_ceiling;
-    uint16_t left_for_data = init_ceiling - header_size;
+    if (header_template.len == ICMP_HEADER_LEN) {
+        // IPv6: the kernel fills in the checksum
+        return header_template.len;
+    }
+
+    auto ip_header = reinterpret_cast<struct ip *>(dest);
+    ip_header->ip_len = htons(header_template.len + data_len);
+    ip_header->ip_sum = checksum_adjust(header_template.ip_checksum, 0, ip_header->ip_len);
 
-    // Binary search bounds
-    uint16_t left = 0;
-    uint16_t right = current_packet_size;
+    icmp_header->checksum = checksum_fold(checksum_add(data, data_len, checksum_add(icmp_header, ICMP_HEADER_LEN)));
+    return header_template.len;
+}
 
-    // Binary search threshold
-    const uint16_t threshold = MPS_SEARCH_THRESHOLD;
+MPSResult find_max_packet_size(Channel &channel, uint16_t init_ceiling) {
+    // Header size (always the same)
+    uint16_t header_size = (channel.dst_addr.family == AF_INET ? IP4_HEADER_LEN : IP6_HEADER_LEN)
+                           + ICMP_HEADER_LEN;
 
-    // An array of zeros to use as the ICMP Echo Request data
-    char dummy_data[left_for_data];
-    memset(dummy_data, 0, left_for_data);
+    // The highest size known to be deliverable and the lowest size known not to be
+    uint16_t lower = header_size;
+    uint32_t upper = init_ceiling + 1;
 
-    AnyIPAddress recv_addr{};
+    // Buffers for assembled and received packets; an array of zeros to use as the ICMP Echo Request data
+    std::vector<uint8_t> packet_buffer(init_ceiling);
+    std::vector<uint8_t> recv_buffer(init_ceiling);
+    std::vector<char> dummy_data(init_ceiling, 0);
+    uint8_t *packet;
 
     int socket_fd = channel.socket_fd;
     uint16_t seq = 0;
-    uint64_t id = getpid();
+    uint16_t id = getpid();
 
-    while (seq < init_ceiling) {
-        uint16_t total_len = make_icmp_packet(packet_buffer, packet, &channel.dst_addr.sock, &channel.src_addr.sock,
-                                              id, seq++, dummy_data, left_for_data);
+    // The first round tries the common path MTUs, the following ones split the remaining interval evenly
+    std::vector<uint16_t> sizes = MPS_PROBE_LADDER;
+    sizes.insert(sizes.begin(), init_ceiling);
 
-        assert(total_len <= init_ceiling);
-        log_verbose("Sending PSD packet #" << seq << " (trying size " << current_packet_size << ")");
+    while (upper - lower > MPS_SEARCH_THRESHOLD) {
+        if (seq > 0) {
+            sizes.clear();
+            for (uint32_t i = 1; i <= MPS_PROBE_COUNT; i++) {
+                sizes.push_back(lower + (upper - lower) * i / (MPS_PROBE_COUNT + 1));
+            }
+        }
 
-        // Send ping
-        if (sendto(socket_fd, packet, total_len, 0, &channel.dst_addr.sock, channel.addr_len) == -1) {
-            if (errno == EMSGSIZE) {
-                log_verbose("Packet not sent (EMSGSIZE)");
-                // Kernel refused to send the message because it knows the MTU is lower
-                // Try lower packet size
-                right = current_packet_size;
-                current_packet_size = left + ((right - left) / 2);
-                left_for_data = current_packet_size - header_size;
-            } else {
-                THROW_ERRNO();
+        // Send all probes at once, remember their sizes by seq
+        std::unordered_map<uint16_t, uint16_t> pending;
+        for (auto size: sizes) {
+            if (size <= lower || size >= upper) {
+                continue;
             }
-        } else {
-            // Wait for response
-            socklen_t recv_addr_len = channel.addr_len;
-            ssize_t received = 0;
-
-            while (!sockaddr_eq(&channel.dst_addr.sock, &recv_addr.sock)) {
-                log_verbose("Waiting for response for PSD packet #" << seq);
-                received = recvfrom(socket_fd, packet_buffer, init_ceiling, 0, &recv_addr.sock, &recv_addr_len);
-
-                if (received == -1) {
-                    recv_addr = {};
-                    break;
-                }
 
-                if (channel.dst_addr.family == AF_INET) {
-                    auto recv_header = reinterpret_cast<icmp *>(packet + IP4_HEADER_LEN);
-                    if (recv_header->icmp_type != ICMP_ECHOREPLY) {
-                        recv_addr = {};
-                        continue;
-                    }
-                } else {
-                    auto recv_header = reinterpret_cast<icmp6_hdr *>(packet_buffer);
-                    if (recv_header->icmp6_type != ICMP6_ECHO_REPLY) {
-                        recv_addr = {};
-                        continue;
-                    }
+            uint16_t total_len = make_icmp_packet(packet_buffer.data(), packet, &channel.dst_addr.sock,
+                                                  &channel.src_addr.sock, id, seq, dummy_data.data(),
+                                                  size - header_size);
+            log_verbose("Sending PSD packet #" << seq << " (trying size " << size << ")");
+
+            if (sendto(socket_fd, packet, total_len, 0, &channel.dst_addr.sock, channel.addr_len) == -1) {
+                if (errno != EMSGSIZE) {
+                    THROW_ERRNO();
                 }
+
+                // Kernel refused to send the message because it knows the MTU is lower
+                log_verbose("Packet not sent (EMSGSIZE)");
+                upper = std::min<uint32_t>(upper, size);
+            } else {
+                pending[seq] = size;
             }
 
-            if (received == -1) {
-                log_verbose("No response for PSD packet #" << seq << " (timeout)");
+            seq++;
+        }
 
-                // No response: consider the packet undelivered and try again
-                right = current_packet_size;
-                current_packet_size = left + ((right - left) / 2);
+        // Collect the replies until all the probes above the confirmed size are answered or the timeout expires
+        auto deadline = now_us() + MPS_RECV_TIMEOUT_MS * 1000;
+        auto outstanding = [&]() {
+            return std::any_of(pending.begin(), pending.end(), [&](auto &probe) { return probe.second > lower; });
+        };
 
-                if (current_packet_size <= header_size) {
-                    throw std::runtime_error("cannot find maximum packet length (destination unreachable?)");
-                }
-                left_for_data = current_packet_size - header_size;
-                continue;
+        while (outstanding()) {
+            auto now = now_us();
+            if (now >= deadline || !channel.poll_in(static_cast<int64_t>(deadline - now))) {
+                break;
             }
 
-            log_verbose("Got response for PSD packet #" << seq);
-
-            // We got a response, attempt increasing the value
-            left = current_packet_size;
-            size_t new_packet_size = left + ((right - left) / 2);
+            auto received = channel.recvfrom(recv_buffer.data(), recv_buffer.size(), MSG_DONTWAIT);
+            ICMPEchoHeader header{};
+            uint8_t *data_begin;
+            uint16_t data_len;
 
-            if (new_packet_size >= init_ceiling || (new_packet_size - current_packet_size) <= threshold) {
-                log_verbose("Target threshold " << threshold << " reached with maximum packet size "
-                                                << current_packet_size);
+            if (!received.success() || !received.is_channel_address
+                || !parse_icmp_echo_packet(recv_buffer.data(), received.size, channel.dst_addr.family, header,
+                                           data_begin, data_len)
+                || (header.type != ICMP_ECHOREPLY && header.type != ICMP6_ECHO_REPLY) || header.id != id) {
+                continue;
+            }
 
-                auto result = MPSResult{.packet_size = current_packet_size};
-                result.data_size = left_for_data;
-                return result;
+            auto it = pending.find(header.seq);
+            if (it != pending.end()) {
+                log_verbose("Got response for PSD packet #" << header.seq << " (size " << it->second << ")");
+                lower = std::max(lower, it->second);
+                pending.erase(it);
             }
+        }
 
-            current_packet_size = new_packet_size;
-            left_for_data = current_packet_size - header_size;
+        // The probes above the confirmed size that haven't been answered are considered undeliverable
+        for (auto &probe: pending) {
+            if (probe.second > lower) {
+                upper = std::min<uint32_t>(upper, probe.second);
+            }
         }
     }
 
-    throw std::runtime_error("Cannot find maximum packet size");
+    if (lower == header_size) {
+        throw std::runtime_error("cannot find maximum packet length (destination unreachable?)");
+    }
+
+    log_verbose("Target threshold " << MPS_SEARCH_THRESHOLD << " reached with maximum packet size " << lower);
+    return MPSResult{.packet_size = lower, .data_size = static_cast<uint16_t>(lower - header_size)};
 }
 
 bool parse_icmp_echo_packet(uint8_t *input_packet, uint16_t input_len, sa_family_t family, ICMPEchoHeader &header,
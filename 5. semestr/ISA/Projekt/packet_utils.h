@@ -18,11 +18,15 @@
 #include <arpa/inet.h>
 #include <iomanip>
 #include <cassert>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 
 #include "common.h"
 #include "errors.h"
 #include "utils.h"
 #include "channel.h"
+#include "checksum.h"
 
 /**
  * A result of find_max_packet_size().
@@ -52,12 +56,13 @@ struct addrinfo *resolve(const std::string &hostname);
 /**
  * Computes an internet checksum.
  *
- * @param [in] addr A pointer to the start of data to calculate checksum for.
- * @param [in] len Total number of 32-bit words in the data.
+ * @param [in] data A pointer to the start of data to calculate checksum for.
+ * @param [in] len Length of the data in bytes.
  * @return The internet checksum for the specified data.
  * @see <a href="https://datatracker.ietf.org/doc/html/rfc1071">RFC 1071</a>
+ * @see checksum.h
  */
-uint16_t inet_checksum(uint16_t *addr, int len);
+uint16_t inet_checksum(const void *data, size_t len);
 
 /**
  * Creates an IPv4 or IPv6 packet encapsulating an ICMP(v6) Echo Request with the specified data.
@@ -123,23 +128,60 @@ uint16_t make_icmp4_packet(uint8_t *res_packet, in_addr dst_addr, in_addr src_ad
 uint16_t make_icmp6_packet(uint8_t *res_buffer, uint8_t *&res_packet, in6_addr dst_addr, in6_addr src_addr,
                            uint16_t id, uint16_t seq, char *data, uint16_t data_len);
 
+/**
+ * Prepares the headers of Echo Request packets sent from a source to a destination address: the IPv4 header
+ * (in IPv4) and the ICMP(v6) Echo Request header with the fields that don't change between packets.
+ *
+ * @param [out] header_template The template to fill.
+ * @param [in] dst The destination IPv4 or IPv6 address.
+ * @param [in] src The source (interface) IPv4 or IPv6 address.
+ */
+void make_echo_header_template(EchoHeaderTemplate &header_template, const sockaddr *dst, const sockaddr *src);
+
+/**
+ * Creates the headers of an Echo Request packet from a template. The data are not copied; the packet is sent as
+ * the headers followed by the data (e.g. using SendBatch::add() with two parts).
+ *
+ * @remark The IPv4 header checksum is updated incrementally (RFC 1624). In IPv6, the ICMPv6 checksum is left zero
+ * as the kernel always computes it for raw ICMPv6 sockets (RFC 3542, section 3.1).
+ * @param [in] header_template The template created by make_echo_header_template().
+ * @param [out] dest A buffer of at least IP4_HEADER_LEN + ICMP_HEADER_LEN bytes to save the headers to.
+ * @param [in] id A value for the ICMP Identification header field.
+ * @param [in] seq A value for the ICMP Sequence Number header field.
+ * @param [in] data A pointer to the data that will follow the headers (used to compute the checksum).
+ * @param [in] data_len The length of the data.
+ * @return Length of the headers.
+ */
+uint8_t make_echo_header(const EchoHeaderTemplate &header_template, uint8_t *dest, uint16_t id, uint16_t seq,
+                         const void *data, uint16_t data_len);
+
 /**
  * Discovers the maximum size of an ICMP IP packet that can be delivered to the specified destination.
  *
  * @remarks
- * Uses modified binary search: it starts at the value of init_ceiling, if delivery is unsuccessful, the value
- * is halved until a sufficiently low value is found. This value is then used as the lower bound and from this moment,
- * a normal binary search ensues.
- * This behaviour is used because it is expected that init_ceiling has a fairly high chance of being the wanted value.
+ * Sends a ladder of probes of different sizes at once and matches the replies by their seq. The first round tries
+ * init_ceiling and the common path MTUs (MPS_PROBE_LADDER); each following round sends MPS_PROBE_COUNT probes that
+ * evenly split the interval between the highest answered size and the lowest unanswered one. A round ends when all
+ * the probes that could raise the result are answered, or after MPS_RECV_TIMEOUT_MS.
  * @remarks
  * MPS_SEARCH_THRESHOLD is used to determine the search accuracy.
  * @param [in] channel A descriptor of the communication channel.
  * @param [in] init_ceiling The initial maximum value of the IP packet size.
  * @return A MPSResult structure with the found maximum IP packet size and corresponding maximum data length.
+ * @throws std::runtime_error Thrown when no probe is answered.
  * @see MPS_SEARCH_THRESHOLD
  */
 MPSResult find_max_packet_size(Channel &channel, uint16_t init_ceiling);
 
+/**
+ * Returns the seq a data chunk is sent with (the seqs wrap around after PROTO_DATA_SEQ_COUNT chunks).
+ * @param [in] index The chunk index.
+ * @return The seq.
+ */
+inline uint16_t data_seq(uint64_t index) {
+    return static_cast<uint16_t>(index % PROTO_DATA_SEQ_COUNT + 2);
+}
+
 /**
  * Parses the data received from a socket as an ICMP Echo packet.
  * @param [in] input_packet An input buffer with the received data.
@@ -0,0 +1,126 @@
+// rate_control.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+
+#include "common.h"
+#include "rate_control.h"
+
+RateController::RateController(const RateOptions &options, uint16_t packet_len)
+        : mode(options.mode), packet_len(packet_len) {
+    max_rate_bps = options.max_rate == 0 ? static_cast<double>(UINT64_MAX) : static_cast<double>(options.max_rate);
+
+    if (options.initial_rate != 0) {
+        rate_bps = static_cast<double>(options.initial_rate);
+    } else {
+        // The rate the compile-time delays would result in
+        rate_bps = S_DELAY_AFTER_SENT_CHUNKS * static_cast<double>(packet_len) * 1000000.0 / S_DELAY_US;
+    }
+
+    // The maximum set by the user wins over S_RATE_MIN (std::clamp requires the bounds to be ordered)
+    rate_bps = std::min(max_rate_bps, std::max<double>(S_RATE_MIN, rate_bps));
+    increase_step = rate_bps / S_RATE_INCREASE_DIVISOR;
+}
+
+int64_t RateController::time_to_send(uint64_t now_us) const {
+    return next_send_us > now_us ? static_cast<int64_t>(next_send_us - now_us) : 0;
+}
+
+void RateController::on_sent(uint64_t now_us, uint16_t len) {
+    if (len == 0) {
+        len = packet_len;
+    }
+
+    sent_total++;
+    interval_sent++;
+    interval_bytes += len;
+
+    if (mode == RATE_FIXED) {
+        if (!resending && S_DELAY_AFTER_SENT_CHUNKS > 0 && sent_total % S_DELAY_AFTER_SENT_CHUNKS == 0) {
+            next_send_us = now_us + S_DELAY_US;
+        } else if (resending && S_RESEND_DELAY_AFTER_SENT_CHUNKS > 0
+                   && sent_total % S_RESEND_DELAY_AFTER_SENT_CHUNKS == 0) {
+            next_send_us = now_us + S_RESEND_DELAY_US;
+        }
+
+        return;
+    }
+
+    // Allow a short burst after an idle period, but don't accumulate more credit than that
+    // The burst is measured in full-sized packets
+    auto interval_us = static_cast<uint64_t>(len * 1000000.0 / rate_bps);
+    auto burst_us = static_cast<uint64_t>(S_RATE_BURST * packet_len * 1000000.0 / rate_bps);
+    uint64_t earliest = now_us > burst_us ? now_us - burst_us : 0;
+    next_send_us = std::max(next_send_us, earliest) + interval_us;
+}
+
+void RateController::on_ack(uint64_t now_us, uint64_t srtt_us, uint64_t min_rtt_us) {
+    last_srtt_us = srtt_us;
+    if (min_rtt_us != UINT64_MAX && srtt_us > min_rtt_us * S_WINDOW_RTT_INFLATION + S_WINDOW_RTT_SLACK_US) {
+        interval_rtt_inflated = true;
+    }
+
+    evaluate(now_us);
+}
+
+void RateController::on_loss(uint64_t now_us) {
+    interval_lost++;
+    evaluate(now_us);
+}
+
+void RateController::on_receiver_loss(uint64_t missing, uint64_t total) {
+    if (mode == RATE_FIXED || missing == 0 || total == 0) {
+        return;
+    }
+
+    if (static_cast<double>(missing) / static_cast<double>(total) > S_RATE_LOSS_TOLERANCE) {
+        decrease();
+    }
+}
+
+void RateController::on_queue_full(uint64_t now_us, uint64_t count) {
+    interval_lost += count;
+    evaluate(now_us);
+}
+
+void RateController::evaluate(uint64_t now_us) {
+    if (mode == RATE_FIXED) {
+        return;
+    }
+
+    if (interval_start_us == 0) {
+        interval_start_us = now_us;
+        return;
+    }
+
+    uint64_t interval_len = std::max<uint64_t>(2 * last_srtt_us, S_RATE_INTERVAL_MIN_US);
+    if (now_us - interval_start_us < interval_len) {
+        return;
+    }
+
+    double loss_ratio = interval_sent == 0 ? 0.0 : static_cast<double>(interval_lost) / interval_sent;
+
+    if (loss_ratio > S_RATE_LOSS_TOLERANCE || interval_rtt_inflated) {
+        decrease();
+    } else {
+        // Only increase the rate when it is actually the limit (the sender is not application-limited)
+        double achieved = static_cast<double>(interval_bytes) * 1000000.0
+                          / static_cast<double>(now_us - interval_start_us);
+        if (achieved >= rate_bps / 2) {
+            rate_bps = startup ? rate_bps * 2 : rate_bps + increase_step;
+            rate_bps = std::min(rate_bps, max_rate_bps);
+        }
+    }
+
+    interval_start_us = now_us;
+    interval_sent = 0;
+    interval_bytes = 0;
+    interval_lost = 0;
+    interval_rtt_inflated = false;
+}
+
+void RateController::decrease() {
+    startup = false;
+    rate_bps = std::min(max_rate_bps, std::max<double>(S_RATE_MIN, rate_bps * S_RATE_DECREASE_FACTOR));
+    increase_step = rate_bps / S_RATE_INCREASE_DIVISOR;
+}
@@ -0,0 +1,145 @@
+// rate_control.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_RATE_CONTROL_H
+#define ISA_RATE_CONTROL_H
+
+#include <cstdint>
+
+/**
+ * Describes the strategy used to pace the sent chunks.
+ */
+enum RateMode {
+    /**
+     * The sending rate is adjusted at runtime: it grows until a loss or an inflated round-trip time is detected,
+     * then it is decreased multiplicatively and grows by a constant step again (AIMD).
+     */
+    RATE_AIMD,
+
+    /**
+     * The compile-time delays are used: S_DELAY_US after each S_DELAY_AFTER_SENT_CHUNKS chunks (S_RESEND_DELAY_US
+     * after each S_RESEND_DELAY_AFTER_SENT_CHUNKS chunks when resending).
+     */
+    RATE_FIXED
+};
+
+/**
+ * Rate control settings, usually provided by the user.
+ */
+struct RateOptions {
+    RateMode mode = RATE_AIMD; /**< The pacing strategy. */
+    /** The initial sending rate in bytes per second. If zero, it is derived from the S_DELAY_* constants. */
+    uint64_t initial_rate = 0;
+    /** The maximum sending rate in bytes per second. If zero, the rate is not limited. */
+    uint64_t max_rate = 0;
+};
+
+/**
+ * Paces the sent packets and adjusts the sending rate based on the losses and the round-trip time measured
+ * from the Echo Replies and on the losses reported by the receiver.
+ *
+ * @remark The rate is evaluated once per measurement interval (two smoothed round-trip times, at least
+ * S_RATE_INTERVAL_MIN_US). If no Echo Replies arrive, the rate never changes.
+ */
+class RateController {
+public:
+    /**
+     * Creates a RateController.
+     *
+     * @param [in] options The rate control settings.
+     * @param [in] packet_len The (maximum) length of a sent packet in bytes.
+     */
+    RateController(const RateOptions &options, uint16_t packet_len);
+
+    /**
+     * @param [in] now_us The current time.
+     * @return Number of microseconds to wait before the next packet may be sent (zero if it may be sent now).
+     */
+    [[nodiscard]] int64_t time_to_send(uint64_t now_us) const;
+
+    /**
+     * Registers a sent packet and schedules the next one (the smaller the packet, the sooner).
+     *
+     * @param [in] now_us The current time.
+     * @param [in] len The length of the packet in bytes; zero for the maximum length.
+     */
+    void on_sent(uint64_t now_us, uint16_t len = 0);
+
+    /**
+     * Registers an acknowledged packet.
+     *
+     * @param [in] now_us The current time.
+     * @param [in] srtt_us The current smoothed round-trip time.
+     * @param [in] min_rtt_us The lowest measured round-trip time.
+     */
+    void on_ack(uint64_t now_us, uint64_t srtt_us, uint64_t min_rtt_us);
+
+    /**
+     * Registers a packet that has not been acknowledged in time.
+     *
+     * @param [in] now_us The current time.
+     */
+    void on_loss(uint64_t now_us);
+
+    /**
+     * Registers the chunks the receiver requested to resend (it had not received them even though their delivery
+     * may have been acknowledged by the receiver's system). Decreases the rate.
+     *
+     * @param [in] missing The number of missing chunks.
+     * @param [in] total The total number of chunks sent.
+     */
+    void on_receiver_loss(uint64_t missing, uint64_t total);
+
+    /**
+     * Registers packets that had to wait because the output queue of the local network interface was full.
+     * They're counted as lost packets.
+     *
+     * @param [in] now_us The current time.
+     * @param [in] count The number of packets.
+     */
+    void on_queue_full(uint64_t now_us, uint64_t count);
+
+    /**
+     * Switches between the initial transmission and resending (only affects RATE_FIXED).
+     *
+     * @param [in] value True when resending chunks.
+     */
+    void set_resending(bool value) { resending = value; }
+
+    /** @return The current sending rate in bytes per second. */
+    [[nodiscard]] uint64_t rate() const { return static_cast<uint64_t>(rate_bps); }
+
+private:
+    RateMode mode; /**< The pacing strategy. */
+    uint16_t packet_len; /**< The length of a sent packet. */
+    double rate_bps; /**< The current sending rate in bytes per second. */
+    double max_rate_bps; /**< The maximum sending rate in bytes per second. */
+    double increase_step; /**< The additive increase step; set on every decrease. */
+    bool startup = true; /**< Signalises that the rate doubles every interval (before the first decrease). */
+    bool resending = false; /**< Signalises that chunks are being resent. */
+
+    uint64_t next_send_us = 0; /**< Time when the next packet may be sent. */
+    uint64_t sent_total = 0; /**< Number of packets sent. */
+
+    uint64_t interval_start_us = 0; /**< Start of the current measurement interval. */
+    uint64_t interval_sent = 0; /**< Number of packets sent in the current measurement interval. */
+    uint64_t interval_bytes = 0; /**< Number of bytes sent in the current measurement interval. */
+    uint64_t interval_lost = 0; /**< Number of packets lost in the current measurement interval. */
+    bool interval_rtt_inflated = false; /**< Signalises an inflated round-trip time in the current interval. */
+    uint64_t last_srtt_us = 0; /**< The last known smoothed round-trip time. */
+
+    /**
+     * Evaluates the current measurement interval if it has ended and adjusts the rate.
+     *
+     * @param [in] now_us The current time.
+     */
+    void evaluate(uint64_t now_us);
+
+    /**
+     * Decreases the rate multiplicatively and ends the startup phase.
+     */
+    void decrease();
+};
+
+#endif //ISA_RATE_CONTROL_H
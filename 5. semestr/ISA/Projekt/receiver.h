@@ -6,130 +6,131 @@
 #define ISA_RECEIVER_H
 
 #include <string>
-#include <fstream>
-#include <list>
+#include <unordered_map>
+#include <vector>
 
 #include "common.h"
 #include "secure_string.h"
 #include "channel.h"
+#include "receiver_session.h"
+#include "event_loop.h"
 
 class Receiver {
 public:
-    explicit Receiver(bool enable_overwrite) : mode(ONE_WAY), enable_overwrite(enable_overwrite) {};
+    /**
+     * Creates a Receiver.
+     *
+     * @param [in] enable_overwrite Signalises if Receiver should allow overwriting an existing file.
+     * @param [in] daemon If true, the Receiver keeps accepting transmissions (multiple ones at once) until it's
+     * interrupted by a signal. Otherwise, it only accepts one transmission.
+     */
+    Receiver(bool enable_overwrite, bool daemon) : enable_overwrite(enable_overwrite), daemon(daemon) {};
 
     /**
-     * Opens two raw sockets – one for IPv4, one for IPv6 – and listens on both in parallel until a 'Hello' protocol
-     * is received. Then closes the other socket and performs all steps of data transmission.
+     * Opens two raw sockets – one for IPv4, one for IPv6 – and listens on both in an event loop. When a 'Hello'
+     * protocol message is received, creates a ReceiverSession for the transmission and passes it all the packets that
+     * belong to it. The sessions' timeouts are timers in the event loop. Returns when the transmission ends (or, in the daemon mode, when a signal is received).
      *
      * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
+     * @throws std::runtime_error Thrown when the transmission fails (except in the daemon mode, where the failed
+     * transmission is only logged and the Receiver continues).
      */
     void accept(const secure_string &password);
 
     ~Receiver();
 
 private:
-    TransmissionMode mode; /**< The current mode of transmission. */
-    Channel *channel{}; /**< Encapsulates the socket currently used for communication. */
-    char input_buffer[R_RECV_BUFFER_SIZE]{}; /**< A buffer for storing received data. */
-    uint16_t trans_id{}; /**< The current transaction ID. */
-
     bool enable_overwrite; /**< Signalises if Receiver should allow overwriting an existing file. */
-    uint64_t recv_encrypted_file_len{}; /**< The total length of the encrypted data that is being received. */
-    std::list<uint16_t> missed_seqs; /**< A list of sequence numbers of chunks that haven't been received. */
+    bool daemon; /**< Signalises if Receiver should keep accepting transmissions. */
+    bool accepted_one = false; /**< Signalises if a transmission has been accepted (when not in the daemon mode). */
 
-    /** Signalises if a 'Transmission Finished' protocol packet with total number of chunks has been received. */
-    bool last_seq_received = false;
-    uint16_t highest_seq_received = 0; /**< The largest chunk sequence number that has been received. */
-
-    /**
-     * FILE identifier of the temporary file used to store received encrypted data.
-     * Populated if R_USE_TEMP_FILE is set to 1.
-     */
-    FILE *tmp_file{};
-    /**
-     * Pointer to memory-mapped temporary file used to store received encrypted data.
-     * Populated if R_USE_TEMP_FILE is set to 1.
-     * */
-    void *tmp_file_mem{};
+    Channel *listen_channels[2]{}; /**< Channels that own the IPv4 and the IPv6 socket. */
+    /** The running sessions by their transaction ID. Multiple senders may use the same transaction ID. */
+    std::unordered_map<uint16_t, std::vector<ReceiverSession *>> sessions;
+    size_t session_count = 0; /**< The number of the running sessions. */
 
-    FILE *out_file{}; /**< FILE identifier of the output file to save decrypted data to. */
-    int out_file_fd; /**< File descriptor number of the output file to save decrypted data to. */
-    void *out_file_mem{}; /**< Pointer to memory-mapped output file to save decrypted data to. */
+    /** A timer scheduled for a session's deadline. */
+    struct SessionTimer {
+        EventLoop::TimerId id; /**< The timer ID. */
+        uint64_t deadline; /**< The deadline the timer has been scheduled for. */
+    };
 
-    /**< Signalises if the Receiver is receiving the initial stream of data (not data it has requested to resend). */
-    bool first_pass = true;
+    EventLoop loop; /**< Dispatches the received packets and the session timeouts. */
+    std::unordered_map<ReceiverSession *, SessionTimer> session_timers; /**< The timers of the running sessions. */
 
     /**
-     * Receives a packet from a socket. Checks if it contains a valid 'Hello' message.
-     * If so, populates channel and trans_id.
+     * Processes a received packet: passes it to the session it belongs to or creates a new session if it contains
+     * a valid 'Hello' message.
      *
-     * @param [in] socket_fd The socket file descriptor.
+     * @param [in] socket_fd The socket the packet has been received from.
+     * @param [in] packet The received packet.
+     * @param [in] received Describes the received packet.
      * @param [in] family The address family of the socket (AF_INET or AF_INET6).
-     * @return True if the received packet contains a valid 'Hello' message; false otherwise.
+     * @param [in] password The encryption password.
      */
-    bool check_socket(int socket_fd, sa_family_t family);
+    void handle_packet(int socket_fd, uint8_t *packet, const RecvResult &received, sa_family_t family,
+                       const secure_string &password);
 
     /**
-     * Opens the specified file as the output file. Attempts to pre-allocate space of @a recv_encrypted_file_len bytes
-     * and to map the file into memory. Populates out_file, out_file_fd and out_file_mem.
+     * Passes a 'Join' message of an additional path of a multipath transfer to the sessions with its transaction ID
+     * until one of them accepts it (see ReceiverSession::join()).
      *
-     * @remark out_file is only opened if memory mapping fails.
-     * @param [in] name Name of the file.
-     * @throws std::runtime_error Thrown when the file cannot be opened.
+     * @param [in] id The transaction ID in the message.
+     * @param [in] address The address the message has been received from.
+     * @param [in] data The message data.
+     * @param [in] data_len Length of the message data.
      */
-    void open_file(const std::string &name);
+    void join_session(uint16_t id, const sockaddr *address, const uint8_t *data, uint16_t data_len);
 
     /**
-     * If R_USE_TEMP_FILE is set to 1, creates a temporary file, stores its identifier to tmp_file and attempts
-     * to pre-allocate space of @a recv_encrypted_file_len bytes and to map the file into memory.
-     * If R_USE_TEMP_FILE is set to 0, allocates @a recv_encrypted_file_len bytes in memory.
+     * Finds the session a packet belongs to (the packet may come from the sender's address or from a joined path).
+     * Control packets (seq 0 and 1) carry the transaction ID, data packets (seq 2 and higher) carry the transaction
+     * ID + 1, so the packets of two sessions with consecutive IDs are not mixed up.
      *
-     * @throws std::runtime_error Thrown when the file cannot be opened (or when memory cannot be allocated).
+     * @param [in] header The header of the packet.
+     * @param [in] address The address the packet has been received from.
+     * @return The session; nullptr if there's no such session.
      */
-    void open_tmp_file();
+    ReceiverSession *find_session(const ICMPEchoHeader &header, const sockaddr *address);
 
     /**
-     * Reads the received encrypted data from the temporary file or memory, decrypts them and stores them
-     * to the output file. Attempts to truncate the file to the resulting number of decrypted bytes.
+     * Creates a session for a transmission after a valid 'Hello' message has been received and starts it.
      *
-     * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
-     * @throws std::runtime_error Thrown when decryption fails.
+     * @param [in] socket_fd The socket the message has been received from.
+     * @param [in] packet The received packet (with the IP header in IPv4).
+     * @param [in] received Describes the received packet.
+     * @param [in] header The ICMP Echo header of the message.
+     * @param [in] version The protocol version requested by the sender.
+     * @param [in] salt The transfer salt sent by the sender (protocol version 4).
+     * @param [in] password The encryption password.
      */
-    void decrypt_file(const secure_string &password);
+    void create_session(int socket_fd, uint8_t *packet, const RecvResult &received, const ICMPEchoHeader &header,
+                        uint8_t version, const TransferSalt &salt, const secure_string &password);
 
     /**
-     * Finalizes a received handshake: Sends a 'Hello Back' packet to the remote party and waits for a confirmation
-     * 'Hello Back' packet to be received from the sender. If this succeeds, sets the transmission mode to two-way.
-     */
-    void com_init();
-
-    /**
-     * Receives a 'File Information' packet, decrypts the received file name, stores the received file length in
-     * @a recv_encrypted_file_en and calls open_file() and open_tmp_file().
+     * Calls a session's handler. If the handler fails, logs the error (in the daemon mode) or re-throws it.
+     * Removes the session if it has ended.
      *
-     * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
-     * @throws std::runtime_error Thrown when the packet doesn't arrive in time specified by R_FILE_INFO_TIMEOUT_MS.
-     * @throws std::runtime_error Thrown when the received packet doesn't contain valid data.
-     * @throws std::runtime_error Thrown when decryption fails.
-     * @see R_FILE_INFO_TIMEOUT_MS
+     * @param [in] session The session.
+     * @param [in] handler The handler to call.
      */
-    void com_receive_fileinfo(const secure_string &password);
+    template<typename Handler>
+    void run_session(ReceiverSession *session, Handler handler);
 
     /**
-     * Receives the data stream. Saves the received data to the temporary file/memory.
-     * Keeps track of sequence number of chunks that were not received.
-     * If the transmission runs in two-way mode, sends back a 'Request Resend' packet for the first 730 missed chunks
-     * and calls itself again.
+     * Removes and deletes a session.
+     *
+     * @param [in] session The session.
      */
-    void com_receive_data();
+    void remove_session(ReceiverSession *session);
 
     /**
-     * Sends a protocol message – an ICMP Echo Request with one byte of data, optionally followed by a string message.
+     * Schedules a timer for the session's deadline (replaces the previous one). When the timer expires and
+     * the deadline hasn't been postponed in the meantime, calls the session's on_timeout().
      *
-     * @param [in] flag The protocol message type.
-     * @param [in] message The message. May be empty.
+     * @param [in] session The session.
      */
-    void com_send_control(uint8_t flag, const std::string &message);
+    void schedule_timeout(ReceiverSession *session);
 };
 
 #endif //ISA_RECEIVER_H
@@ -0,0 +1,1012 @@
+// receiver_session.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <fcntl.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <filesystem>
+
+#include "receiver_session.h"
+#include "utils.h"
+#include "errors.h"
+#include "metrics.h"
+
+using std::string;
+
+ReceiverSession::ReceiverSession(Channel *channel, uint16_t trans_id, uint8_t version, const TransferSalt &salt,
+                                 bool enable_overwrite, const secure_string &password)
+        : channel(channel), trans_id(trans_id), version(version), password(password), transfer_salt(salt),
+          enable_overwrite(enable_overwrite) {
+}
+
+void ReceiverSession::start(uint64_t now) {
+    log_verbose("Attempting handshake");
+
+    // Try sending 'Hello Back' packet, followed by the chosen version (omitted in version 1)
+    char hello_resp[5] = PROTO_HELLO_BACK;
+    hello_resp[4] = static_cast<char>(version);
+    uint16_t hello_resp_len = version == PROTO_VERSION_STREAM ? 4 : 5;
+
+    uint8_t *packet;
+    uint16_t packet_size = make_icmp_packet(send_buffer, packet, channel, trans_id, 0, hello_resp, hello_resp_len);
+    if (channel->sendto(packet, packet_size, 0) == -1) {
+        throw std::runtime_error("Cannot send hello back packet");
+    }
+    log_monitor("ESTAB: Sent R->S 'Hello Back'");
+
+    // Wait for the sender's 'Hello Back'
+    current_state = SESSION_ESTABLISHING;
+    deadline_us = now + MODE_ESTAB_TIMEOUT_MS * 1000ull;
+}
+
+void ReceiverSession::on_packet(const ICMPEchoHeader &header, uint8_t *data, uint16_t data_len, uint64_t now) {
+    if (header.type != ICMP_ECHO && header.type != ICMP6_ECHO_REQUEST) {
+        log_monitor("Got Echo Response message, ignoring");
+        return;
+    }
+
+    if (header.id == trans_id) {
+        char hello_resp[] = PROTO_HELLO_BACK;
+
+        if (current_state == SESSION_ESTABLISHING && header.seq == 0 && data_len >= 4
+            && memcmp(data, hello_resp, 4) == 0) {
+            // We have received an echo request, we can use the two-way mode
+            log_monitor("ESTAB: Received 'Hello Back' Echo Request from the other side, set mode to two-way");
+            mode = TWO_WAY;
+            current_state = SESSION_FILE_INFO;
+            deadline_us = now + R_FILE_INFO_TIMEOUT_MS * 1000ull;
+        } else if ((current_state == SESSION_ESTABLISHING || current_state == SESSION_FILE_INFO)
+                   && header.seq == 1) {
+            // In one-way mode, the file information may come before our handshake timeout expires
+            if (current_state == SESSION_ESTABLISHING) {
+                log_info("Set mode to one-way");
+            }
+
+            com_receive_fileinfo(data, data_len);
+            current_state = SESSION_DATA;
+            deadline_us = now + R_RECV_TIMEOUT_MS * 1000ull;
+        }
+    } else if (current_state == SESSION_DATA) {
+        com_receive_data(header, data, data_len);
+        deadline_us = now + R_RECV_TIMEOUT_MS * 1000ull;
+
+        if (journal && now >= journal_saved_us + R_JOURNAL_INTERVAL_MS * 1000ull) {
+            save_journal(now);
+        }
+    }
+}
+
+void ReceiverSession::on_timeout(uint64_t now) {
+    switch (current_state) {
+        case SESSION_ESTABLISHING:
+            // Timeout, assume one-way
+            log_monitor("ESTAB: Timeout");
+            log_info("Set mode to one-way");
+            mode = ONE_WAY;
+            current_state = SESSION_FILE_INFO;
+            deadline_us = now + R_FILE_INFO_TIMEOUT_MS * 1000ull;
+            break;
+        case SESSION_FILE_INFO:
+            log_monitor("INFO: Timeout");
+            current_state = SESSION_DONE;
+            throw std::runtime_error("File information did not arrive in time");
+        case SESSION_DATA:
+            com_end_pass(now);
+            deadline_us = now + R_RECV_TIMEOUT_MS * 1000ull;
+            break;
+        case SESSION_DONE:
+            break;
+    }
+}
+
+void ReceiverSession::com_receive_fileinfo(const uint8_t *data, uint16_t data_len) {
+    log_verbose("Receiving file info");
+
+    unsigned char decrypt_buf[data_len + 1];
+    size_t decrypt_len;
+
+    if (version == PROTO_VERSION_STREAM) {
+        auto crypto = Crypto(password, trans_id);
+        try {
+            decrypt_len = crypto.decrypt(decrypt_buf, data, data_len, true);
+        } catch (std::runtime_error const &e) {
+            com_send_control(PROTO_INVALID_KEY, "");
+            throw e;
+        }
+    } else {
+        // The file information is encrypted as the chunk with index 0 under its own key
+        auto crypto = ChunkCrypto(password, transfer_salt, KeyPurpose::FILE_INFO);
+        if (!crypto.decrypt(0, decrypt_buf, data, data_len, decrypt_len)) {
+            com_send_control(PROTO_INVALID_KEY, "");
+            throw std::runtime_error("Cannot decrypt data");
+        }
+    }
+
+    // Version 1: [encrypted stream length][file name]
+    // Version 2: [file length][chunk size][file name]
+    // Version 2, a batch: [batch stream length][chunk size | PROTO_FILE_INFO_BATCH][manifest length][batch name]
+    // Version 2, resumable: the identity follows the other fields (and PROTO_FILE_INFO_RESUMABLE is set)
+    size_t header_len = sizeof(uint64_t) + (version == PROTO_VERSION_STREAM ? 0 : sizeof(uint16_t));
+    if (decrypt_len <= header_len) {
+        throw std::runtime_error("Invalid file information received");
+    }
+
+    bool is_batch = false, is_resumable = false;
+    JournalInfo journal_info{};
+    if (version != PROTO_VERSION_STREAM) {
+        chunk_size = be16toh(*reinterpret_cast<uint16_t *>(decrypt_buf + sizeof(uint64_t)));
+        is_batch = (chunk_size & PROTO_FILE_INFO_BATCH) != 0;
+        is_resumable = (chunk_size & PROTO_FILE_INFO_RESUMABLE) != 0;
+        streaming = (chunk_size & PROTO_FILE_INFO_STREAMING) != 0;
+        len_unknown = streaming;
+        chunk_size &= ~(PROTO_FILE_INFO_BATCH | PROTO_FILE_INFO_RESUMABLE | PROTO_FILE_INFO_STREAMING);
+
+        if (is_batch) {
+            if (decrypt_len <= header_len + sizeof(uint64_t)) {
+                throw std::runtime_error("Invalid file information received");
+            }
+
+            batch_manifest_len = be64toh(*reinterpret_cast<uint64_t *>(decrypt_buf + header_len));
+            header_len += sizeof(uint64_t);
+        }
+
+        if (is_resumable) {
+            if (decrypt_len <= header_len + PROTO_IDENTITY_LEN) {
+                throw std::runtime_error("Invalid file information received");
+            }
+
+            memcpy(journal_info.identity, decrypt_buf + header_len, PROTO_IDENTITY_LEN);
+            header_len += PROTO_IDENTITY_LEN;
+        }
+    }
+
+    // Add null termination character to the end of decrypted data so that std::string may easily be created from it
+    decrypt_buf[decrypt_len] = 0;
+    std::string file_name = std::string(reinterpret_cast<char *>(decrypt_buf + header_len));
+
+    if (version == PROTO_VERSION_STREAM) {
+        recv_encrypted_file_len = be64toh(*reinterpret_cast<uint64_t *>(decrypt_buf));
+
+        log_info("Accepting file: " << file_name << " (" << recv_encrypted_file_len << " bytes long)");
+        open_file(file_name, recv_encrypted_file_len);
+        stream_crypto = new Crypto(password, trans_id + 1);
+        reorder = new ReorderBuffer(R_REORDER_MEMORY_LIMIT);
+    } else {
+        recv_file_len = be64toh(*reinterpret_cast<uint64_t *>(decrypt_buf));
+
+        if (chunk_size == 0 || ChunkCrypto::encrypted_len(chunk_size) + sizeof(uint64_t) > R_RECV_BUFFER_SIZE) {
+            com_send_control(PROTO_ERROR, "Invalid chunk size");
+            throw std::runtime_error("Invalid file information received");
+        }
+
+        if (streaming && (is_batch || is_resumable)) {
+            com_send_control(PROTO_ERROR, "A stream cannot be resumed or contain multiple files");
+            throw std::runtime_error("Invalid file information received");
+        }
+
+        if (is_batch && (batch_manifest_len == 0 || batch_manifest_len > PROTO_BATCH_MAX_MANIFEST_LEN
+                         || batch_manifest_len > recv_file_len)) {
+            com_send_control(PROTO_ERROR, "Invalid manifest length");
+            throw std::runtime_error("Invalid file information received");
+        }
+
+        // Continue a previous transfer of the same data if its journal exists
+        bool resumed = false;
+        if (is_resumable) {
+            journal_info.file_len = recv_file_len;
+            journal_info.chunk_size = chunk_size;
+            journal_info.manifest_len = batch_manifest_len;
+            journal = std::make_unique<TransferJournal>(file_name, journal_info);
+            resumed = journal->load(tracker, batch_manifest);
+
+            // The received data must still be there
+            BatchManifest manifest;
+            if (resumed && (is_batch ? !BatchManifest::decode(batch_manifest.data(), batch_manifest.size(), manifest)
+                                       || !std::all_of(manifest.entries().begin(), manifest.entries().end(),
+                                                       [](const BatchEntry &entry) {
+                                                           return std::filesystem::exists(entry.path);
+                                                       })
+                                     : !std::filesystem::exists(file_name))) {
+                log_warn("The data of the previous transfer are gone, starting again");
+                tracker.restore({});
+                resumed = false;
+            }
+        }
+
+        if (is_batch) {
+            log_info("Accepting batch: " << file_name << " (" << recv_file_len << " bytes long)");
+            if (resumed) {
+                open_batch(true);
+            } else {
+                // The files are created when the manifest arrives
+                batch_manifest.resize(batch_manifest_len);
+            }
+        } else if (streaming) {
+            log_info("Accepting file: " << file_name << " (streamed, length unknown)");
+            open_file(file_name, 0);
+        } else {
+            log_info("Accepting file: " << file_name << " (" << recv_file_len << " bytes long)");
+            open_file(file_name, recv_file_len, resumed);
+        }
+
+        if (resumed) {
+            log_info("Resuming the transfer, " << tracker.received_count() << " of " << chunk_count()
+                                               << " chunks already received");
+        }
+
+        chunk_crypto = new ChunkCrypto(password, transfer_salt, KeyPurpose::DATA);
+        if (version >= PROTO_VERSION_COMPRESSION) {
+            decompressor = std::make_unique<ChunkDecompressor>();
+        }
+
+        // Tell the sender what to send (it waits for the answer in two-way mode)
+        if (is_resumable && mode == TWO_WAY) {
+            if (resumed) {
+                com_request_resend(tracker.missing_ranges(chunk_count(), R_RESEND_MAX_RANGES));
+            } else {
+                com_send_control(PROTO_RESUME_NONE, "");
+            }
+        }
+    }
+}
+
+void ReceiverSession::open_file(const string &name, uint64_t size, bool resume) {
+    // Check if the file exists (a resumed transfer continues writing the file)
+    auto file_path = std::filesystem::path(name);
+    if (!resume && std::filesystem::exists(file_path) && !enable_overwrite) {
+        com_send_control(PROTO_ERROR, "File already exists");
+        throw std::runtime_error("An existing file '" + name + "' would be overwritten");
+    }
+
+    // Attempt to allocate the file and map it to memory
+    // An empty file cannot be mapped
+    int fd = size == 0 ? -1 : open(file_path.c_str(), O_RDWR | O_CREAT, 600);
+    if (fd == -1) {
+        if (size != 0) {
+            log_warn("Cannot open file: " << strerror(errno));
+        }
+    } else {
+        out_file_fd = fd;
+
+        int allocate_res = posix_fallocate(fd, 0, static_cast<long>(size));
+        if (allocate_res == 0) {
+            out_file_mem = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0);
+            if (out_file_mem == MAP_FAILED) {
+                log_warn("Cannot memory-map file: " << strerror(errno));
+                close(fd);
+                out_file_fd = -1;
+                out_file_mem = nullptr;
+            }
+        } else {
+            log_warn("Cannot allocate file space");
+            close(fd);
+            out_file_fd = -1;
+        }
+    }
+
+    // If it failed, attempt to open the file 'normally' and write it in the background
+    if (out_file_mem == nullptr) {
+        fd = open(file_path.c_str(), O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0666);
+
+        if (fd == -1) {
+            auto errno_prev = errno;
+            com_send_control(PROTO_ERROR, "Cannot open file for writing");
+            throw std::system_error(errno_prev, std::generic_category(),
+                                    "Cannot open file " + file_path.string() + " for writing");
+        }
+
+        out_writer = std::make_unique<AsyncWriter>(fd, size);
+    }
+}
+
+void ReceiverSession::write_stream(uint64_t pos, const uint8_t *data, uint32_t data_len) {
+    if (pos != reorder->position()) {
+        // Keep the chunk until the preceding ones arrive (duplicates are ignored)
+        reorder->add(pos, data, data_len);
+        return;
+    }
+
+    decrypt_stream(data, data_len);
+    reorder->skip(data_len);
+
+    // Decrypt the chunks that have been waiting for this one
+    uint8_t buffer[R_RECV_BUFFER_SIZE];
+    size_t len;
+    while ((len = reorder->pop(buffer, R_RECV_BUFFER_SIZE)) > 0) {
+        decrypt_stream(buffer, len);
+    }
+}
+
+void ReceiverSession::decrypt_stream(const uint8_t *data, uint32_t data_len) {
+    bool is_final = reorder->position() + data_len == recv_encrypted_file_len;
+
+    if (out_file_mem != nullptr) {
+        out_file_pos += stream_crypto->decrypt(reinterpret_cast<unsigned char *>(out_file_mem) + out_file_pos,
+                                               data, data_len, is_final);
+    } else {
+        // The output may be one block longer than the input
+        unsigned char output_buf[R_RECV_BUFFER_SIZE + 16];
+        auto decrypted_len = stream_crypto->decrypt(output_buf, data, data_len, is_final);
+        out_writer->write(out_file_pos, output_buf, decrypted_len);
+        out_file_pos += decrypted_len;
+    }
+}
+
+void ReceiverSession::close_stream() {
+    if (reorder->position() != recv_encrypted_file_len) {
+        log_warn("Only " << out_file_pos << " bytes could be decrypted");
+    } else {
+        log_verbose("Decrypted " << out_file_pos << " bytes");
+    }
+
+    if (out_file_mem != nullptr) {
+        munmap(out_file_mem, recv_encrypted_file_len);
+        out_file_mem = nullptr;
+        if (ftruncate(out_file_fd, static_cast<long>(out_file_pos)) == -1) {
+            perror("Cannot truncate output file");
+        }
+        close(out_file_fd);
+        out_file_fd = -1;
+    }
+
+    if (out_writer) {
+        out_writer->flush();
+    }
+}
+
+void ReceiverSession::close_file() {
+    if (out_writer) {
+        out_writer->flush();
+
+        // The last chunk of a stream may have been lost, so the file may be shorter (or a forged chunk may lie
+        // beyond it); this also frees the space preallocated past the end
+        if (streaming && !len_unknown) {
+            try {
+                out_writer->truncate(recv_file_len);
+            } catch (const std::system_error &e) {
+                log_warn(e.what());
+            }
+        }
+    }
+
+    if (batch_manifest_len > 0) {
+        if (!batch) {
+            log_warn("The list of the files has not been received, no file has been saved");
+            return;
+        }
+
+        auto incomplete = batch->finish();
+        if (incomplete > 0) {
+            log_warn(incomplete << " of " << batch->files().entries().size() << " files are incomplete");
+        } else {
+            log_verbose("Received " << batch->files().entries().size() << " files");
+        }
+        return;
+    }
+
+    if (out_file_mem != nullptr) {
+        munmap(out_file_mem, recv_file_len);
+        out_file_mem = nullptr;
+        close(out_file_fd);
+        out_file_fd = -1;
+    }
+}
+
+void ReceiverSession::com_receive_data(const ICMPEchoHeader &header, uint8_t *data, uint16_t data_len) {
+    if (header.seq < 2) {
+        log_monitor("DATA: Got seq < 2, ignoring");
+        return;
+    }
+
+    if (header.seq == UINT16_MAX) {
+        // 'All Data Sent' packet received
+        if (data_len < sizeof(uint16_t)) {
+            log_warn("Invalid ending packet received; ignoring");
+            return;
+        }
+
+        log_verbose("Ending packet received");
+        if (version != PROTO_VERSION_STREAM && data_len >= sizeof(uint64_t)) {
+            // Version 2: the number of chunks; the packet is not authenticated, so it must agree with the file length
+            // (the length of a stream is only known when its last chunk arrives, until then the count is used)
+            auto count = be64toh(*reinterpret_cast<uint64_t *>(data));
+            if (!len_unknown && count != chunk_count()) {
+                log_warn("Invalid ending packet received; ignoring");
+                return;
+            }
+
+            tracker.expect(count);
+        } else {
+            // Version 1: the chunks have seqs 2 to the last seq
+            uint16_t sender_last_seq = be16toh(*reinterpret_cast<uint16_t *>(data));
+            tracker.expect(sender_last_seq > 1 ? sender_last_seq - 1 : 0);
+        }
+        return;
+    }
+
+    if (data_len < sizeof(uint64_t)) {
+        log_monitor("DATA: Chunk too short, ignoring");
+        return;
+    }
+
+    uint64_t pos = *reinterpret_cast<uint64_t *>(data);
+    pos = be64toh(pos);
+    uint32_t encrypted_data_len = data_len - sizeof(uint64_t);
+    metric_add(packets_received, 1);
+    metric_add(bytes_received, data_len);
+
+    uint64_t index;
+    if (version != PROTO_VERSION_STREAM && (pos & FEC_FLAG) != 0) {
+        receive_parity(pos, data + sizeof(uint64_t), encrypted_data_len);
+        return;
+    } else if (version != PROTO_VERSION_STREAM) {
+        // The seqs wrap around, the chunk index is determined by the position (write_chunk() checks it's aligned)
+        index = (pos & ~COMPRESSION_FLAG) / chunk_size;
+        if (!write_chunk(pos, data + sizeof(uint64_t), encrypted_data_len)) {
+            // Treat the chunk as missing
+            metric_add(chunks_invalid, 1);
+            log_monitor("DATA [" << header.seq << "]: Invalid chunk at pos " << pos);
+            return;
+        }
+    } else if ((pos + encrypted_data_len) > recv_encrypted_file_len) {
+        log_warn("total len: " << recv_encrypted_file_len << ", current pos: " << pos << ", recv len: "
+                               << encrypted_data_len);
+        // Don't allow writing outside the expected bounds
+        throw std::runtime_error(
+                "Invalid write position requested. This may signalise an attack attempt, terminating");
+    } else {
+        index = header.seq - 2;
+        write_stream(pos, data + sizeof(uint64_t), encrypted_data_len);
+    }
+
+    pass_packets++;
+    if (!tracker.mark(index)) {
+        metric_add(chunks_duplicate, 1);
+    } else {
+        metric_add(chunks_received, 1);
+        if (tracker.received_count() == 1) {
+            log_verbose("First data chunk received");
+        }
+    }
+
+    log_monitor("DATA [" << header.seq << "]: Written " << encrypted_data_len << " B to pos " << pos);
+}
+
+void ReceiverSession::com_end_pass(uint64_t now) {
+    uint64_t limit;
+    if (tracker.expected_known()) {
+        limit = tracker.expected();
+        if (tracker.seen() > limit) {
+            log_warn("More chunks received than expected");
+        }
+    } else {
+        limit = tracker.seen();
+        if (limit > 0) {
+            log_warn("Ending packet not received, cannot guarantee completeness");
+        }
+    }
+
+    if (first_pass || pass_packets > 0) {
+        empty_passes = 0;
+    } else if (++empty_passes >= R_MAX_EMPTY_PASSES) {
+        // Don't keep the session forever if the sender has gone away
+        current_state = SESSION_DONE;
+        throw std::runtime_error("The sender stopped responding, the file is incomplete");
+    }
+
+    // Reconstruct what can be reconstructed from the parity chunks before asking for the rest
+    for (auto it = fec_groups.begin(); it != fec_groups.end();) {
+        recover_group(it->first);
+        it = fec_groups.upper_bound(it->first);
+    }
+
+    auto missing = tracker.missing_ranges(limit, R_RESEND_MAX_RANGES);
+
+    // In one-way mode, we can only inform the sender of success/failure
+    // In two-way mode, we can check whether we have received all data and ask for more or signalise success
+    if (mode == ONE_WAY) {
+#if ENABLE_MONITOR == 1
+        for (const auto &range: missing) {
+            log_monitor("DATA: Chunks " << range.first << " to " << (range.first + range.count - 1) << " missing");
+        }
+#endif
+
+        if (!missing.empty()) {
+            log_warn("Some data were not received, data WILL be CORRUPTED");
+        }
+    } else if (missing.empty()) {
+        log_verbose("All data received");
+        // We have received everything; the sender is only told so when the data have been written
+        if (out_writer) {
+            out_writer->flush();
+        }
+
+        com_send_control(PROTO_OK, "");
+    } else if (streaming) {
+        // The sender cannot read the stream again, it's only informed that the data are incomplete
+        com_request_resend(missing);
+        log_warn("Some data were not received and cannot be sent again, data WILL be CORRUPTED");
+    } else {
+        com_request_resend(missing);
+        save_journal(now);
+
+        // Start listening for incoming packets again
+        log_verbose("Listening for incoming packets again");
+        first_pass = false;
+        pass_packets = 0;
+        return;
+    }
+
+    if (journal && missing.empty()) {
+        journal->remove();
+        journal.reset();
+    }
+
+    if (version == PROTO_VERSION_STREAM) {
+        close_stream();
+    } else {
+        close_file();
+    }
+
+    current_state = SESSION_DONE;
+}
+
+void ReceiverSession::com_request_resend(const std::vector<ChunkRange> &ranges) {
+    uint8_t *packet;
+    uint16_t packet_size;
+
+    if (version == PROTO_VERSION_STREAM) {
+        // Version 1 senders only understand a list of seqs
+        char msg_data[R_RESEND_MESSAGE_LEN];
+        msg_data[0] = PROTO_REQUEST_RESEND;
+        size_t msg_data_pos = 1;
+
+        for (const auto &range: ranges) {
+            for (uint64_t i = range.first; i < range.first + range.count
+                                           && msg_data_pos + sizeof(uint16_t) <= R_RESEND_MESSAGE_LEN; i++) {
+                uint16_t seq_be = htobe16(static_cast<uint16_t>(i + 2));
+                memcpy(msg_data + msg_data_pos, &seq_be, sizeof(uint16_t));
+                msg_data_pos += sizeof(uint16_t);
+            }
+        }
+
+        log_verbose("Requesting resending of " << (msg_data_pos - 1) / sizeof(uint16_t) << " seqs");
+        packet_size = make_icmp_packet(send_buffer, packet, channel, trans_id, UINT16_MAX, msg_data, msg_data_pos);
+        if (channel->sendto(packet, packet_size, 0) == -1) {
+            throw std::runtime_error("Cannot send 'Request Resend' packet");
+        }
+
+        metric_add(resend_requests, 1);
+        return;
+    }
+
+    // Split the ranges into messages: [type][part number][number of parts][encoded ranges]
+    const size_t header_len = 3 * sizeof(uint8_t);
+    char parts[R_RESEND_PACKETS][R_RESEND_MESSAGE_LEN];
+    size_t parts_len[R_RESEND_PACKETS];
+    size_t part_count = 0, from = 0;
+
+    // An empty message means that nothing is missing (when resuming a complete transfer)
+    while (part_count == 0 || (from < ranges.size() && part_count < R_RESEND_PACKETS)) {
+        size_t encoded_len;
+        from = encode_ranges(ranges, from, reinterpret_cast<uint8_t *>(parts[part_count]) + header_len,
+                             R_RESEND_MESSAGE_LEN - header_len, encoded_len);
+        parts_len[part_count++] = header_len + encoded_len;
+    }
+
+    log_verbose("Requesting resending of " << from << " ranges in " << part_count << " packets");
+    for (size_t i = 0; i < part_count; i++) {
+        parts[i][0] = PROTO_REQUEST_RESEND_RANGES;
+        parts[i][1] = static_cast<char>(i);
+        parts[i][2] = static_cast<char>(part_count);
+
+        packet_size = make_icmp_packet(send_buffer, packet, channel, trans_id, UINT16_MAX, parts[i], parts_len[i]);
+        if (channel->sendto(packet, packet_size, 0) == -1) {
+            throw std::runtime_error("Cannot send 'Request Resend Ranges' packet");
+        }
+    }
+
+    metric_add(resend_requests, 1);
+}
+
+bool ReceiverSession::write_chunk(uint64_t pos, const uint8_t *data, uint32_t data_len) {
+    bool compressed = decompressor && (pos & COMPRESSION_FLAG) != 0;
+    if (compressed) {
+        pos &= ~COMPRESSION_FLAG;
+    }
+
+    // The chunks are authenticated, so a chunk that doesn't fit is not a reason to terminate
+    if (pos % chunk_size != 0 || (!len_unknown && pos > recv_file_len)) {
+        return false;
+    }
+
+    if (tracker.received(pos / chunk_size)) {
+        // Don't decrypt and save the same data again
+        return true;
+    }
+
+    // A compressed chunk is shorter than the plain one; any chunk of a stream may be the last, shorter one
+    auto plain_len = len_unknown ? chunk_size : std::min<uint64_t>(chunk_size, recv_file_len - pos);
+    if (compressed ? data_len <= ChunkCrypto::encrypted_len(0) || data_len >= ChunkCrypto::encrypted_len(plain_len)
+                   : len_unknown ? data_len > ChunkCrypto::encrypted_len(plain_len)
+                                 : data_len != ChunkCrypto::encrypted_len(plain_len)) {
+        return false;
+    }
+
+    // Decrypt to a buffer first so that a forged chunk cannot overwrite already received data
+    // The flag is a part of the index the chunk has been encrypted with
+    unsigned char plain_buf[R_RECV_BUFFER_SIZE];
+    size_t decrypted_len;
+    uint64_t index = pos / chunk_size | (compressed ? COMPRESSION_FLAG : 0);
+    auto start = now_ns();
+    if (!chunk_crypto->decrypt(index, plain_buf, data, data_len, decrypted_len)) {
+        return false;
+    }
+
+    const uint8_t *plain = plain_buf;
+    size_t len = decrypted_len;
+    unsigned char decompressed_buf[R_RECV_BUFFER_SIZE];
+    if (compressed) {
+        len = plain_len;
+        if (!decompressor->decompress(plain_buf, decrypted_len, decompressed_buf, len)
+            || (!len_unknown && len != plain_len)) {
+            return false;
+        }
+
+        plain = decompressed_buf;
+    }
+
+    metric_record(decrypt_ns, now_ns() - start);
+
+    // The last chunk of a stream is the one that doesn't fill the chunk size (possibly an empty one); it's
+    // authenticated, so the length of the stream is taken from it
+    if (len_unknown && len < chunk_size) {
+        recv_file_len = pos + len;
+        len_unknown = false;
+        tracker.expect(chunk_count());
+        log_verbose("The streamed file is " << recv_file_len << " bytes long");
+    }
+
+    return save_plain(pos, plain, len);
+}
+
+bool ReceiverSession::save_plain(uint64_t pos, const uint8_t *data, size_t len) {
+    if (batch_manifest_len == 0) {
+        if (out_file_mem != nullptr) {
+            memcpy(reinterpret_cast<char *>(out_file_mem) + pos, data, len);
+        } else {
+            out_writer->write(pos, data, len);
+        }
+
+        return true;
+    }
+
+    // A batch stream starts with the manifest, the contents of the files follow
+    if (pos < batch_manifest_len) {
+        auto manifest_part = static_cast<size_t>(std::min<uint64_t>(len, batch_manifest_len - pos));
+        memcpy(batch_manifest.data() + pos, data, manifest_part);
+
+        auto manifest_chunks = (batch_manifest_len + chunk_size - 1) / chunk_size;
+        if (manifest_tracker.mark(pos / chunk_size) && manifest_tracker.received_count() == manifest_chunks
+            && !batch) {
+            open_batch();
+        }
+
+        pos += manifest_part;
+        data += manifest_part;
+        len -= manifest_part;
+    }
+
+    if (len == 0) {
+        return true;
+    }
+
+    if (batch) {
+        batch->write(pos - batch_manifest_len, data, len);
+        return true;
+    }
+
+    // Keep the data until the manifest arrives; if there's not enough memory, the chunk will be requested again
+    if (batch_pending_len + len > R_REORDER_MEMORY_LIMIT) {
+        return false;
+    }
+
+    batch_pending.emplace(pos, std::vector<uint8_t>(data, data + len));
+    batch_pending_len += len;
+    return true;
+}
+
+void ReceiverSession::load_plain(uint64_t pos, uint8_t *data, size_t len) {
+    if (batch_manifest_len == 0) {
+        if (out_file_mem != nullptr) {
+            memcpy(data, reinterpret_cast<char *>(out_file_mem) + pos, len);
+        } else {
+            out_writer->read(pos, data, len);
+        }
+
+        return;
+    }
+
+    if (pos < batch_manifest_len) {
+        auto manifest_part = static_cast<size_t>(std::min<uint64_t>(len, batch_manifest_len - pos));
+        memcpy(data, batch_manifest.data() + pos, manifest_part);
+        pos += manifest_part;
+        data += manifest_part;
+        len -= manifest_part;
+    }
+
+    if (len == 0) {
+        return;
+    }
+
+    if (batch) {
+        batch->read(pos - batch_manifest_len, data, len);
+    } else {
+        auto it = batch_pending.find(pos);
+        if (it != batch_pending.end()) {
+            memcpy(data, it->second.data(), std::min(len, it->second.size()));
+        }
+    }
+}
+
+void ReceiverSession::open_batch(bool resume) {
+    BatchManifest manifest;
+    if (!BatchManifest::decode(batch_manifest.data(), batch_manifest.size(), manifest)
+        || manifest.data_len() != recv_file_len - batch_manifest_len) {
+        com_send_control(PROTO_ERROR, "Invalid list of files");
+        throw std::runtime_error("Invalid list of files received");
+    }
+
+    log_info("Receiving " << manifest.entries().size() << " files (" << manifest.data_len() << " bytes)");
+
+    try {
+        batch = std::make_unique<BatchWriter>(std::move(manifest), enable_overwrite, resume);
+    } catch (std::system_error const &e) {
+        com_send_control(PROTO_ERROR, "Cannot open file for writing");
+        throw;
+    } catch (std::runtime_error const &e) {
+        com_send_control(PROTO_ERROR, "File already exists");
+        throw;
+    }
+
+    if (resume) {
+        // The contents of the chunks received by the previous transfer are in the files already
+        for (uint64_t i = 0; i < chunk_count(); i++) {
+            uint64_t pos = i * chunk_size;
+            auto end = std::min<uint64_t>(pos + chunk_size, recv_file_len);
+            if (tracker.received(i) && end > batch_manifest_len) {
+                pos = std::max(pos, batch_manifest_len);
+                batch->skip(pos - batch_manifest_len, end - pos);
+            }
+        }
+    }
+
+    for (const auto &pending: batch_pending) {
+        batch->write(pending.first - batch_manifest_len, pending.second.data(), pending.second.size());
+    }
+
+    batch_pending.clear();
+    batch_pending_len = 0;
+}
+
+void ReceiverSession::receive_parity(uint64_t pos, const uint8_t *data, uint32_t data_len) {
+    uint8_t group_size, parity_index;
+    uint64_t group;
+    fec_parse_pos(pos, group_size, parity_index, group);
+
+    if (group_size == 0 || group_size + parity_index > FEC_MAX_CHUNKS
+        || (!len_unknown && group >= (chunk_count() + group_size - 1) / group_size)
+        || data_len != ChunkCrypto::encrypted_len(chunk_size)) {
+        log_monitor("DATA: Invalid parity chunk " << std::hex << pos << std::dec);
+        return;
+    }
+
+    auto it = fec_groups.find(group);
+    if (it != fec_groups.end()) {
+        if (it->second.group_size != group_size) {
+            return;
+        }
+
+        for (const auto &parity: it->second.parity) {
+            if (parity.first == parity_index) {
+                return;
+            }
+        }
+    }
+
+    // The parity chunks are encrypted with the position field as the chunk index
+    std::vector<uint8_t> plain(chunk_size);
+    size_t decrypted_len;
+    if (!chunk_crypto->decrypt(pos, plain.data(), data, data_len, decrypted_len)) {
+        log_monitor("DATA: Invalid parity chunk " << std::hex << pos << std::dec);
+        return;
+    }
+
+    log_monitor("DATA: Received parity chunk " << static_cast<int>(parity_index) << " of group " << group);
+    auto &fec_group = fec_groups[group];
+    fec_group.group_size = group_size;
+    fec_group.parity.emplace_back(parity_index, std::move(plain));
+
+    // Reconstruct the missing chunks as soon as there are enough parity chunks so that they don't take memory
+    recover_group(group);
+}
+
+void ReceiverSession::recover_group(uint64_t group) {
+    auto it = fec_groups.find(group);
+    if (it == fec_groups.end() || len_unknown) {
+        return;
+    }
+
+    auto &fec_group = it->second;
+    uint64_t first = group * fec_group.group_size;
+    auto count = static_cast<size_t>(std::min<uint64_t>(fec_group.group_size, chunk_count() - first));
+
+    std::vector<bool> present(count);
+    size_t missing = 0;
+    for (size_t i = 0; i < count; i++) {
+        present[i] = tracker.received(first + i);
+        missing += present[i] ? 0 : 1;
+    }
+
+    if (missing == 0) {
+        fec_groups.erase(it);
+        return;
+    }
+
+    if (missing > fec_group.parity.size()) {
+        return;
+    }
+
+    // Read the received chunks back from the output file (the missing ones are zero-padded to the chunk size)
+    std::vector<uint8_t> buffer(count * chunk_size, 0);
+    std::vector<uint8_t *> chunks(count);
+    for (size_t i = 0; i < count; i++) {
+        chunks[i] = buffer.data() + i * chunk_size;
+        if (!present[i]) {
+            continue;
+        }
+
+        uint64_t pos = (first + i) * chunk_size;
+        load_plain(pos, chunks[i], std::min<uint64_t>(chunk_size, recv_file_len - pos));
+    }
+
+    std::vector<std::pair<uint8_t, const uint8_t *>> parity;
+    for (const auto &item: fec_group.parity) {
+        parity.emplace_back(item.first, item.second.data());
+    }
+
+    if (!fec_recover(fec_group.group_size, chunks, present, parity, chunk_size)) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (present[i]) {
+            continue;
+        }
+
+        uint64_t pos = (first + i) * chunk_size;
+        if (save_plain(pos, chunks[i], std::min<uint64_t>(chunk_size, recv_file_len - pos))) {
+            tracker.mark(first + i);
+            metric_add(chunks_recovered, 1);
+        }
+    }
+
+    log_verbose("Reconstructed " << missing << " chunks of group " << group << " using FEC");
+    fec_groups.erase(it);
+}
+
+void ReceiverSession::save_journal(uint64_t now) {
+    // The contents of a batch received before the manifest are only kept in memory
+    if (!journal || (batch_manifest_len > 0 && !batch)) {
+        return;
+    }
+
+    // The journal must not mark the chunks that are still waiting to be written
+    if (out_writer) {
+        try {
+            out_writer->flush();
+        } catch (const std::system_error &e) {
+            log_warn(e.what());
+            return;
+        }
+    }
+
+    journal->save(tracker, batch_manifest);
+    journal_saved_us = now;
+}
+
+bool ReceiverSession::has_address(const sockaddr *address) const {
+    if (sockaddr_eq(&channel->dst_addr.sock, address)) {
+        return true;
+    }
+
+    return std::any_of(joined_paths.begin(), joined_paths.end(), [address](const auto &joined) {
+        return sockaddr_eq(&joined.second.sock, address);
+    });
+}
+
+bool ReceiverSession::join(const sockaddr *address, const uint8_t *data, uint16_t data_len) {
+    // [magic][path number][the source address of the path encrypted as the chunk with the index of the path number
+    // under the join key]
+    const size_t header_len = 4 + sizeof(uint8_t);
+    if (version == PROTO_VERSION_STREAM || mode != TWO_WAY || current_state != SESSION_DATA
+        || data_len <= header_len || data[4] == 0) {
+        return false;
+    }
+
+    uint8_t number = data[4];
+    const uint8_t *source;
+    auto source_len = addr_bytes(address, source);
+    unsigned char decrypt_buf[data_len];
+    size_t decrypt_len;
+    auto crypto = ChunkCrypto(password, transfer_salt, KeyPurpose::JOIN);
+
+    // The proof is bound to the source address, so a captured 'Join' cannot add another address to the transfer
+    if (source_len == 0 || !crypto.decrypt(number, decrypt_buf, data + header_len, data_len - header_len, decrypt_len)
+        || decrypt_len != source_len || memcmp(decrypt_buf, source, source_len) != 0) {
+        return false;
+    }
+
+    // Each path joins once; the same 'Join' is only repeated when the answer has been lost
+    auto joined_it = joined_paths.find(number);
+    if (joined_it != joined_paths.end() && !sockaddr_eq(&joined_it->second.sock, address)) {
+        log_verbose("Path " << static_cast<int>(number) << " has already joined transmission " << trans_id
+                            << " from another address, ignoring 'Join' from " << addr_to_string(address));
+        return false;
+    }
+
+    if (joined_it == joined_paths.end()) {
+        if (has_address(address)) {
+            log_verbose("Address " << addr_to_string(address) << " already belongs to transmission " << trans_id
+                                   << ", ignoring 'Join' of path " << static_cast<int>(number));
+            return false;
+        }
+
+        AnyIPAddress joined{};
+        memcpy(&joined, address, address->sa_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6));
+        joined_paths[number] = joined;
+        log_info("Path " << static_cast<int>(number) << " (" << addr_to_string(address) << ") joined transmission "
+                         << trans_id);
+    }
+
+    com_send_control(PROTO_JOINED, string(1, static_cast<char>(number)));
+    return true;
+}
+
+void ReceiverSession::com_send_control(uint8_t flag, const string &message) {
+    char err_data[sizeof(uint8_t) + message.length()];
+    if (message.length() > 0) {
+        memcpy(err_data + sizeof(uint8_t), message.c_str(), message.length());
+    }
+
+    err_data[0] = static_cast<char>(flag);
+
+    uint8_t *packet;
+    auto packet_size = make_icmp_packet(send_buffer, packet, channel, trans_id,
+                                        UINT16_MAX,
+                                        err_data, sizeof(err_data));
+
+    if (channel->sendto(packet, packet_size, 0) == -1) {
+        throw std::runtime_error("Cannot send control packet");
+    }
+
+    log_monitor("Sent control packet (type " << static_cast<int>(flag) << ", message: '" << message << "')");
+}
+
+ReceiverSession::~ReceiverSession() {
+    // Keep the state of an unfinished transfer so that it can be resumed
+    save_journal(now_us());
+
+    if (out_file_mem != nullptr) {
+        munmap(out_file_mem, version == PROTO_VERSION_STREAM ? recv_encrypted_file_len : recv_file_len);
+    }
+
+    if (out_file_fd != -1) {
+        close(out_file_fd);
+    }
+
+    delete chunk_crypto;
+    delete stream_crypto;
+    delete reorder;
+    delete channel;
+}
@@ -0,0 +1,379 @@
+// receiver_session.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_RECEIVER_SESSION_H
+#define ISA_RECEIVER_SESSION_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "async_writer.h"
+#include "secure_string.h"
+#include "channel.h"
+#include "encryption.h"
+#include "packet_utils.h"
+#include "reorder_buffer.h"
+#include "chunk_tracker.h"
+#include "fec.h"
+#include "compression.h"
+#include "batch_writer.h"
+#include "journal.h"
+
+/**
+ * Describes the state of a ReceiverSession.
+ */
+enum SessionState {
+    /** 'Hello Back' has been sent, waiting for the sender's 'Hello Back' (two-way mode) or for the file information. */
+    SESSION_ESTABLISHING,
+    /** Waiting for the file information. */
+    SESSION_FILE_INFO,
+    /** Receiving the data chunks. */
+    SESSION_DATA,
+    /** The transmission has ended (successfully or not); the session may be removed. */
+    SESSION_DONE
+};
+
+/**
+ * The state of one transmission on the receiver side. The session doesn't receive packets itself: the Receiver passes
+ * it the packets that belong to it (the ones from the sender's address with its transaction ID or the transaction
+ * ID + 1) and calls on_timeout() when its deadline passes.
+ */
+class ReceiverSession {
+public:
+    /**
+     * Creates a ReceiverSession for a received 'Hello' message.
+     *
+     * @param [in] channel The Channel for communication with the sender. The session takes ownership of it.
+     * @param [in] trans_id The transaction ID.
+     * @param [in] version The protocol version.
+     * @param [in] salt The transfer salt the keys are derived from (protocol version 4).
+     * @param [in] enable_overwrite Signalises if the session should allow overwriting an existing file.
+     * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
+     */
+    ReceiverSession(Channel *channel, uint16_t trans_id, uint8_t version, const TransferSalt &salt,
+                    bool enable_overwrite, const secure_string &password);
+
+    /**
+     * Closes the output file and frees the resources used by this session.
+     */
+    ~ReceiverSession();
+
+    ReceiverSession(const ReceiverSession &) = delete;
+
+    ReceiverSession &operator=(const ReceiverSession &) = delete;
+
+    /**
+     * Starts the handshake: sends a 'Hello Back' packet to the sender.
+     *
+     * @param [in] now The current time (monotonic, in microseconds).
+     * @throws std::runtime_error Thrown when the packet cannot be sent.
+     */
+    void start(uint64_t now);
+
+    /**
+     * Processes a packet that belongs to this session.
+     *
+     * @param [in] header The ICMP Echo header of the packet.
+     * @param [in] data The packet data.
+     * @param [in] data_len Length of the packet data.
+     * @param [in] now The current time.
+     * @throws std::runtime_error Thrown when a fatal error occurs; the session should be removed.
+     */
+    void on_packet(const ICMPEchoHeader &header, uint8_t *data, uint16_t data_len, uint64_t now);
+
+    /**
+     * Handles the expiration of the session's deadline.
+     *
+     * @param [in] now The current time.
+     * @throws std::runtime_error Thrown when a fatal error occurs; the session should be removed.
+     */
+    void on_timeout(uint64_t now);
+
+    /** @return Time when on_timeout() should be called. */
+    [[nodiscard]] uint64_t deadline() const { return deadline_us; }
+
+    /** @return The current state. */
+    [[nodiscard]] SessionState state() const { return current_state; }
+
+    /** @return The transaction ID. */
+    [[nodiscard]] uint16_t id() const { return trans_id; }
+
+    /** @return The sender's address. */
+    [[nodiscard]] const sockaddr *address() const { return &channel->dst_addr.sock; }
+
+    /**
+     * @param [in] address An address.
+     * @return True if the packets from the address belong to this session (it's the sender's address or the address
+     * of a joined path).
+     */
+    [[nodiscard]] bool has_address(const sockaddr *address) const;
+
+    /**
+     * Processes a 'Join' message of an additional path of a multipath transfer (see PROTO_JOIN): verifies it and
+     * accepts the data packets from the path's address. Answers with PROTO_JOINED on the primary path (again when
+     * the path has already joined from the same address, the previous answer may have been lost).
+     *
+     * @remark Paths may only join a transfer that uses protocol version 4 in two-way mode and that is receiving data.
+     * The message is ignored when it has not been sent from the address it proves, when the path has joined from
+     * another address or when the address already belongs to the transfer.
+     * @param [in] address The address the message has been received from.
+     * @param [in] data The message data (starting with the magic).
+     * @param [in] data_len Length of the message data.
+     * @return False if the message doesn't belong to this session.
+     * @throws std::runtime_error Thrown when the answer cannot be sent.
+     */
+    bool join(const sockaddr *address, const uint8_t *data, uint16_t data_len);
+
+private:
+    SessionState current_state = SESSION_ESTABLISHING; /**< The current state. */
+    uint64_t deadline_us = 0; /**< Time when on_timeout() should be called. */
+
+    TransmissionMode mode = ONE_WAY; /**< The current mode of transmission. */
+    Channel *channel; /**< Encapsulates the socket used for communication with the sender. */
+    std::map<uint8_t, AnyIPAddress> joined_paths; /**< The sender's addresses of the joined paths (by path number). */
+    uint8_t send_buffer[R_RECV_BUFFER_SIZE]{}; /**< A buffer for preparing packets to send. */
+    uint16_t trans_id; /**< The transaction ID. */
+    uint8_t version; /**< The protocol version used in the transmission. */
+    secure_string password; /**< The encryption password. */
+    TransferSalt transfer_salt; /**< The random salt the keys of the transmission are derived from (version 4). */
+
+    bool enable_overwrite; /**< Signalises if the session should allow overwriting an existing file. */
+    uint64_t recv_encrypted_file_len{}; /**< The total length of the encrypted data that is being received. */
+    uint64_t recv_file_len{}; /**< The length of the file that is being received (protocol version 2). */
+    uint16_t chunk_size{}; /**< The number of plain bytes in a data chunk (protocol version 2). */
+    /** Signalises that the file is streamed: its length is determined by its last chunk and the chunks cannot be
+     * resent (see PROTO_FILE_INFO_STREAMING). */
+    bool streaming = false;
+    bool len_unknown = false; /**< Signalises that the last chunk of a streamed file has not been received yet. */
+    /** Decrypts the received chunks on arrival (protocol version 2). */
+    ChunkCrypto *chunk_crypto{};
+    /** Decompresses the compressed chunks (protocol version 3). */
+    std::unique_ptr<ChunkDecompressor> decompressor;
+    /** Keeps track of the received chunks (by chunk index: seq - 2 in version 1, position / chunk size in version 2). */
+    ChunkTracker tracker;
+
+    /** The parity chunks of a group of chunks that has not been received completely (protocol version 2). */
+    struct FecGroup {
+        uint8_t group_size = 0; /**< The number of chunks in the group (K). */
+        std::vector<std::pair<uint8_t, std::vector<uint8_t>>> parity; /**< The decrypted parity chunks by index. */
+    };
+
+    std::map<uint64_t, FecGroup> fec_groups; /**< The groups with missing chunks by group number. */
+
+    /** The length of the manifest at the beginning of the stream; zero if a single file is received. */
+    uint64_t batch_manifest_len = 0;
+    std::vector<uint8_t> batch_manifest; /**< The received parts of the manifest. */
+    ChunkTracker manifest_tracker; /**< Keeps track of the received chunks that contain the manifest. */
+    /** Writes the files of a batch (created when the whole manifest has been received). */
+    std::unique_ptr<BatchWriter> batch;
+    /** The contents of the files of a batch received before the manifest, by position in the stream. */
+    std::map<uint64_t, std::vector<uint8_t>> batch_pending;
+    size_t batch_pending_len = 0; /**< The number of bytes in @a batch_pending. */
+
+    /** The journal of a resumable transfer; nullptr if the transfer is not resumable or if it's complete. */
+    std::unique_ptr<TransferJournal> journal;
+    uint64_t journal_saved_us = 0; /**< Time when the journal was last saved. */
+
+    /** Decrypts the received stream (protocol version 1). */
+    Crypto *stream_crypto{};
+    /** Keeps the chunks received out of order until the preceding ones arrive (protocol version 1). */
+    ReorderBuffer *reorder{};
+    uint64_t out_file_pos = 0; /**< The number of decrypted bytes saved to the output file (protocol version 1). */
+
+    /** Writes the decrypted data to the output file if it's not memory-mapped. */
+    std::unique_ptr<AsyncWriter> out_writer;
+    int out_file_fd = -1; /**< File descriptor number of the output file to save decrypted data to. */
+    void *out_file_mem{}; /**< Pointer to memory-mapped output file to save decrypted data to. */
+
+    /** Signalises if the session is receiving the initial stream of data (not data it has requested to resend). */
+    bool first_pass = true;
+    unsigned int empty_passes = 0; /**< The number of consecutive resend rounds in which no data have arrived. */
+
+    uint64_t pass_packets = 0; /**< The number of data chunks received in the current pass. */
+
+    /**
+     * Receives a 'File Information' packet, decrypts the received file name, stores the received file length in
+     * @a recv_encrypted_file_len, calls open_file() and creates @a stream_crypto and @a reorder.
+     * In protocol version 2, stores the file length in @a recv_file_len and the chunk size in @a chunk_size,
+     * calls open_file() and creates @a chunk_crypto. If a batch of files is announced, @a recv_file_len is the length
+     * of the whole batch stream and no file is opened until the manifest is received. If a resumable transfer is
+     * announced, loads its journal and (in two-way mode) tells the sender which chunks are missing.
+     *
+     * @param [in] data The packet data.
+     * @param [in] data_len Length of the packet data.
+     * @throws std::runtime_error Thrown when the received packet doesn't contain valid data.
+     * @throws std::runtime_error Thrown when decryption fails.
+     */
+    void com_receive_fileinfo(const uint8_t *data, uint16_t data_len);
+
+    /**
+     * Processes a data chunk or an 'All Data Sent' packet. Decrypts the received data as soon as possible
+     * (see write_stream()). In protocol version 2, decrypts the chunks and saves them to the output file directly
+     * (the chunks that fail authentication are treated as missing). Marks the received chunks in @a tracker.
+     * The 'All Data Sent' packet of a streamed file sets its length.
+     *
+     * @param [in] header The ICMP Echo header of the packet.
+     * @param [in] data The packet data.
+     * @param [in] data_len Length of the packet data.
+     */
+    void com_receive_data(const ICMPEchoHeader &header, uint8_t *data, uint16_t data_len);
+
+    /**
+     * Ends the current pass of receiving data (after no data has arrived for R_RECV_TIMEOUT_MS milliseconds).
+     * If the transmission runs in two-way mode and some chunks are missing, requests resending them
+     * (see com_request_resend()) and starts another pass. Otherwise, finishes saving the file. Saves the journal
+     * of a resumable transfer, removes it when the transfer is complete. A streamed file is finished even if some
+     * chunks are missing (the sender is informed about them).
+     *
+     * @param [in] now The current time.
+     * @throws std::runtime_error Thrown when no data have arrived in R_MAX_EMPTY_PASSES consecutive resend rounds.
+     */
+    void com_end_pass(uint64_t now);
+
+    /**
+     * Sends a request to resend the missing chunks. In protocol version 2, sends up to R_RESEND_PACKETS
+     * 'Request Resend Ranges' packets with the missing ranges. In protocol version 1, sends a 'Request Resend' packet
+     * with the sequence numbers of the first missing chunks that fit into it.
+     *
+     * @param [in] ranges The missing ranges.
+     * @throws std::runtime_error Thrown when the packet cannot be sent.
+     */
+    void com_request_resend(const std::vector<ChunkRange> &ranges);
+
+    /**
+     * Opens the specified file as the output file. Attempts to pre-allocate space of @a size bytes
+     * and to map the file into memory. Populates out_file_fd and out_file_mem.
+     *
+     * @remark If memory mapping fails, the file is opened for out_writer instead.
+     * @param [in] name Name of the file.
+     * @param [in] size The number of bytes to allocate.
+     * @param [in] resume If true, the file of a resumed transfer is opened (it's not truncated or checked for
+     * existence).
+     * @throws std::runtime_error Thrown when the file cannot be opened.
+     */
+    void open_file(const std::string &name, uint64_t size, bool resume = false);
+
+    /**
+     * Saves a received chunk of the encrypted stream (protocol version 1). If the chunk follows the already
+     * decrypted data, decrypts it (and the chunks received before that follow it) and saves it to the output file.
+     * Otherwise, stores it in the reorder buffer.
+     *
+     * @param [in] pos The position of the chunk in the encrypted stream.
+     * @param [in] data The encrypted chunk.
+     * @param [in] data_len Length of the encrypted chunk.
+     * @throws std::runtime_error Thrown when decryption fails.
+     */
+    void write_stream(uint64_t pos, const uint8_t *data, uint32_t data_len);
+
+    /**
+     * Decrypts a chunk of the encrypted stream that follows the already decrypted data and saves it to the output
+     * file.
+     *
+     * @param [in] data The encrypted chunk.
+     * @param [in] data_len Length of the encrypted chunk.
+     * @throws std::runtime_error Thrown when decryption fails.
+     */
+    void decrypt_stream(const uint8_t *data, uint32_t data_len);
+
+    /**
+     * Finishes saving the decrypted stream (protocol version 1). Attempts to truncate the file to the resulting
+     * number of decrypted bytes. If some data haven't been received, only the data preceding them are saved.
+     *
+     * @throws std::system_error Thrown when the data cannot be written.
+     */
+    void close_stream();
+
+    /**
+     * Unmaps the output file after the chunks have been decrypted on arrival (protocol version 2).
+     * Waits for the data written in the background (see AsyncWriter) and truncates a streamed file to its length.
+     * When receiving a batch, closes the files and reports the incomplete ones.
+     *
+     * @throws std::system_error Thrown when the data cannot be written.
+     */
+    void close_file();
+
+    /**
+     * Saves decrypted data to the output file (protocol version 2). When receiving a batch, the data are saved to
+     * the manifest or to the files of the batch; when the manifest is complete, calls open_batch(). The contents
+     * of the files received before the manifest are kept in memory (up to R_REORDER_MEMORY_LIMIT bytes).
+     *
+     * @param [in] pos The position of the data in the file (or in the batch stream).
+     * @param [in] data The data.
+     * @param [in] len Length of the data.
+     * @return False if the data cannot be saved yet (they arrived before the manifest and there's not enough memory).
+     */
+    bool save_plain(uint64_t pos, const uint8_t *data, size_t len);
+
+    /**
+     * Reads saved data back from the output file (protocol version 2).
+     *
+     * @param [in] pos The position of the data in the file (or in the batch stream).
+     * @param [out] data A buffer to read the data to.
+     * @param [in] len Length of the data.
+     */
+    void load_plain(uint64_t pos, uint8_t *data, size_t len);
+
+    /**
+     * Decodes the received manifest, creates the files of the batch and saves the data received before.
+     *
+     * @param [in] resume If true, the files of a resumed transfer are opened (the manifest has been loaded from
+     * the journal).
+     * @throws std::runtime_error Thrown when the manifest is invalid or when the files cannot be created.
+     */
+    void open_batch(bool resume = false);
+
+    /**
+     * Saves the journal of a resumable transfer (if the transfer is resumable and unfinished).
+     *
+     * @param [in] now The current time.
+     */
+    void save_journal(uint64_t now);
+
+    /**
+     * Verifies and decrypts a received chunk (protocol version 2) and saves it to the output file (see save_plain()).
+     * A compressed chunk (protocol version 3) is decompressed first. Already received chunks are ignored.
+     * While the length of a streamed file is not known, any chunk up to the chunk size is accepted.
+     *
+     * @param [in] pos The position of the chunk in the file, with COMPRESSION_FLAG if the chunk is compressed.
+     * @param [in] data The encrypted chunk.
+     * @param [in] data_len Length of the encrypted chunk.
+     * @return False if the chunk doesn't fit into the file, if it is not authentic or if it cannot be saved yet.
+     */
+    bool write_chunk(uint64_t pos, const uint8_t *data, uint32_t data_len);
+
+    /**
+     * Verifies, decrypts and stores a parity chunk (see fec.h). Reconstructs the missing chunks of its group
+     * if possible.
+     *
+     * @param [in] pos The position field of the chunk (FEC_FLAG is set).
+     * @param [in] data The encrypted parity chunk.
+     * @param [in] data_len Length of the encrypted parity chunk.
+     */
+    void receive_parity(uint64_t pos, const uint8_t *data, uint32_t data_len);
+
+    /**
+     * Reconstructs the missing chunks of a group from its parity chunks and the received chunks (read back from
+     * the output file) if there are enough parity chunks. Forgets the parity chunks of a complete group.
+     * Does nothing while the length of a streamed file is not known (the last group may be shorter).
+     *
+     * @param [in] group The group number.
+     */
+    void recover_group(uint64_t group);
+
+    /** @return The number of data chunks the sender sends (protocol version 2). */
+    [[nodiscard]] uint64_t chunk_count() const { return recv_file_len / chunk_size + 1; }
+
+    /**
+     * Sends a protocol message – an ICMP Echo Request with one byte of data, optionally followed by a string message.
+     *
+     * @param [in] flag The protocol message type.
+     * @param [in] message The message. May be empty.
+     */
+    void com_send_control(uint8_t flag, const std::string &message);
+};
+
+#endif //ISA_RECEIVER_SESSION_H
@@ -0,0 +1,79 @@
+// reorder_buffer.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "reorder_buffer.h"
+
+ReorderBuffer::ReorderBuffer(size_t memory_limit) : memory_limit(memory_limit) {
+}
+
+ReorderBuffer::~ReorderBuffer() {
+    if (spill_file != nullptr) {
+        fclose(spill_file);
+    }
+}
+
+bool ReorderBuffer::add(uint64_t pos, const uint8_t *data, size_t len) {
+    if (pos < next_pos || segments.count(pos) != 0 || spilled_segments.count(pos) != 0) {
+        return false;
+    }
+
+    if (memory_size + len <= memory_limit) {
+        segments.emplace(pos, std::vector<uint8_t>(data, data + len));
+        memory_size += len;
+        return true;
+    }
+
+    if (spill_file == nullptr) {
+        spill_file = std::tmpfile();
+        if (spill_file == nullptr) {
+            throw std::runtime_error("Cannot open a temporary file for writing the received data");
+        }
+    }
+
+    if (pwrite(fileno(spill_file), data, len, static_cast<off_t>(pos)) != static_cast<ssize_t>(len)) {
+        throw std::runtime_error("Cannot write the received data to a temporary file");
+    }
+
+    spilled_segments.emplace(pos, len);
+    spilled_size += len;
+    return true;
+}
+
+size_t ReorderBuffer::pop(uint8_t *dest, size_t capacity) {
+    auto it = segments.find(next_pos);
+    if (it != segments.end()) {
+        auto len = it->second.size();
+        if (len > capacity) {
+            throw std::runtime_error("Reorder buffer segment too large");
+        }
+
+        std::copy(it->second.begin(), it->second.end(), dest);
+        memory_size -= len;
+        next_pos += len;
+        segments.erase(it);
+        return len;
+    }
+
+    auto spilled_it = spilled_segments.find(next_pos);
+    if (spilled_it != spilled_segments.end()) {
+        auto len = spilled_it->second;
+        if (len > capacity) {
+            throw std::runtime_error("Reorder buffer segment too large");
+        }
+
+        if (pread(fileno(spill_file), dest, len, static_cast<off_t>(next_pos)) != static_cast<ssize_t>(len)) {
+            throw std::runtime_error("Cannot read the received data from a temporary file");
+        }
+
+        spilled_size -= len;
+        next_pos += len;
+        spilled_segments.erase(spilled_it);
+        return len;
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+// reorder_buffer.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_REORDER_BUFFER_H
+#define ISA_REORDER_BUFFER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+/**
+ * Reassembles a stream from segments that arrive out of order. The segments are identified by their position in
+ * the stream. The consumer processes the stream from the beginning; the segments that arrive before all the
+ * preceding data are kept until they can be processed.
+ *
+ * @remark The segments are kept in memory up to a limit. The segments that don't fit are written to a temporary file
+ * at their position (the file is sparse, so it only takes the space of the written segments).
+ * @remark The segments must not partially overlap (the same segment may arrive multiple times, though).
+ */
+class ReorderBuffer {
+public:
+    /**
+     * Creates an empty ReorderBuffer.
+     *
+     * @param [in] memory_limit The maximum number of bytes kept in memory.
+     */
+    explicit ReorderBuffer(size_t memory_limit);
+
+    /**
+     * Closes the temporary file.
+     */
+    ~ReorderBuffer();
+
+    ReorderBuffer(const ReorderBuffer &) = delete;
+
+    ReorderBuffer &operator=(const ReorderBuffer &) = delete;
+
+    /**
+     * @return The position in the stream up to which the data has been processed.
+     */
+    [[nodiscard]] uint64_t position() const { return next_pos; }
+
+    /**
+     * Marks a segment at position() as processed (used when a segment arrives in order and the consumer
+     * processes it directly).
+     *
+     * @param [in] len Length of the segment.
+     */
+    void skip(size_t len) { next_pos += len; }
+
+    /**
+     * Stores a segment that cannot be processed yet.
+     *
+     * @param [in] pos The position of the segment in the stream.
+     * @param [in] data The segment data.
+     * @param [in] len Length of the segment.
+     * @return False if the segment has already been processed or stored.
+     * @throws std::runtime_error Thrown when the temporary file cannot be written.
+     */
+    bool add(uint64_t pos, const uint8_t *data, size_t len);
+
+    /**
+     * Takes the stored segment at position() (if any) and marks it as processed.
+     *
+     * @param [out] dest A buffer to copy the segment to.
+     * @param [in] capacity Size of the buffer. Must be able to hold any stored segment.
+     * @return Length of the segment; zero if no stored segment starts at position().
+     * @throws std::runtime_error Thrown when the temporary file cannot be read.
+     */
+    size_t pop(uint8_t *dest, size_t capacity);
+
+    /** @return The number of bytes kept in memory. */
+    [[nodiscard]] size_t memory_used() const { return memory_size; }
+
+    /** @return The number of bytes kept in the temporary file. */
+    [[nodiscard]] uint64_t spilled() const { return spilled_size; }
+
+private:
+    size_t memory_limit; /**< The maximum number of bytes kept in memory. */
+    uint64_t next_pos = 0; /**< The position up to which the data has been processed. */
+
+    std::map<uint64_t, std::vector<uint8_t>> segments; /**< The segments kept in memory (by position). */
+    size_t memory_size = 0; /**< The number of bytes kept in memory. */
+
+    std::map<uint64_t, uint32_t> spilled_segments; /**< Lengths of the segments in the temporary file (by position). */
+    uint64_t spilled_size = 0; /**< The number of bytes kept in the temporary file. */
+    FILE *spill_file = nullptr; /**< The temporary file; created when first needed. */
+};
+
+#endif //ISA_REORDER_BUFFER_H
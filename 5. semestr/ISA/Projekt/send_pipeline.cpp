@@ -0,0 +1,196 @@
+// send_pipeline.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+#include <unistd.h>
+
+#include "encryption.h"
+#include "send_pipeline.h"
+#include "metrics.h"
+#include "utils.h"
+
+void PipelineInput::rewind() const {
+    if (stream != nullptr) {
+        stream->clear();
+        stream->seekg(0, std::ios_base::beg);
+    }
+}
+
+SendPipeline::SendPipeline(const PipelineInput &input, size_t chunk_size, size_t header_len,
+                           std::vector<ChunkEncryptor> encryptors, std::vector<uint64_t> indices, uint32_t depth)
+        : input(input), chunk_size(chunk_size), header_size(header_len), encryptors(std::move(encryptors)),
+          indices(std::move(indices)), chunks(depth), free_chunks(depth) {
+    // The chunks of a mapped input are not copied, so they don't need the plain buffers
+    auto plain_size = input.stream != nullptr ? chunk_size : 0;
+    auto data_size = header_len + std::max(Crypto::encrypted_len(chunk_size), ChunkCrypto::encrypted_len(chunk_size));
+    buffers = std::make_unique<unsigned char[]>((plain_size + data_size) * depth);
+
+    for (uint32_t i = 0; i < depth; i++) {
+        chunks[i].buffer = buffers.get() + (plain_size + data_size) * i;
+        chunks[i].data = chunks[i].buffer + plain_size;
+        free_chunks.try_push(&chunks[i]);
+    }
+
+    for (size_t i = 0; i < this->encryptors.size(); i++) {
+        worker_input.push_back(std::make_unique<SpscQueue<PipelineChunk *>>(depth));
+        worker_output.push_back(std::make_unique<SpscQueue<PipelineChunk *>>(depth));
+    }
+
+    for (size_t i = 0; i < this->encryptors.size(); i++) {
+        workers.emplace_back(&SendPipeline::encrypt_loop, this, i);
+    }
+
+    reader = std::thread(&SendPipeline::read_loop, this);
+}
+
+SendPipeline::~SendPipeline() {
+    stopping = true;
+
+    reader.join();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+PipelineChunk *SendPipeline::next() {
+    if (finished) {
+        return nullptr;
+    }
+
+    auto &queue = *worker_output[next_count % worker_output.size()];
+    PipelineChunk *chunk;
+    unsigned int attempts = 0;
+    while (!queue.try_pop(chunk)) {
+        if (stopping) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            std::rethrow_exception(error);
+        }
+
+        backoff(attempts);
+    }
+
+    next_count++;
+    finished = chunk->is_last;
+    return chunk;
+}
+
+void SendPipeline::release(PipelineChunk *chunk) {
+    // There's always enough space for all the chunks
+    free_chunks.try_push(chunk);
+}
+
+void SendPipeline::read_loop() {
+    try {
+        uint64_t count = 0;
+        bool is_last = false;
+
+        while (!is_last) {
+            PipelineChunk *chunk;
+            if (!wait_pop(free_chunks, chunk)) {
+                return;
+            }
+
+            chunk->index = indices.empty() ? count : indices[count];
+            if (input.stream == nullptr) {
+                // The last chunk is the one that doesn't fill the chunk size (possibly an empty one)
+                auto pos = std::min<uint64_t>(chunk->index * chunk_size, input.len);
+                chunk->plain = input.data + pos;
+                chunk->plain_len = std::min<uint64_t>(chunk_size, input.len - pos);
+                is_last = indices.empty() ? chunk->plain_len < chunk_size : count + 1 == indices.size();
+            } else {
+                if (!indices.empty()) {
+                    input.stream->clear();
+                    input.stream->seekg(static_cast<std::streamoff>(chunk->index * chunk_size), std::ios_base::beg);
+                }
+
+                input.stream->read(reinterpret_cast<char *>(chunk->buffer), static_cast<std::streamsize>(chunk_size));
+                // Determine whether we've read the last chunk
+                is_last = indices.empty() ? input.stream->eof() : count + 1 == indices.size();
+
+                chunk->plain = chunk->buffer;
+                chunk->plain_len = input.stream->gcount();
+            }
+
+            chunk->is_last = is_last;
+
+            // The workers are assigned in the order of reading, the consumer collects the chunks in the same order
+            if (!wait_push(*worker_input[count % worker_input.size()], chunk)) {
+                return;
+            }
+
+            count++;
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+void SendPipeline::encrypt_loop(size_t worker) {
+    try {
+        auto &input = *worker_input[worker];
+        auto &output = *worker_output[worker];
+        auto &encrypt = encryptors[worker];
+
+        while (true) {
+            PipelineChunk *chunk;
+            if (!wait_pop(input, chunk)) {
+                return;
+            }
+
+            auto start = now_ns();
+            chunk->compressed = false;
+            chunk->encrypted_len = encrypt(chunk->data + header_size, chunk->plain, chunk->plain_len, chunk->index,
+                                           chunk->is_last, chunk->compressed);
+            metric_record(encrypt_ns, now_ns() - start);
+
+            if (!wait_push(output, chunk) || chunk->is_last) {
+                return;
+            }
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+void SendPipeline::fail(std::exception_ptr exception) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) {
+        error = std::move(exception);
+    }
+
+    stopping = true;
+}
+
+bool SendPipeline::wait_push(SpscQueue<PipelineChunk *> &queue, PipelineChunk *chunk) {
+    unsigned int attempts = 0;
+    while (!queue.try_push(chunk)) {
+        if (stopping) {
+            return false;
+        }
+
+        backoff(attempts);
+    }
+
+    return true;
+}
+
+bool SendPipeline::wait_pop(SpscQueue<PipelineChunk *> &queue, PipelineChunk *&chunk) {
+    unsigned int attempts = 0;
+    while (!queue.try_pop(chunk)) {
+        if (stopping) {
+            return false;
+        }
+
+        backoff(attempts);
+    }
+
+    return true;
+}
+
+void SendPipeline::backoff(unsigned int &attempts) {
+    if (attempts++ < S_PIPELINE_SPIN_LIMIT) {
+        std::this_thread::yield();
+    } else {
+        usleep(S_PIPELINE_SLEEP_US);
+    }
+}
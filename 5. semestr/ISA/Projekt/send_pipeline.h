@@ -0,0 +1,202 @@
+// send_pipeline.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_SEND_PIPELINE_H
+#define ISA_SEND_PIPELINE_H
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "spsc_queue.h"
+
+/**
+ * A chunk of data passed through the SendPipeline.
+ */
+struct PipelineChunk {
+    uint64_t index; /**< The chunk index (zero for the first chunk of the stream). */
+    bool is_last; /**< Signalises that this is the last chunk passed through the pipeline. */
+    /** The plain data: in @a buffer when read from a stream, in the mapped input otherwise. */
+    const unsigned char *plain;
+    unsigned char *buffer; /**< A buffer to read the plain data from a stream to. */
+    size_t plain_len; /**< Length of the read data. */
+    /** A buffer that starts with the pipeline's header_len bytes reserved for the caller, followed by the encrypted
+     * data. */
+    unsigned char *data;
+    size_t encrypted_len; /**< Length of the encrypted data (without the reserved header). */
+    bool compressed; /**< Signalises that the data have been compressed before encryption (see compression.h). */
+};
+
+/**
+ * The input of a SendPipeline: a stream or a memory-mapped file. The chunks of a mapped file are not copied,
+ * the encryptors read them straight from the mapping (and so from the page cache).
+ */
+struct PipelineInput {
+    std::istream *stream = nullptr; /**< The input stream; nullptr if the input is mapped. */
+    const unsigned char *data = nullptr; /**< The mapped input. */
+    uint64_t len = 0; /**< Length of the mapped input. */
+    bool seekable = true; /**< False if the stream cannot be read again (e.g. a pipe). */
+
+    /**
+     * Creates an input that reads a stream.
+     *
+     * @param [in,out] stream The input stream.
+     * @param [in] seekable False if the stream cannot be read again.
+     */
+    explicit PipelineInput(std::istream &stream, bool seekable = true) : stream(&stream), seekable(seekable) {}
+
+    /**
+     * Creates an input that reads a mapped file.
+     *
+     * @param [in] data The mapped file.
+     * @param [in] len Length of the mapped file.
+     */
+    PipelineInput(const unsigned char *data, uint64_t len) : data(data), len(len) {}
+
+    /**
+     * Moves back to the beginning of the input (a stream must be seekable).
+     */
+    void rewind() const;
+};
+
+/**
+ * A function that encrypts one chunk (possibly compressing it first). Returns the number of bytes saved to dest.
+ *
+ * @param [out] dest A buffer to save the encrypted data to.
+ * @param [in] plain The input data.
+ * @param [in] plain_len Length of the input data.
+ * @param [in] index The chunk index.
+ * @param [in] is_last True if this is the last chunk of the stream.
+ * @param [out] compressed Set to true if the data have been compressed (false when called).
+ */
+using ChunkEncryptor = std::function<size_t(unsigned char *dest, const unsigned char *plain, size_t plain_len,
+                                            uint64_t index, bool is_last, bool &compressed)>;
+
+/**
+ * Reads an input and encrypts it in background threads so that reading from disk and encryption overlap with
+ * sending the data.
+ *
+ * The reader thread reads chunks into free buffers and distributes them to the encryption workers (round-robin in
+ * the order of reading). Each worker has its own encryptor. The consumer (the sending thread) collects the encrypted chunks
+ * in order using next() and returns their buffers using release(). All the stages are connected by SpscQueues.
+ *
+ * @remark With a chaining cipher mode (CBC), the chunks depend on each other and there must be exactly one worker.
+ * @remark If a list of chunk indices is provided, only these chunks are read (the stream must be seekable).
+ * @remark The input must not be used by anyone else until the pipeline is destroyed.
+ */
+class SendPipeline {
+public:
+    /**
+     * Creates a SendPipeline and starts the reader and the worker threads.
+     *
+     * @param [in] input The input. The badbit exception of an input stream is propagated to the consumer.
+     * @param [in] chunk_size The number of bytes to read into one chunk.
+     * @param [in] header_len The number of bytes to reserve before the encrypted data of each chunk.
+     * @param [in] encryptors The encryptors, one for each worker thread.
+     * @param [in] indices If not empty, only the chunks with these indices are read (in the given order).
+     * Otherwise, the whole stream is read from the current position (a mapped input from the beginning).
+     * @param [in] depth The number of chunk buffers (the maximum number of chunks read ahead).
+     */
+    SendPipeline(const PipelineInput &input, size_t chunk_size, size_t header_len,
+                 std::vector<ChunkEncryptor> encryptors, std::vector<uint64_t> indices = {},
+                 uint32_t depth = S_PIPELINE_DEPTH);
+
+    /**
+     * Stops the threads and frees the buffers.
+     */
+    ~SendPipeline();
+
+    SendPipeline(const SendPipeline &) = delete;
+
+    SendPipeline &operator=(const SendPipeline &) = delete;
+
+    /**
+     * Waits for the next encrypted chunk. The chunk must be returned using release() when no longer needed.
+     *
+     * @return A pointer to the next chunk; nullptr after the last chunk has been returned.
+     * @throws std::exception Rethrows the exception that occurred in a background thread (e.g. a read error).
+     */
+    PipelineChunk *next();
+
+    /**
+     * Returns a chunk buffer to the reader.
+     *
+     * @param [in] chunk The chunk returned by next().
+     */
+    void release(PipelineChunk *chunk);
+
+private:
+    PipelineInput input; /**< The input. */
+    size_t chunk_size; /**< The number of bytes to read into one chunk. */
+    size_t header_size; /**< The number of bytes reserved before the encrypted data of each chunk. */
+    std::vector<ChunkEncryptor> encryptors; /**< The encryptors, one for each worker. */
+    std::vector<uint64_t> indices; /**< The indices of the chunks to read; empty to read the whole stream. */
+
+    std::vector<PipelineChunk> chunks; /**< All chunks. */
+    std::unique_ptr<unsigned char[]> buffers; /**< Memory for the plain and encrypted buffers of all chunks. */
+
+    SpscQueue<PipelineChunk *> free_chunks; /**< Chunks returned by the consumer to the reader. */
+    std::vector<std::unique_ptr<SpscQueue<PipelineChunk *>>> worker_input; /**< Chunks read for each worker. */
+    std::vector<std::unique_ptr<SpscQueue<PipelineChunk *>>> worker_output; /**< Chunks encrypted by each worker. */
+
+    uint64_t next_count = 0; /**< The number of chunks the consumer has received. */
+    bool finished = false; /**< Signalises that the consumer has received the last chunk. */
+
+    std::atomic<bool> stopping{false}; /**< Signalises the threads to stop (on destruction or on error). */
+    std::mutex error_mutex; /**< Guards error. */
+    std::exception_ptr error; /**< The first exception that occurred in a background thread. */
+
+    std::thread reader; /**< The reader thread. */
+    std::vector<std::thread> workers; /**< The encryption worker threads. */
+
+    /**
+     * The reader thread body.
+     */
+    void read_loop();
+
+    /**
+     * The worker thread body.
+     *
+     * @param [in] worker The worker number.
+     */
+    void encrypt_loop(size_t worker);
+
+    /**
+     * Stores an exception to be rethrown to the consumer and stops the threads.
+     *
+     * @param [in] exception The exception.
+     */
+    void fail(std::exception_ptr exception);
+
+    /**
+     * Adds an item to a queue, waits while the queue is full.
+     *
+     * @return False if the pipeline is stopping.
+     */
+    bool wait_push(SpscQueue<PipelineChunk *> &queue, PipelineChunk *chunk);
+
+    /**
+     * Removes an item from a queue, waits while the queue is empty.
+     *
+     * @return False if the pipeline is stopping.
+     */
+    bool wait_pop(SpscQueue<PipelineChunk *> &queue, PipelineChunk *&chunk);
+
+    /**
+     * Yields the processor to the other threads while waiting for a queue. After a number of unsuccessful attempts,
+     * sleeps for a short time.
+     *
+     * @param [in,out] attempts The number of unsuccessful attempts so far.
+     */
+    static void backoff(unsigned int &attempts);
+};
+
+#endif //ISA_SEND_PIPELINE_H
@@ -0,0 +1,167 @@
+// send_window.cpp
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+#include <algorithm>
+
+#include "common.h"
+#include "send_window.h"
+#include "metrics.h"
+
+SendWindow::SendWindow(uint32_t capacity, std::function<void(PipelineChunk *)> release_chunk)
+        : slots(capacity), release_chunk(std::move(release_chunk)), window(S_WINDOW_INITIAL), ssthresh(capacity),
+          rto_us(S_RTO_INITIAL_US) {
+    free_slots.reserve(capacity);
+    slot_by_index.reserve(capacity);
+
+    for (uint32_t i = 0; i < capacity; i++) {
+        free_slots.push_back(capacity - i - 1);
+    }
+
+    window = std::min(window, static_cast<double>(capacity));
+}
+
+SendWindow::~SendWindow() {
+    for (auto &entry: slot_by_index) {
+        release_chunk(slots[entry.second].chunk);
+    }
+}
+
+bool SendWindow::can_send() const {
+    return !free_slots.empty() && static_cast<double>(slot_by_index.size()) < window;
+}
+
+WindowSlot *SendWindow::acquire(uint64_t index, uint16_t seq) {
+    if (free_slots.empty()) {
+        return nullptr;
+    }
+
+    auto pos = free_slots.back();
+    free_slots.pop_back();
+    slot_by_index[index] = pos;
+
+    WindowSlot &slot = slots[pos];
+    slot.index = index;
+    slot.seq = seq;
+    slot.chunk = nullptr;
+    slot.header_len = 0;
+    slot.data_len = 0;
+    slot.transmissions = 0;
+
+    return &slot;
+}
+
+void SendWindow::sent(WindowSlot *slot, uint64_t now_us) {
+    // Exponential back-off for retransmitted chunks (RFC 6298, section 5.5)
+    uint64_t timeout = rto_us << std::min<uint8_t>(slot->transmissions, 6);
+
+    slot->transmissions++;
+    slot->sent_at_us = now_us;
+    slot->deadline_us = now_us + std::min<uint64_t>(timeout, S_RTO_MAX_US);
+    timers.push(Timer{slot->deadline_us, slot->index, slot->transmissions});
+}
+
+void SendWindow::release(WindowSlot *slot) {
+    auto it = slot_by_index.find(slot->index);
+    if (it == slot_by_index.end()) {
+        return;
+    }
+
+    free_slot(it);
+}
+
+void SendWindow::free_slot(std::unordered_map<uint64_t, uint32_t>::iterator it) {
+    auto chunk = slots[it->second].chunk;
+    free_slots.push_back(it->second);
+    slot_by_index.erase(it);
+
+    if (chunk != nullptr) {
+        release_chunk(chunk);
+    }
+}
+
+bool SendWindow::ack(uint64_t index, uint64_t now_us) {
+    auto it = slot_by_index.find(index);
+    if (it == slot_by_index.end()) {
+        return false;
+    }
+
+    WindowSlot &slot = slots[it->second];
+
+    // Karn's algorithm: don't take samples from retransmitted chunks, the reply may belong to any transmission
+    if (slot.transmissions == 1) {
+        update_rtt(now_us - slot.sent_at_us);
+        metric_record(rtt_us, now_us - slot.sent_at_us);
+    }
+
+    free_slot(it);
+    acked++;
+
+    // Don't grow the window while the round-trip time is inflated
+    bool queue_building = min_rtt_us != UINT64_MAX
+                          && srtt_us > min_rtt_us * S_WINDOW_RTT_INFLATION + S_WINDOW_RTT_SLACK_US;
+    if (window < ssthresh) {
+        window += 1.0;
+    } else if (!queue_building) {
+        window += 1.0 / window;
+    }
+
+    window = std::min(window, static_cast<double>(slots.size()));
+    return true;
+}
+
+WindowSlot *SendWindow::pop_expired(uint64_t now_us) {
+    if (time_to_deadline(now_us) != 0) {
+        return nullptr;
+    }
+
+    WindowSlot &slot = slots[slot_by_index[timers.top().index]];
+    timers.pop();
+    expired++;
+
+    // Only react to one loss per round-trip time (the chunks sent before the last reduction don't count)
+    if (slot.sent_at_us > last_reduction_us) {
+        ssthresh = std::max(window / 2.0, static_cast<double>(S_WINDOW_MIN));
+        window = ssthresh;
+        last_reduction_us = now_us;
+    }
+
+    return &slot;
+}
+
+int64_t SendWindow::time_to_deadline(uint64_t now_us) {
+    // Skip the timers of acknowledged chunks and of superseded transmissions
+    while (!timers.empty()) {
+        auto it = slot_by_index.find(timers.top().index);
+        if (it != slot_by_index.end() && slots[it->second].transmissions == timers.top().transmissions) {
+            break;
+        }
+
+        timers.pop();
+    }
+
+    if (timers.empty()) {
+        return -1;
+    }
+
+    auto deadline_us = timers.top().deadline_us;
+    if (deadline_us <= now_us) {
+        return 0;
+    }
+
+    return static_cast<int64_t>(deadline_us - now_us);
+}
+
+void SendWindow::update_rtt(uint64_t rtt_us) {
+    min_rtt_us = std::min(min_rtt_us, rtt_us);
+
+    if (srtt_us == 0) {
+        srtt_us = rtt_us;
+        rttvar_us = rtt_us / 2;
+    } else {
+        uint64_t delta = srtt_us > rtt_us ? srtt_us - rtt_us : rtt_us - srtt_us;
+        rttvar_us = (3 * rttvar_us + delta) / 4;
+        srtt_us = (7 * srtt_us + rtt_us) / 8;
+    }
+
+    rto_us = std::clamp<uint64_t>(srtt_us + 4 * rttvar_us, S_RTO_MIN_US, S_RTO_MAX_US);
+}
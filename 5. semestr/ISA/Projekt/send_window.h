@@ -0,0 +1,186 @@
+// send_window.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_SEND_WINDOW_H
+#define ISA_SEND_WINDOW_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "utils.h"
+#include "send_pipeline.h"
+
+/**
+ * Describes a data chunk that has been sent and waits for an acknowledgement.
+ */
+struct WindowSlot {
+    uint64_t index; /**< The chunk index (zero for the first data chunk). */
+    uint16_t seq; /**< The ICMP sequence number the chunk is sent with. */
+    uint8_t header[IP4_HEADER_LEN + ICMP_HEADER_LEN]; /**< The packet headers (see make_echo_header()). */
+    uint8_t header_len; /**< Length of the packet headers. */
+    PipelineChunk *chunk; /**< The chunk the packet data are taken from; held until the slot is freed. */
+    const uint8_t *data; /**< A pointer to the packet data that follow the headers (in the chunk's buffer). */
+    uint16_t data_len; /**< Length of the packet data. */
+    uint64_t sent_at_us; /**< Time of the last transmission (monotonic, in microseconds). */
+    uint64_t deadline_us; /**< Time after which the last transmission is considered lost. */
+    uint8_t transmissions; /**< Number of times the chunk has been transmitted. */
+};
+
+/**
+ * A sliding window of data chunks in flight. Holds the headers and the chunks of the sent packets so that they can be
+ * retransmitted (without copying the data), runs a retransmission timer for each of them and controls the number of
+ * chunks that may be in flight (the congestion window).
+ *
+ * @remark The chunks are acknowledged by the Echo Reply messages the receiver's system generates for every
+ * received Echo Request. Such acknowledgement only signalises that the receiving host got the packet.
+ * @remark The retransmission timeout is computed as described in RFC 6298. The congestion window grows by one chunk
+ * per acknowledged chunk in slow start and by one chunk per round-trip time afterwards. The growth is paused while
+ * the measured round-trip time is inflated (which signalises that a queue is building up on the path). A lost chunk
+ * halves the window (at most once per round-trip time).
+ */
+class SendWindow {
+public:
+    /**
+     * Creates a SendWindow.
+     *
+     * @param [in] capacity The maximum number of chunks in flight.
+     * @param [in] release_chunk Called with the chunk of a slot when the slot is freed (acknowledged or released).
+     */
+    SendWindow(uint32_t capacity, std::function<void(PipelineChunk *)> release_chunk);
+
+    /**
+     * Returns the chunks that are still in flight.
+     */
+    ~SendWindow();
+
+    SendWindow(const SendWindow &) = delete;
+
+    SendWindow &operator=(const SendWindow &) = delete;
+
+    /**
+     * @return True if the congestion window allows sending another chunk.
+     */
+    [[nodiscard]] bool can_send() const;
+
+    /**
+     * @return The number of chunks in flight.
+     */
+    [[nodiscard]] size_t in_flight() const { return slot_by_index.size(); }
+
+    /**
+     * Reserves a slot for a new chunk. The caller should fill in the slot's headers, chunk and data and call sent().
+     *
+     * @param [in] index The chunk index.
+     * @param [in] seq The ICMP sequence number of the chunk.
+     * @return A pointer to the reserved slot; nullptr if the window is full.
+     */
+    WindowSlot *acquire(uint64_t index, uint16_t seq);
+
+    /**
+     * Marks a chunk as (re)transmitted and starts its retransmission timer.
+     *
+     * @param [in,out] slot The slot returned by acquire() or pop_expired().
+     * @param [in] now_us The current time.
+     */
+    void sent(WindowSlot *slot, uint64_t now_us);
+
+    /**
+     * Removes a chunk from the window without acknowledging it (e.g. when it has been retransmitted too many times).
+     *
+     * @param [in] slot The slot to free.
+     */
+    void release(WindowSlot *slot);
+
+    /**
+     * Acknowledges a chunk. Updates the round-trip time estimation and grows the congestion window.
+     *
+     * @param [in] index The chunk index.
+     * @param [in] now_us The current time.
+     * @return True if the chunk was in flight; false for unknown or duplicate acknowledgements.
+     */
+    bool ack(uint64_t index, uint64_t now_us);
+
+    /**
+     * Finds a chunk the retransmission timer of which has expired and treats it as lost (shrinks the window).
+     * The caller should either retransmit the chunk and call sent(), or call release().
+     *
+     * @param [in] now_us The current time.
+     * @return A pointer to the expired slot; nullptr if no timer has expired.
+     */
+    WindowSlot *pop_expired(uint64_t now_us);
+
+    /**
+     * @param [in] now_us The current time.
+     * @return Number of microseconds until the nearest retransmission timer expires (zero if already expired);
+     * -1 if no chunk is in flight.
+     */
+    int64_t time_to_deadline(uint64_t now_us);
+
+    /** @return The current smoothed round-trip time in microseconds (zero if not measured yet). */
+    [[nodiscard]] uint64_t srtt() const { return srtt_us; }
+
+    /** @return The lowest measured round-trip time in microseconds. */
+    [[nodiscard]] uint64_t min_rtt() const { return min_rtt_us; }
+
+    /** @return The current retransmission timeout in microseconds. */
+    [[nodiscard]] uint64_t rto() const { return rto_us; }
+
+    /** @return The current congestion window (number of chunks). */
+    [[nodiscard]] double cwnd() const { return window; }
+
+    uint64_t acked = 0; /**< Number of acknowledged chunks. */
+    uint64_t expired = 0; /**< Number of expired retransmission timers. */
+
+private:
+    /** A retransmission timer in the timer heap. */
+    struct Timer {
+        uint64_t deadline_us; /**< The deadline of the transmission. */
+        uint64_t index; /**< The chunk index. */
+        uint8_t transmissions; /**< The transmission number the timer belongs to. */
+
+        bool operator>(const Timer &other) const {
+            return deadline_us > other.deadline_us || (deadline_us == other.deadline_us && index > other.index);
+        }
+    };
+
+    std::vector<WindowSlot> slots; /**< All slots. */
+    std::vector<uint32_t> free_slots; /**< Positions of the unused slots in @a slots. */
+    std::unordered_map<uint64_t, uint32_t> slot_by_index; /**< Maps indices of chunks in flight to their slots. */
+    /**
+     * The retransmission timers ordered by their deadline (the back-off and the changing timeout make the deadlines
+     * differ from the order of transmission). The timers of acknowledged chunks and of superseded transmissions are
+     * only removed when they get to the top.
+     */
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+    std::function<void(PipelineChunk *)> release_chunk; /**< Returns the chunk of a freed slot. */
+
+    double window; /**< The congestion window. */
+    double ssthresh; /**< The slow start threshold. */
+    uint64_t last_reduction_us = 0; /**< Time of the last congestion window reduction. */
+
+    uint64_t srtt_us = 0; /**< Smoothed round-trip time. */
+    uint64_t rttvar_us = 0; /**< Round-trip time variation. */
+    uint64_t min_rtt_us = UINT64_MAX; /**< The lowest measured round-trip time. */
+    uint64_t rto_us; /**< The retransmission timeout. */
+
+    /**
+     * Updates the round-trip time estimation with a new sample (RFC 6298, section 2).
+     *
+     * @param [in] rtt_us The measured round-trip time.
+     */
+    void update_rtt(uint64_t rtt_us);
+
+    /**
+     * Frees a slot and returns its chunk.
+     *
+     * @param [in] it The slot's entry in @a slot_by_index.
+     */
+    void free_slot(std::unordered_map<uint64_t, uint32_t>::iterator it);
+};
+
+#endif //ISA_SEND_WINDOW_H
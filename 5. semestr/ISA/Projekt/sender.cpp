@@ -2,24 +2,47 @@
 // Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
 
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <fstream>
 #include <vector>
 #include <algorithm>
+#include <memory>
+#include <thread>
+#include <filesystem>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 
 #include "encryption.h"
 #include "utils.h"
 #include "interface_find.h"
 #include "sender.h"
 #include "packet_utils.h"
+#include "send_window.h"
+#include "send_pipeline.h"
+#include "mps_cache.h"
+#include "batch_manifest.h"
+#include "metrics.h"
+#include "errors.h"
 
-using std::istream;
 using std::string;
 
-Sender::Sender(const string &target_hostname) : mode(ONE_WAY) {
+Sender::Sender(const string &target_hostname, const SenderOptions &options)
+        : mode(ONE_WAY), version(options.protocol_version), fec_group_size(options.fec_group_size),
+          fec_parity_count(options.fec_parity_count), resumable(options.resumable),
+          compress(options.compress) {
+    if (fec_parity_count > 0 && (fec_group_size == 0 || fec_group_size + fec_parity_count > FEC_MAX_CHUNKS)) {
+        throw std::invalid_argument("Invalid forward error correction parameters");
+    }
+
     // Resolve destination
     auto target_addr = resolve(target_hostname);
 
     // Find source IP address
     InterfaceFinder interface_finder;
+    string target_interface;
     sockaddr *src_addr, *dst_addr;
     bool iface_found = interface_finder.find_source_interface(target_addr, target_interface, src_addr, dst_addr);
     if (!iface_found) {
@@ -27,43 +50,245 @@ Sender::Sender(const string &target_hostname) : mode(ONE_WAY) {
     }
 
     log_verbose("Source IP: " << addr_to_string(src_addr));
+    log_verbose("Checksum implementation: " << checksum_impl_name());
+    add_path(dst_addr, src_addr, target_interface, options.rate);
 
-    // Find maximum packet size
-    auto mps_channel = Channel(dst_addr, src_addr, target_interface, MPS_RECV_TIMEOUT_MS);
-    auto mps = find_max_packet_size(mps_channel, STARTING_MPS);
+    if (options.multipath) {
+        // One path for each family and interface that reaches one of the receiver's addresses
+        for (const auto &found: interface_finder.find_paths(target_addr)) {
+            if (paths.size() == S_MAX_PATHS) {
+                break;
+            }
 
-    packet_buffer = new uint8_t[mps.packet_size];
-    data_buffer = new char[mps.data_size];
-    packet_len = mps.packet_size;
-    data_len = mps.data_size;
+            bool is_new = std::none_of(paths.begin(), paths.end(), [&found](const std::unique_ptr<SendPath> &path) {
+                return path->channel->dst_addr.family == found.dst_address->sa_family
+                       && path->interface == found.if_name;
+            });
+
+            if (!is_new) {
+                continue;
+            }
+
+            try {
+                add_path(found.dst_address, found.src_address, found.if_name, options.rate);
+            } catch (std::runtime_error &e) {
+                log_warn("Cannot use the path from " << found.if_name << " to " << addr_to_string(found.dst_address)
+                                                     << ": " << e.what());
+            }
+        }
+
+        if (paths.size() == 1) {
+            log_warn("No other path to the receiver found, sending over a single path");
+        }
+    }
+
+    // The chunks may be sent over any path, so they must fit into the smallest packets
+    packet_len = 0;
+    data_len = UINT16_MAX;
+    for (const auto &path: paths) {
+        packet_len = std::max(packet_len, path->packet_len);
+        data_len = std::min(data_len, path->data_len);
+    }
+
+    // The control messages are received to the same buffer, they're not limited by the maximum packet size
+    packet_buffer = new uint8_t[std::max<size_t>(packet_len, R_RECV_BUFFER_SIZE)];
+    data_buffer = new char[data_len];
+    recv_batch = new RecvBatch(BATCH_SIZE, packet_len);
+    channel = paths[0]->channel.get();
 
     srand(getpid());
     trans_id = rand() % UINT16_MAX;
 
+    // The keys of the transfer are derived from the salt (protocol version 4), it must not repeat
+    if (RAND_bytes(transfer_salt.data(), static_cast<int>(transfer_salt.size())) != 1) {
+        throw std::runtime_error("Cannot generate the transfer salt");
+    }
+}
+
+void Sender::add_path(sockaddr *dst, sockaddr *src, const string &if_name, const RateOptions &rate_options) {
+    auto path = std::make_unique<SendPath>();
+    path->interface = if_name;
+
+    // Find maximum packet size (or take it from the cache)
+    MPSCache mps_cache;
+    MPSResult mps{};
+    path->mps_cached = mps_cache.lookup(src, dst, mps);
+    if (path->mps_cached) {
+        log_verbose("Using cached maximum packet size " << mps.packet_size << " (" << if_name << ")");
+    } else {
+        auto mps_channel = Channel(dst, src, if_name, MPS_RECV_TIMEOUT_MS);
+        mps = find_max_packet_size(mps_channel, STARTING_MPS);
+        mps_cache.store(src, dst, mps);
+    }
+
+    path->packet_len = mps.packet_size;
+    path->data_len = mps.data_size;
+    path->rate = std::make_unique<RateController>(rate_options, mps.packet_size);
+    path->batch_buffer = std::make_unique<uint8_t[]>(sizeof(EchoHeaderTemplate::data) * BATCH_SIZE);
+
     // Create channel
-    channel = new Channel(dst_addr, src_addr, target_interface);
+    path->channel = std::make_unique<Channel>(dst, src, if_name);
+    set_receive_buffer_size(path->channel->socket_fd, SOCKET_BUFFER_SIZE);
+
+    if (!paths.empty()) {
+        log_info("Adding path " << path->name());
+    }
+
+    paths.push_back(std::move(path));
 }
 
-void Sender::send(istream &stream, const string &file_name, const secure_string &password) {
-    if (stream.eof()) {
+void Sender::send(const string &path, const string &file_name, const secure_string &password) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        THROW_ERRNO_W("Cannot open file " + path);
+    }
+
+    struct stat file_stat{};
+    if (fstat(fd, &file_stat) == -1) {
+        CLOSE_THROW_W(fd, "Cannot open file " + path);
+    }
+
+    // The size of a regular file is known without reading it; an empty file cannot be mapped
+    bool is_regular = S_ISREG(file_stat.st_mode);
+    auto size = static_cast<uint64_t>(file_stat.st_size);
+    void *mem = MAP_FAILED;
+    if (is_regular && size > 0) {
+        mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem == MAP_FAILED) {
+            log_verbose("Cannot memory-map the file, reading it as a stream: " << strerror(errno));
+        }
+    }
+
+    // The mapping stays valid after the file is closed
+    close(fd);
+
+    uint8_t identity[PROTO_IDENTITY_LEN];
+    if (mem != MAP_FAILED) {
+        struct Unmap {
+            uint64_t len;
+
+            void operator()(void *addr) const { munmap(addr, len); }
+        };
+        std::unique_ptr<void, Unmap> mapping(mem, Unmap{size});
+
+        // The chunks are read in order (only the resent ones are not), let the kernel read ahead
+        madvise(mem, size, MADV_SEQUENTIAL);
+
+        PipelineInput input(static_cast<const unsigned char *>(mem), size);
+        if (resumable) {
+            compute_identity(input, identity);
+        }
+
+        send_stream(input, static_cast<std::streamsize>(size), file_name, password, 0,
+                    resumable ? identity : nullptr);
         return;
     }
 
-    // Throw when the stream gets into an erroneous state
+    // Pipes and other special files cannot be read again, they're sent in streaming mode
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+    if (!stream) {
+        THROW_ERRNO_W("Cannot open file " + path);
+    }
+
+    stream.exceptions(std::iostream::badbit);
+    PipelineInput input(stream, is_regular);
+
+    if (resumable && !is_regular) {
+        log_warn("The input cannot be read twice, the transfer will not be resumable");
+    } else if (resumable) {
+        compute_identity(input, identity);
+    }
+
+    send_stream(input, static_cast<std::streamsize>(size), file_name, password, 0,
+                resumable && is_regular ? identity : nullptr);
+}
+
+void Sender::send_batch(const std::vector<string> &paths, const secure_string &password) {
+    auto manifest = BatchManifest::scan(paths);
+    if (manifest.entries().empty()) {
+        throw std::runtime_error("No files to send");
+    }
+
+    // The files are read as one stream: the manifest followed by their contents
+    BatchStreamBuf buffer(manifest);
+    std::istream stream(&buffer);
     stream.exceptions(std::iostream::failbit | std::iostream::badbit);
 
-    // If the input stream doesn't support seeking, this will throw
-    auto stream_size = get_file_size(stream);
+    PipelineInput input(stream);
+    uint8_t identity[PROTO_IDENTITY_LEN];
+    if (resumable) {
+        compute_identity(input, identity);
+    }
+
+    log_info("Sending " << manifest.entries().size() << " files (" << manifest.data_len() << " bytes)");
+    auto name = std::filesystem::path(manifest.entries()[0].path).begin()->string();
+    send_stream(input, static_cast<std::streamsize>(buffer.stream_len()), name, password, buffer.manifest_len(),
+                resumable ? identity : nullptr);
+}
 
+void Sender::send_stream(const PipelineInput &input, std::streamsize stream_size, const string &file_name,
+                         const secure_string &password, uint64_t manifest_len, const uint8_t *identity) {
     com_init();
-    com_send_fileinfo(file_name, stream_size, password);
-    com_send_data(stream, password);
+
+    // The length of a stream that cannot be read twice is only known when it has been read
+    if (version == PROTO_VERSION_STREAM && !input.seekable) {
+        throw std::runtime_error("Sending data from a pipe requires protocol version 2");
+    }
+
+    if (version == PROTO_VERSION_STREAM && manifest_len > 0) {
+        throw std::runtime_error("Sending multiple files requires protocol version 2");
+    }
+
+    if (version == PROTO_VERSION_STREAM
+        && Crypto::encrypted_len(stream_size) / chunk_size() + 1 > PROTO_DATA_SEQ_COUNT) {
+        throw std::runtime_error("The file is too large to be sent using protocol version 1");
+    }
+
+    if (version < PROTO_VERSION_COMPRESSION && compress) {
+        log_warn("Compression requires protocol version 3, the data will not be compressed");
+        compress = false;
+    }
+
+    if (version == PROTO_VERSION_STREAM && identity != nullptr) {
+        log_warn("Resuming requires protocol version 2, the transfer will not be resumable");
+        identity = nullptr;
+    }
+
+    // The receiver only accepts the data from the additional paths after it answers their 'Join' messages
+    if (paths.size() > 1 && (version == PROTO_VERSION_STREAM || mode == ONE_WAY)) {
+        log_warn("Multipath transfers require protocol version 2 and two-way mode, sending over a single path");
+        paths.resize(1);
+    }
+
+    com_send_fileinfo(file_name, input.seekable ? stream_size : 0, password, manifest_len, identity,
+                      !input.seekable);
+
+    // The receiver may have received a part of the stream in a previous transfer
+    std::vector<uint64_t> indices;
+    if (identity != nullptr && mode == TWO_WAY) {
+        chunk_count = static_cast<uint64_t>(stream_size) / chunk_size() + 1;
+        if (com_receive_resume(indices)) {
+            log_info("Resuming the transfer, " << chunk_count - indices.size() << " of " << chunk_count
+                                               << " chunks already received");
+            com_join_paths(password);
+            com_send_data(input, password, &indices, true);
+            finish_mps_probe();
+            return;
+        }
+    }
+
+    com_join_paths(password);
+    com_send_data(input, password);
+    finish_mps_probe();
 }
 
 void Sender::com_init() {
-    // Send hello (0x01 10 01 10)
-    char hello[] = PROTO_HELLO;
+    // Send hello (0x01 10 01 10), followed by the protocol version and the transfer salt (omitted in version 1)
+    char hello[5 + CRYPTO_TRANSFER_SALT_LEN] = PROTO_HELLO;
     char hello_resp[] = PROTO_HELLO_BACK;
+    hello[4] = static_cast<char>(version);
+    memcpy(hello + 5, transfer_salt.data(), transfer_salt.size());
+    uint16_t hello_len = version == PROTO_VERSION_STREAM ? 4 : sizeof(hello);
 
     uint8_t *packet;
     uint16_t packet_size;
@@ -78,7 +303,7 @@ void Sender::com_init() {
     com_init_fsm:
     switch (state) {
         case 0: // Sending our Hello packet
-            packet_size = make_icmp_packet(packet_buffer, packet, channel, trans_id, 0, hello, 4);
+            packet_size = make_icmp_packet(packet_buffer, packet, channel, trans_id, 0, hello, hello_len);
             if (channel->sendto_poll(packet, packet_size, 0) == -1) {
                 throw std::runtime_error("Cannot send 'Hello' packet");
             }
@@ -140,6 +365,15 @@ void Sender::com_init() {
             if (memcmp(recv_data_begin, hello_resp, 4) == 0) {
                 // We have received an echo request, we can use the two-way mode
                 log_monitor("ESTAB: Received a 'Hello Back' packet from the other side");
+
+                // The receiver states the version it is going to use; the ones that don't only support version 1
+                // (versions 2 and 3 are not used anymore, see PROTO_VERSION)
+                if (recv_data_len > 4 && recv_data_begin[4] >= PROTO_VERSION_SALTED) {
+                    version = std::min<uint8_t>(version, recv_data_begin[4]);
+                } else {
+                    version = PROTO_VERSION_STREAM;
+                }
+
                 state = 3;
                 goto com_init_fsm;
             }
@@ -154,7 +388,7 @@ void Sender::com_init() {
                 throw std::runtime_error("Cannot send 'Hello Back' packet");
             }
 
-            log_info("Set mode to two-way");
+            log_info("Set mode to two-way (protocol version " << static_cast<int>(version) << ")");
             mode = TWO_WAY;
             return;
         case 99:
@@ -165,12 +399,21 @@ void Sender::com_init() {
 }
 
 
-void Sender::com_send_fileinfo(const string &file_name, std::streamsize file_len, const secure_string &password) {
+void Sender::com_send_fileinfo(const string &file_name, std::streamsize file_len, const secure_string &password,
+                               uint64_t manifest_len, const uint8_t *identity, bool streaming) {
     log_info("Sending file information");
 
+    // Version 1: [encrypted stream length][file name]
+    // Version 2: [file length][chunk size][file name]
+    // Version 2, a batch: [batch stream length][chunk size | PROTO_FILE_INFO_BATCH][manifest length][batch name]
+    // Version 2, resumable: [...][identity][file name], PROTO_FILE_INFO_RESUMABLE in the chunk size
+    // Version 2, streaming: [zero][chunk size | PROTO_FILE_INFO_STREAMING][file name]
+    size_t header_len = sizeof(uint64_t) + (version == PROTO_VERSION_STREAM ? 0 : sizeof(uint16_t))
+                        + (manifest_len > 0 ? sizeof(uint64_t) : 0) + (identity != nullptr ? PROTO_IDENTITY_LEN : 0);
+
     // Check if we have enough space to send the data
-    auto len = sizeof(uint64_t) + file_name.size();
-    auto req_packet_len = Crypto::encrypted_len(len);
+    auto len = header_len + file_name.size();
+    auto req_packet_len = std::max(Crypto::encrypted_len(len), ChunkCrypto::encrypted_len(len));
     if (req_packet_len > data_len) {
         throw std::runtime_error("Cannot transmit file information: packet too large");
     }
@@ -178,17 +421,42 @@ void Sender::com_send_fileinfo(const string &file_name, std::streamsize file_len
     // Encryption input buffer
     unsigned char input_buf[len];
 
-    // Put encrypted data size (big endian) to the buffer
-    uint64_t file_size = htobe64(Crypto::encrypted_len(file_len));
-    memcpy(input_buf, &file_size, sizeof(uint64_t));
+    if (version == PROTO_VERSION_STREAM) {
+        // Put encrypted data size (big endian) to the buffer
+        uint64_t file_size = htobe64(Crypto::encrypted_len(file_len));
+        memcpy(input_buf, &file_size, sizeof(uint64_t));
+    } else {
+        uint64_t file_size = htobe64(file_len);
+        uint16_t chunk_size_be = htobe16(chunk_size() | (manifest_len > 0 ? PROTO_FILE_INFO_BATCH : 0)
+                                         | (identity != nullptr ? PROTO_FILE_INFO_RESUMABLE : 0)
+                                         | (streaming ? PROTO_FILE_INFO_STREAMING : 0));
+        memcpy(input_buf, &file_size, sizeof(uint64_t));
+        memcpy(input_buf + sizeof(uint64_t), &chunk_size_be, sizeof(uint16_t));
+        auto dest = input_buf + sizeof(uint64_t) + sizeof(uint16_t);
+
+        if (manifest_len > 0) {
+            uint64_t manifest_len_be = htobe64(manifest_len);
+            memcpy(dest, &manifest_len_be, sizeof(uint64_t));
+            dest += sizeof(uint64_t);
+        }
+
+        if (identity != nullptr) {
+            memcpy(dest, identity, PROTO_IDENTITY_LEN);
+        }
+    }
 
     // Put file name to the buffer
-    memcpy(input_buf + sizeof(uint64_t), file_name.c_str(), file_name.size());
+    memcpy(input_buf + header_len, file_name.c_str(), file_name.size());
 
-    // Encrypt data
-    auto crypto = Crypto(password, trans_id);
-    auto encrypted_len =
-            crypto.encrypt(reinterpret_cast<unsigned char *>(data_buffer), input_buf, len, true);
+    // Encrypt data (in version 4, as the chunk with index 0 under the file information key)
+    size_t encrypted_len;
+    if (version == PROTO_VERSION_STREAM) {
+        auto crypto = Crypto(password, trans_id);
+        encrypted_len = crypto.encrypt(reinterpret_cast<unsigned char *>(data_buffer), input_buf, len, true);
+    } else {
+        auto crypto = ChunkCrypto(password, transfer_salt, KeyPurpose::FILE_INFO);
+        encrypted_len = crypto.encrypt(0, reinterpret_cast<unsigned char *>(data_buffer), input_buf, len);
+    }
 
     // Make packet
     uint8_t *res_packet;
@@ -206,138 +474,466 @@ void Sender::com_send_fileinfo(const string &file_name, std::streamsize file_len
     // in two-way mode, signalise failure with an exception
 }
 
-void Sender::com_send_data(istream &stream, const secure_string &password, std::vector<uint16_t> *seq_whitelist) {
+bool Sender::com_receive_resume(std::vector<uint64_t> &indices) {
+    uint8_t *recv_data_begin;
+    uint16_t recv_data_len;
+
+    log_verbose("Waiting for the receiver to resume the transfer");
+    if (!com_receive_control(recv_data_begin, recv_data_len, S_RESUME_TIMEOUT_MS)) {
+        log_verbose("No answer received, sending everything");
+        return false;
+    }
+
+    if (recv_data_begin[0] == PROTO_REQUEST_RESEND_RANGES) {
+        if (!com_receive_resend_ranges(recv_data_begin, recv_data_len, indices)) {
+            log_warn("Invalid protocol message received, sending everything");
+            indices.clear();
+            return false;
+        }
+
+        return true;
+    } else if (recv_data_begin[0] == PROTO_ERROR) {
+        throw std::runtime_error("The receiver refused the file: " + string(reinterpret_cast<char *>(
+                recv_data_begin + 1), recv_data_len - 1));
+    } else if (recv_data_begin[0] == PROTO_INVALID_KEY) {
+        throw std::runtime_error("The receiver cannot decrypt the data (invalid password)");
+    }
+
+    return false;
+}
+
+void Sender::com_join_paths(const secure_string &password) {
+    if (paths.size() < 2) {
+        return;
+    }
+
+    // 'Join': [magic][path number][the source address of the path encrypted as the chunk with the index of the path
+    // number under the join key]; the receiver only accepts it from that address
+    char join_magic[] = PROTO_JOIN;
+    auto crypto = ChunkCrypto(password, transfer_salt, KeyPurpose::JOIN);
+    std::vector<bool> joined(paths.size(), false);
+    joined[0] = true;
+
+    for (unsigned int attempt = 0; attempt < S_JOIN_ATTEMPTS; attempt++) {
+        for (size_t i = 1; i < paths.size(); i++) {
+            if (joined[i]) {
+                continue;
+            }
+
+            auto number = static_cast<uint8_t>(i);
+            auto path_channel = paths[i]->channel.get();
+            const uint8_t *source;
+            auto source_len = addr_bytes(&path_channel->src_addr.sock, source);
+
+            memcpy(data_buffer, join_magic, sizeof(join_magic));
+            data_buffer[sizeof(join_magic)] = static_cast<char>(number);
+            auto encrypted_len = crypto.encrypt(number, reinterpret_cast<unsigned char *>(data_buffer)
+                                                        + sizeof(join_magic) + 1, source, source_len);
+
+            uint8_t *res_packet;
+            uint16_t packet_size = make_icmp_packet(packet_buffer, res_packet, path_channel, trans_id, 0, data_buffer,
+                                                    sizeof(join_magic) + 1 + encrypted_len);
+            if (path_channel->sendto_poll(res_packet, packet_size, 0) == -1) {
+                log_verbose("Cannot send 'Join' over path " << paths[i]->name());
+            }
+        }
+
+        // The answers come over the primary path
+        uint8_t *recv_data_begin;
+        uint16_t recv_data_len;
+        auto deadline = now_us() + S_JOIN_TIMEOUT_MS * 1000ull;
+        while (std::find(joined.begin(), joined.end(), false) != joined.end()) {
+            auto now = now_us();
+            if (now >= deadline || !com_receive_control(recv_data_begin, recv_data_len,
+                                                        std::max<unsigned int>((deadline - now) / 1000, 1))) {
+                break;
+            }
+
+            if (recv_data_begin[0] == PROTO_JOINED && recv_data_len > 1 && recv_data_begin[1] < paths.size()) {
+                log_verbose("Path " << paths[recv_data_begin[1]]->name() << " joined");
+                joined[recv_data_begin[1]] = true;
+            } else if (recv_data_begin[0] == PROTO_ERROR) {
+                throw std::runtime_error("The receiver refused the file: " + string(reinterpret_cast<char *>(
+                        recv_data_begin + 1), recv_data_len - 1));
+            } else if (recv_data_begin[0] == PROTO_INVALID_KEY) {
+                throw std::runtime_error("The receiver cannot decrypt the data (invalid password)");
+            }
+        }
+
+        if (std::find(joined.begin(), joined.end(), false) == joined.end()) {
+            break;
+        }
+    }
+
+    // Keep the order of the joined paths, their numbers are not used anymore
+    size_t kept = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (joined[i]) {
+            paths[kept++] = std::move(paths[i]);
+        } else {
+            log_warn("The receiver has not accepted path " << paths[i]->name() << ", it will not be used");
+        }
+    }
+
+    paths.resize(kept);
+    if (paths.size() > 1) {
+        log_info("Sending over " << paths.size() << " paths");
+    }
+}
+
+void Sender::com_send_data(const PipelineInput &input, const secure_string &password,
+                           std::vector<uint64_t> *resend_indices, bool resume) {
     log_info("Sending data");
     // Determine maximum chunk size
-    auto max_chunk_size = Crypto::max_plain_len_to_fit(data_len - sizeof(uint64_t));
+    auto max_chunk_size = chunk_size();
 
-    // Create crypto for encryption (let salt be PID + 1)
-    auto crypto = Crypto(password, trans_id + 1);
-
-    unsigned char input_buf[max_chunk_size];
     uint16_t seq = 2;
-    uint64_t pos = 0;
+    uint64_t index, pos = 0;
+    uint64_t next_index = 0;
+    uint64_t compressed_count = 0;
 
     // We've previously set the stream to throw when failbit is set
     // We don't want that now
-    stream.exceptions(std::iostream::badbit);
+    if (input.stream != nullptr) {
+        input.stream->exceptions(std::iostream::badbit);
+    }
 
-    std::vector<uint16_t>::iterator it;
-    if (seq_whitelist != nullptr) {
-        std::sort(seq_whitelist->begin(), seq_whitelist->end());
-        it = seq_whitelist->begin();
+    // The chunks missing from a resumed transfer haven't been lost, they're sent at the full rate
+    for (const auto &path: paths) {
+        path->rate->set_resending(resend_indices != nullptr && !resume);
+        path->chunks_sent = 0;
     }
 
-#if S_WAIT_FOR_DATA_REPLIES == 1
-    RecvResult received;
-    ICMPEchoHeader recv_header{};
-    uint8_t *recv_data_begin;
-    uint16_t recv_data_len;
-#endif
+    std::vector<uint64_t>::iterator it;
+    if (resend_indices != nullptr) {
+        std::sort(resend_indices->begin(), resend_indices->end());
+        it = resend_indices->begin();
+    }
 
-    while (!stream.eof()) {
-        // Read from stream
-        stream.read(reinterpret_cast<char *>(input_buf), static_cast<std::streamsize>(max_chunk_size));
-        auto read = stream.gcount();
-        // Determine whether we've read the last chunk
-        auto is_last = stream.eof();
-        // Encrypt data
-        auto encrypted_len = crypto.encrypt(reinterpret_cast<unsigned char *>(data_buffer + sizeof(uint64_t)),
-                                            input_buf, read, is_last);
-
-        // If we're resending data, check whether we actually want to do it
-        if (seq_whitelist != nullptr) {
-            if (it == seq_whitelist->end()) {
-                break;
-            }
+    // Create crypto for encryption (let salt be PID + 1); when resending, reuse the contexts
+    std::vector<ChunkEncryptor> encryptors;
+    std::vector<uint64_t> indices;
 
-            if (*it != seq) {
-                seq++;
-                pos += encrypted_len;
-                continue;
-            }
-            it++;
+    if (version == PROTO_VERSION_STREAM) {
+        if (stream_crypto == nullptr) {
+            stream_crypto = new Crypto(password, trans_id + 1);
+        } else {
+            stream_crypto->reset();
         }
 
-        // Put encrypted data position into the packet
-        uint64_t pos_be = htobe64(pos);
-        memcpy(data_buffer, &pos_be, sizeof(uint64_t));
-        pos += encrypted_len;
-        // Make packet
-        uint8_t *res_packet;
-        uint16_t packet_size = make_icmp_packet(packet_buffer, res_packet, channel, trans_id + 1, seq++, data_buffer,
-                                                encrypted_len + sizeof(uint64_t));
+        // CBC chains the chunks, so they must be encrypted in order by a single worker
+        encryptors.emplace_back([crypto = stream_crypto](unsigned char *dest, const unsigned char *plain,
+                                                         size_t plain_len, uint64_t, bool is_last, bool &) {
+            return crypto->encrypt(dest, plain, plain_len, is_last);
+        });
+    } else {
+        // The chunks are independent, each worker has its own context
+        auto workers = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, S_ENCRYPTION_WORKERS);
+        while (chunk_cryptos.size() < workers) {
+            chunk_cryptos.push_back(std::make_unique<ChunkCrypto>(password, transfer_salt, KeyPurpose::DATA));
+        }
 
-        // Send packet
-        if (channel->sendto_poll(res_packet, packet_size, 0) == -1) {
-            throw std::runtime_error("Cannot send file data chunk");
+        while (compress && chunk_compressors.size() < workers) {
+            chunk_compressors.push_back(std::make_unique<ChunkCompressor>(max_chunk_size));
         }
 
-        log_monitor("DATA: Sent chunk #" << (seq - 2) << " (encrypted data length: " << encrypted_len << ")");
+        for (size_t i = 0; i < workers; i++) {
+            auto compressor = compress ? chunk_compressors[i].get() : nullptr;
+            encryptors.emplace_back([crypto = chunk_cryptos[i].get(), compressor](
+                    unsigned char *dest, const unsigned char *plain, size_t plain_len, uint64_t index, bool,
+                    bool &compressed) {
+                // The flag is a part of the index so that it's authenticated
+                auto compressed_len = compressor != nullptr ? compressor->compress(plain, plain_len) : 0;
+                if (compressed_len > 0) {
+                    compressed = true;
+                    return crypto->encrypt(index | COMPRESSION_FLAG, dest, compressor->data(), compressed_len);
+                }
+
+                return crypto->encrypt(index, dest, plain, plain_len);
+            });
+        }
 
-        if (seq_whitelist == nullptr) {
-#if S_DELAY_AFTER_SENT_CHUNKS > 0
-            if (seq % S_DELAY_AFTER_SENT_CHUNKS == 0) {
-                usleep(S_DELAY_US);
-            }
-#endif
+        // Only read the chunks that should be resent
+        if (resend_indices != nullptr) {
+            indices = *resend_indices;
+        }
+    }
+
+    // Parity chunks are only sent in the initial pass; the resent chunks are requested explicitly
+    std::unique_ptr<FecEncoder> fec;
+    if (resend_indices == nullptr && fec_parity_count > 0) {
+        if (version == PROTO_VERSION_STREAM) {
+            log_warn("Forward error correction requires protocol version 2, disabling");
         } else {
-#if S_RESEND_DELAY_AFTER_SENT_CHUNKS > 0
-            if (seq % S_RESEND_DELAY_AFTER_SENT_CHUNKS == 0) {
-                usleep(S_RESEND_DELAY_US);
-            }
+            fec = std::make_unique<FecEncoder>(fec_group_size, fec_parity_count, max_chunk_size);
+            fec_crypto = std::make_unique<ChunkCrypto>(password, transfer_salt, KeyPurpose::DATA);
+        }
+    }
+
+    // The chunks in flight hold their pipeline buffers, so the pipeline must have enough of them for full windows
+    uint32_t pipeline_depth = S_PIPELINE_DEPTH;
+#if S_WINDOW_MODE == 1
+    for (const auto &path: paths) {
+        if (path->use_window) {
+            pipeline_depth += S_WINDOW_MAX;
+        }
+    }
 #endif
+
+    // Packets are sent in batches (one for each path); the headers are prepared separately (in the window slots
+    // or in the path's batch_buffer) and the data are sent directly from the pipeline buffers
+    std::vector<SendBatch> batches(paths.size(), SendBatch(BATCH_SIZE));
+    // The chunks sent blindly in the batches, released after they're sent
+    std::vector<std::vector<PipelineChunk *>> batch_chunks(paths.size());
+
+    {
+        // The stream is read and encrypted in background threads; the chunks are prepended with their position
+        SendPipeline pipeline(input, max_chunk_size, sizeof(uint64_t), encryptors, indices, pipeline_depth);
+        PipelineChunk *chunk;
+
+        auto flush_blind = [&](size_t p) {
+            flush_batch(*paths[p], batches[p]);
+            for (auto sent_chunk: batch_chunks[p]) {
+                pipeline.release(sent_chunk);
+            }
+            batch_chunks[p].clear();
+        };
+
+        auto flush_all = [&]() {
+            for (size_t p = 0; p < paths.size(); p++) {
+                flush_blind(p);
+            }
+        };
+
+        // The windows are destroyed before the pipeline (they release the chunks in flight)
+        std::vector<std::unique_ptr<SendWindow>> windows;
+#if S_WINDOW_MODE == 1
+        for (size_t p = 0; p < paths.size(); p++) {
+            windows.push_back(std::make_unique<SendWindow>(S_WINDOW_MAX, [&pipeline](PipelineChunk *acked_chunk) {
+                pipeline.release(acked_chunk);
+            }));
         }
+#endif
 
+        auto any_window = [&]() {
+            return std::any_of(paths.begin(), paths.end(), [](const std::unique_ptr<SendPath> &path) {
+                return path->use_window;
+            });
+        };
+
+        // Picks the path that may send a chunk the soonest (with a free place in its window); waits for it
+        auto next_path = [&]() {
+            while (true) {
+                auto now = now_us();
+                size_t best = 0;
+                int64_t best_wait_us = -1;
+                for (size_t p = 0; p < paths.size(); p++) {
+                    if (paths[p]->use_window && !windows[p]->can_send()) {
+                        continue;
+                    }
+
+                    auto wait_us = paths[p]->rate->time_to_send(now);
+                    if (best_wait_us < 0 || wait_us < best_wait_us) {
+                        best = p;
+                        best_wait_us = wait_us;
+                    }
+                }
+
+                if (best_wait_us == 0) {
+                    return best;
+                }
+
+                // Send the batched chunks before waiting for a free place in a window and for the pacing
+                flush_all();
+                if (any_window()) {
+                    service_windows(windows, best_wait_us);
+                } else {
+                    usleep(best_wait_us);
+                }
+            }
+        };
+
+        // An empty list of chunks to resend means nothing (the pipeline would read the whole stream)
+        bool nothing_to_send = resend_indices != nullptr && resend_indices->empty();
+        while (!nothing_to_send && (chunk = pipeline.next()) != nullptr) {
+            auto encrypted_len = chunk->encrypted_len;
+
+            if (version != PROTO_VERSION_STREAM) {
+                // The position of the plain data in the file
+                index = chunk->index;
+                seq = data_seq(index);
+                pos = index * max_chunk_size | (chunk->compressed ? COMPRESSION_FLAG : 0);
+                compressed_count += chunk->compressed;
+                metric_add(chunks_compressed, chunk->compressed);
+            } else if (resend_indices != nullptr) {
+                // If we're resending data, check whether we actually want to do it
+                if (it == resend_indices->end()) {
+                    pipeline.release(chunk);
+                    break;
+                }
+
+                if (*it != static_cast<uint64_t>(seq - 2)) {
+                    seq++;
+                    pos += encrypted_len;
+                    pipeline.release(chunk);
+                    continue;
+                }
+                it++;
+            }
 
-#if S_WAIT_FOR_DATA_REPLIES == 1
-        while (true) {
-            received = channel->recvfrom(packet_buffer, packet_len, 0);
-            if (!received.success()) {
-                break;
+            if (version == PROTO_VERSION_STREAM) {
+                index = seq - 2;
             }
-            if (!received.is_channel_address) {
-                continue;
+            next_index = std::max(next_index, index + 1);
+
+            if (fec) {
+                // The chunks come in order in the initial pass; a new group means the previous one is complete
+                if (index > 0 && index % fec_group_size == 0) {
+                    auto group = index / fec_group_size - 1;
+                    auto p = group % paths.size();
+                    com_send_parity(*fec, group, *paths[p], batches[p]);
+                }
+
+                fec->add(index % fec_group_size, chunk->plain, chunk->plain_len);
             }
-            if (!parse_icmp_echo_packet(packet_buffer, received.size, channel->dst_addr.family, recv_header,
-                                        recv_data_begin, recv_data_len)) {
+
+            // Put data position into the packet
+            uint64_t pos_be = htobe64(pos);
+            memcpy(chunk->data, &pos_be, sizeof(uint64_t));
+            pos += encrypted_len;
+
+            auto p = next_path();
+            auto &path = *paths[p];
+            auto &batch = batches[p];
+            path.chunks_sent++;
+
+#if S_WINDOW_MODE == 1
+            if (path.use_window) {
+                // The window slot holds the headers and the chunk until it's acknowledged
+                auto &window = *windows[p];
+                auto slot = window.acquire(index, seq);
+                slot->chunk = chunk;
+                slot->data = chunk->data;
+                slot->data_len = encrypted_len + sizeof(uint64_t);
+                slot->header_len = make_echo_header(path.channel->header_template, slot->header, trans_id + 1,
+                                                    seq++, slot->data, slot->data_len);
+                batch.add(slot->header, slot->header_len, slot->data, slot->data_len);
+
+                auto now = now_us();
+                window.sent(slot, now);
+                path.rate->on_sent(now, slot->header_len + slot->data_len);
+                metric_add(chunks_sent, 1);
+                metric_add(bytes_sent, slot->header_len + slot->data_len);
+                log_monitor("DATA: Sent chunk #" << index << " (encrypted data length: " << encrypted_len << ")");
+
+                if (batch.full()) {
+                    flush_blind(p);
+                    // Process the replies that have already arrived
+                    service_window(path, window);
+                }
                 continue;
             }
-            if (recv_header.id != trans_id || (recv_header.type != ICMP_ECHOREPLY && recv_header.type != ICMP6_ECHO_REPLY)) {
-                continue;
+#endif
+
+            // Make the headers; the chunk is held until the batch is sent
+            auto header = path.batch_buffer.get() + batch.size() * sizeof(EchoHeaderTemplate::data);
+            auto data_len = static_cast<uint16_t>(encrypted_len + sizeof(uint64_t));
+            auto header_len = make_echo_header(path.channel->header_template, header, trans_id + 1, seq++,
+                                               chunk->data, data_len);
+            batch.add(header, header_len, chunk->data, data_len);
+            batch_chunks[p].push_back(chunk);
+
+            path.rate->on_sent(now_us(), header_len + data_len);
+            metric_add(chunks_sent, 1);
+            metric_add(bytes_sent, header_len + data_len);
+            log_monitor("DATA: Sent chunk #" << index << " (encrypted data length: " << encrypted_len << ")");
+
+            if (batch.full()) {
+                flush_blind(p);
             }
-            if (recv_header.seq != seq - 1) {
-                // It would be good to keep track of received non-matching seqs here so that we don't drop anything
-                continue;
+        }
+
+        if (fec && next_index > 0) {
+            auto group = (next_index - 1) / fec_group_size;
+            auto p = group % paths.size();
+            com_send_parity(*fec, group, *paths[p], batches[p]);
+        }
+
+        flush_all();
+
+#if S_WINDOW_MODE == 1
+        // Wait for the chunks in flight to be acknowledged
+        auto in_flight = [&]() {
+            for (size_t p = 0; p < paths.size(); p++) {
+                if (paths[p]->use_window && windows[p]->in_flight() > 0) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        while (in_flight()) {
+            service_windows(windows, -1);
+        }
+
+        for (size_t p = 0; p < paths.size(); p++) {
+            if (paths[p]->use_window) {
+                log_verbose("All chunks acknowledged (" << windows[p]->expired << " retransmissions, smoothed RTT "
+                                                        << windows[p]->srtt() << " us, rate " << paths[p]->rate->rate()
+                                                        << " B/s" << (paths.size() > 1 ? ", path " + paths[p]->name()
+                                                                                       : "") << ")");
             }
-            break;
         }
-        log_monitor("DATA: Confirmed chunk #" << (seq - 2));
 #endif
     }
 
-#if S_WAIT_FOR_DATA_REPLIES == 0
-    // Clear receive queue
-    RecvResult r;
-    channel->set_receive_timeout(100);
-    do {
-        r = channel->recvfrom(packet_buffer, packet_len, 0);
-    } while (r.success() && r.size > 0);
-#endif
+    if (paths.size() > 1) {
+        for (const auto &path: paths) {
+            log_verbose(path->chunks_sent << " chunks sent over path " << path->name());
+        }
+    }
+
+    if (compress) {
+        log_verbose(compressed_count << " chunks sent compressed");
+    }
+
+    if (!paths[0]->use_window) {
+        // Clear receive queue
+        RecvResult r;
+        channel->set_receive_timeout(100);
+        do {
+            r = channel->recvfrom(packet_buffer, packet_len, 0);
+        } while (r.success() && r.size > 0);
+    }
 
-    if (max_seq == 0) {
-        max_seq = seq - 1;
+    if (resend_indices == nullptr) {
+        chunk_count = next_index;
     }
 
-    // Make end packet (seq = UINT16 maximum, data: last transferred seq)
-    uint16_t last_seq = htobe16(max_seq);
-    memcpy(data_buffer, &last_seq, sizeof(uint16_t));
+    // Make end packet (seq = UINT16 maximum, data: last transferred seq in version 1, number of chunks in version 2)
+    uint16_t end_data_len;
+    if (version == PROTO_VERSION_STREAM) {
+        uint16_t last_seq = htobe16(static_cast<uint16_t>(chunk_count + 1));
+        memcpy(data_buffer, &last_seq, sizeof(uint16_t));
+        end_data_len = sizeof(uint16_t);
+    } else {
+        uint64_t count_be = htobe64(chunk_count);
+        memcpy(data_buffer, &count_be, sizeof(uint64_t));
+        end_data_len = sizeof(uint64_t);
+    }
 
     uint8_t *res_packet;
     uint16_t packet_size = make_icmp_packet(packet_buffer, res_packet, channel, trans_id + 1, UINT16_MAX,
-                                            data_buffer,
-                                            sizeof(uint16_t));
-    usleep(S_CONFIRMATION_DELAY_US);
+                                            data_buffer, end_data_len);
+    bool any_blind = std::any_of(paths.begin(), paths.end(), [](const std::unique_ptr<SendPath> &path) {
+        return !path->use_window;
+    });
+
+    if (any_blind) {
+        // When sending blindly, give the receiver some time to process the data
+        usleep(S_CONFIRMATION_DELAY_US);
+    }
+
     // Send packet
     log_verbose("Sending confirmation packet");
     if (channel->sendto_poll(res_packet, packet_size, 0) == -1) {
@@ -346,27 +942,389 @@ void Sender::com_send_data(istream &stream, const secure_string &password, std::
 
 
     if (mode == TWO_WAY) {
-        com_receive_result(stream, password);
+        com_receive_result(input, password);
     } else {
         log_info("File sent");
     }
 }
 
-void Sender::com_receive_result(std::istream &stream, const secure_string &password) {
-    RecvResult received;
+void Sender::service_window(SendPath &path, SendWindow &window) {
+    // Process the replies first so that the chunks acknowledged while we were busy are not retransmitted
+    receive_replies(path, window);
+    auto now = now_us();
+
+    // Retransmit the chunks the timers of which have expired
+    SendBatch batch(BATCH_SIZE);
+    WindowSlot *slot;
+    while ((slot = window.pop_expired(now)) != nullptr) {
+        path.rate->on_loss(now);
+
+        if (window.acked == 0 && window.expired >= S_WINDOW_NO_REPLY_LIMIT) {
+            log_warn("No Echo Reply received from the receiver, switching to blind sending"
+                             << (paths.size() > 1 ? " on path " + path.name() : ""));
+            path.use_window = false;
+
+            // The cached maximum packet size may not be valid anymore
+            if (path.mps_cached) {
+                start_mps_probe(path);
+            }
+            return;
+        }
+
+        if (++path.consecutive_losses == S_MPS_REPROBE_LOSSES) {
+            start_mps_probe(path);
+        }
+
+        if (slot->transmissions >= S_MAX_TRANSMISSIONS) {
+            // Let the resend protocol handle this chunk
+            log_monitor("DATA: Giving up on chunk #" << slot->index);
+            window.release(slot);
+            continue;
+        }
+
+        batch.add(slot->header, slot->header_len, slot->data, slot->data_len);
+        window.sent(slot, now);
+        path.rate->on_sent(now, slot->header_len + slot->data_len);
+        metric_add(retransmissions, 1);
+        metric_add(chunks_sent, 1);
+        metric_add(bytes_sent, slot->header_len + slot->data_len);
+        log_monitor("DATA: Retransmitted chunk #" << slot->index << " (cwnd " << window.cwnd() << ")");
+
+        if (batch.full()) {
+            flush_batch(path, batch);
+        }
+    }
+
+    flush_batch(path, batch);
+}
+
+void Sender::service_windows(std::vector<std::unique_ptr<SendWindow>> &windows, int64_t max_wait_us) {
+    std::vector<pollfd> poll_opts;
+    std::vector<size_t> polled;
+    auto wait_us = max_wait_us;
+
+    for (size_t p = 0; p < paths.size(); p++) {
+        if (!paths[p]->use_window) {
+            continue;
+        }
+
+        service_window(*paths[p], *windows[p]);
+        if (!paths[p]->use_window) {
+            continue;
+        }
+
+        // Wait for an Echo Reply until the nearest retransmission timer expires
+        auto deadline_us = windows[p]->time_to_deadline(now_us());
+        if (deadline_us >= 0) {
+            wait_us = wait_us < 0 ? deadline_us : std::min(wait_us, deadline_us);
+        }
+
+        poll_opts.push_back({.fd = paths[p]->channel->socket_fd, .events = POLLIN, .revents = 0});
+        polled.push_back(p);
+    }
+
+    // Nothing to wait for when no chunk is in flight (the replies may have acknowledged all of them)
+    if (poll_opts.empty() || wait_us <= 0) {
+        return;
+    }
+
+    timespec timeout{.tv_sec = wait_us / 1000000, .tv_nsec = (wait_us % 1000000) * 1000};
+    int res = ppoll(poll_opts.data(), poll_opts.size(), &timeout, nullptr);
+    if (res == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+
+        THROW_ERRNO();
+    }
+
+    for (size_t i = 0; res > 0 && i < poll_opts.size(); i++) {
+        if (poll_opts[i].revents & POLLIN) {
+            receive_replies(*paths[polled[i]], *windows[polled[i]]);
+        }
+    }
+}
+
+void Sender::start_mps_probe(SendPath &path) {
+    if (path.mps_probe.valid()) {
+        return;
+    }
+
+    log_verbose("Too many chunks lost, probing the maximum packet size again (" << path.interface << ")");
+    path.mps_probe = std::async(std::launch::async, [dst = path.channel->dst_addr, src = path.channel->src_addr,
+            if_name = path.interface]() mutable {
+        Channel mps_channel(&dst.sock, &src.sock, if_name, MPS_RECV_TIMEOUT_MS);
+        return find_max_packet_size(mps_channel, STARTING_MPS);
+    });
+}
+
+void Sender::finish_mps_probe() {
+    MPSCache mps_cache;
+    for (const auto &path: paths) {
+        if (!path->mps_probe.valid()) {
+            continue;
+        }
+
+        try {
+            auto mps = path->mps_probe.get();
+            if (mps.packet_size < path->packet_len) {
+                log_warn("The maximum packet size of path " << path->name() << " has dropped to " << mps.packet_size
+                                                             << " bytes, it will be used in the next transmissions");
+            }
+
+            mps_cache.store(&path->channel->src_addr.sock, &path->channel->dst_addr.sock, mps);
+        } catch (std::runtime_error &e) {
+            log_verbose("Cannot find the maximum packet size: " << e.what());
+            mps_cache.remove(&path->channel->src_addr.sock, &path->channel->dst_addr.sock);
+        }
+    }
+}
+
+void Sender::receive_replies(SendPath &path, SendWindow &window) {
     ICMPEchoHeader recv_header{};
     uint8_t *recv_data_begin;
     uint16_t recv_data_len;
 
+    // Process all Echo Replies that are waiting in the receive buffer
+    while (true) {
+        if (path.channel->recv_batch(*recv_batch, MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else {
+                THROW_ERRNO();
+            }
+        }
+
+        auto now = now_us();
+        for (unsigned int i = 0; i < recv_batch->count; i++) {
+            const RecvResult &received = recv_batch->results[i];
+            if (!received.is_channel_address) {
+                continue;
+            }
+
+            if (!parse_icmp_echo_packet(recv_batch->buffer(i), received.size, path.channel->dst_addr.family,
+                                        recv_header, recv_data_begin, recv_data_len)) {
+                continue;
+            }
+
+            if (recv_header.id != static_cast<uint16_t>(trans_id + 1)
+                || (recv_header.type != ICMP_ECHOREPLY && recv_header.type != ICMP6_ECHO_REPLY)) {
+                continue;
+            }
+
+            if (recv_header.seq < 2 || recv_header.seq == UINT16_MAX) {
+                continue;
+            }
+
+            // In version 2, the seqs wrap around, so the chunk is identified by its position echoed in the reply
+            uint64_t index;
+            if (version == PROTO_VERSION_STREAM) {
+                index = recv_header.seq - 2;
+            } else if (recv_data_len >= sizeof(uint64_t)) {
+                auto pos = be64toh(*reinterpret_cast<uint64_t *>(recv_data_begin));
+                if (pos & FEC_FLAG) {
+                    // Parity chunks are not kept in the window
+                    continue;
+                }
+
+                index = (pos & ~COMPRESSION_FLAG) / chunk_size();
+            } else {
+                continue;
+            }
+
+            if (window.ack(index, now)) {
+                path.consecutive_losses = 0;
+                metric_add(acks, 1);
+                path.rate->on_ack(now, window.srtt(), window.min_rtt());
+                log_monitor("DATA: Confirmed chunk #" << index << " (cwnd " << window.cwnd()
+                                                      << ", RTO " << window.rto() << " us)");
+            }
+        }
+
+        if (recv_batch->count < recv_batch->messages.size()) {
+            // The receive buffer has been emptied
+            return;
+        }
+    }
+}
+
+void Sender::com_send_parity(FecEncoder &fec, uint64_t group, SendPath &path, SendBatch &batch) {
+    // The batch references the chunk buffers, send it before reusing packet_buffer
+    flush_batch(path, batch);
+
+    for (uint8_t j = 0; j < fec.parity_count(); j++) {
+        auto wait_us = path.rate->time_to_send(now_us());
+        if (wait_us > 0) {
+            usleep(wait_us);
+        }
+
+        // The position field identifies the parity chunk and serves as its index for encryption
+        uint64_t pos = fec_make_pos(fec.group_size(), j, group);
+        uint64_t pos_be = htobe64(pos);
+        memcpy(data_buffer, &pos_be, sizeof(uint64_t));
+        auto encrypted_len = fec_crypto->encrypt(pos, reinterpret_cast<unsigned char *>(data_buffer) + sizeof(uint64_t),
+                                                 fec.parity(j), fec.chunk_len());
+
+        uint8_t *res_packet;
+        uint16_t packet_size = make_icmp_packet(packet_buffer, res_packet, path.channel.get(), trans_id + 1,
+                                                data_seq(group), data_buffer, encrypted_len + sizeof(uint64_t));
+        if (path.channel->sendto_poll(res_packet, packet_size, 0) == -1) {
+            throw std::runtime_error("Cannot send parity chunk");
+        }
+
+        path.rate->on_sent(now_us(), packet_size);
+        metric_add(parity_sent, 1);
+        metric_add(bytes_sent, packet_size);
+        log_monitor("DATA: Sent parity chunk " << static_cast<int>(j) << " of group " << group);
+    }
+
+    fec.reset();
+}
+
+void Sender::flush_batch(const SendPath &path, SendBatch &batch) {
+    if (batch.size() == 0) {
+        return;
+    }
+
+    if (path.channel->send_batch(batch, 0) == -1) {
+        throw std::runtime_error("Cannot send file data chunk");
+    }
+
+    if (batch.queue_full > 0) {
+        path.rate->on_queue_full(now_us(), batch.queue_full);
+    }
+
+    batch.clear();
+}
+
+void Sender::com_receive_result(const PipelineInput &input, const secure_string &password) {
+    uint8_t *recv_data_begin;
+    uint16_t recv_data_len;
+
     log_verbose("Waiting for result");
-    channel->set_receive_timeout(S_RECV_TIMEOUT_MS);
+    if (!com_receive_control(recv_data_begin, recv_data_len, S_RECV_TIMEOUT_MS)) {
+        log_info("No status confirmation received, file may not be transferred completely");
+        return;
+    }
+
+    // A late answer to the 'File Information' of a resumable transfer or to a 'Join'
+    while (recv_data_begin[0] == PROTO_RESUME_NONE || recv_data_begin[0] == PROTO_JOINED) {
+        if (!com_receive_control(recv_data_begin, recv_data_len, S_RECV_TIMEOUT_MS)) {
+            log_info("No status confirmation received, file may not be transferred completely");
+            return;
+        }
+    }
+
+    std::vector<uint64_t> missing_indices;
+
+    if (recv_data_begin[0] == PROTO_OK) {
+        log_info("File sent successfully");
+        return;
+    } else if (recv_data_begin[0] == PROTO_REQUEST_RESEND) {
+        log_verbose("Resend requested");
+        if (((recv_data_len - sizeof(uint8_t)) % sizeof(uint16_t) != 0)) {
+            log_warn("Invalid protocol message received");
+            return;
+        }
+
+        for (size_t pos = sizeof(uint8_t); pos < recv_data_len; pos += sizeof(uint16_t)) {
+            uint16_t seq = *reinterpret_cast<uint16_t *>(recv_data_begin + pos);
+            seq = be16toh(seq);
+            if (seq >= 2) {
+                missing_indices.push_back(seq - 2);
+            }
+        }
+    } else if (recv_data_begin[0] == PROTO_REQUEST_RESEND_RANGES) {
+        log_verbose("Resend of ranges requested");
+        if (!com_receive_resend_ranges(recv_data_begin, recv_data_len, missing_indices)) {
+            log_warn("Invalid protocol message received");
+            return;
+        }
+    } else {
+        log_warn("Unknown protocol message received");
+        return;
+    }
+
+    if (!missing_indices.empty() && !input.seekable) {
+        throw std::runtime_error(std::to_string(missing_indices.size()) + " chunks have been lost and the data read "
+                                                                          "from a pipe cannot be sent again");
+    }
+
+    if (!missing_indices.empty()) {
+        // The receiver doesn't know which paths the chunks have been lost on
+        uint64_t total_rate = 0;
+        for (const auto &path: paths) {
+            path->rate->on_receiver_loss(missing_indices.size(), chunk_count);
+            total_rate += path->rate->rate();
+        }
+
+        metric_add(resend_requested, missing_indices.size());
+        log_verbose("Resending " << missing_indices.size() << " chunks (rate " << total_rate << " B/s)");
+        input.rewind();
+        com_send_data(input, password, &missing_indices);
+    }
+}
+
+bool Sender::com_receive_resend_ranges(uint8_t *data, uint16_t data_len, std::vector<uint64_t> &indices) {
+    // [type][part number][number of parts][encoded ranges]
+    const size_t header_len = 3 * sizeof(uint8_t);
+    if (data_len < header_len || data[2] == 0 || data[1] >= data[2]) {
+        return false;
+    }
+
+    std::vector<ChunkRange> ranges;
+    std::vector<bool> received_parts(data[2], false);
+    size_t parts_left = data[2];
+
+    while (true) {
+        if (!received_parts[data[1]]) {
+            if (!decode_ranges(data + header_len, data_len - header_len, chunk_count, ranges)) {
+                return false;
+            }
+
+            received_parts[data[1]] = true;
+            parts_left--;
+        }
+
+        if (parts_left == 0) {
+            break;
+        }
+
+        // The parts that get lost will be requested again in the next round
+        if (!com_receive_control(data, data_len, S_RESEND_PARTS_TIMEOUT_MS)) {
+            log_verbose(parts_left << " parts of the resend request not received");
+            break;
+        }
+
+        if (data[0] != PROTO_REQUEST_RESEND_RANGES || data_len < header_len
+            || data[2] != received_parts.size() || data[1] >= data[2]) {
+            log_warn("Unexpected protocol message received");
+            break;
+        }
+    }
+
+    for (const auto &range: ranges) {
+        for (uint64_t i = range.first; i < range.first + range.count; i++) {
+            indices.push_back(i);
+        }
+    }
+
+    // The parts may overlap if they come from different requests
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    return true;
+}
+
+bool Sender::com_receive_control(uint8_t *&data, uint16_t &data_len, unsigned int timeout_ms) {
+    RecvResult received;
+    ICMPEchoHeader recv_header{};
+
+    channel->set_receive_timeout(timeout_ms);
     while (true) {
         received = channel->recvfrom(packet_buffer, R_RECV_BUFFER_SIZE, 0);
         if (!received.success()) {
-            // Timeout or error, assume one-way
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                log_info("No status confirmation received, file may not be transferred completely");
-                return;
+                return false;
             } else {
                 THROW_ERRNO();
             }
@@ -380,7 +1338,7 @@ void Sender::com_receive_result(std::istream &stream, const secure_string &passw
         }
 
         if (!parse_icmp_echo_packet(reinterpret_cast<uint8_t *>(packet_buffer), received.size,
-                                    channel->dst_addr.family, recv_header, recv_data_begin, recv_data_len)) {
+                                    channel->dst_addr.family, recv_header, data, data_len)) {
             // Invalid ICMP Echo packet (either malformed or non-echo)
             log_monitor("END: Data not a valid ICMP Echo packet");
             continue;
@@ -400,48 +1358,58 @@ void Sender::com_receive_result(std::istream &stream, const secure_string &passw
             continue;
         }
 
-        break;
+        if (data_len == 0) {
+            log_monitor("END: Empty protocol message");
+            continue;
+        }
+
+        return true;
     }
+}
 
-    if (recv_data_begin[0] == PROTO_OK) {
-        log_info("File sent successfully");
-        return;
-    } else if (recv_data_begin[0] == PROTO_REQUEST_RESEND) {
-        log_verbose("Resend requested");
-        if (((recv_data_len - sizeof(uint8_t)) % sizeof(uint16_t) != 0)) {
-            log_warn("Invalid protocol message received");
-            return;
-        }
+size_t Sender::chunk_size() const {
+    if (version == PROTO_VERSION_STREAM) {
+        return Crypto::max_plain_len_to_fit(data_len - sizeof(uint64_t));
+    } else {
+        return ChunkCrypto::max_plain_len_to_fit(data_len - sizeof(uint64_t));
+    }
+}
 
-        std::vector<uint16_t> missing_seqs;
-        for (size_t pos = sizeof(uint8_t); pos < recv_data_len; pos += sizeof(uint16_t)) {
-            uint16_t seq = *reinterpret_cast<uint16_t *>(recv_data_begin + pos);
-            seq = be16toh(seq);
-            missing_seqs.push_back(seq);
-        }
+void Sender::compute_identity(const PipelineInput &input, uint8_t *identity) {
+    auto ctx = EVP_MD_CTX_new();
+    if (ctx == nullptr || EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1) {
+        EVP_MD_CTX_free(ctx);
+        throw std::runtime_error("Cannot initialise the hash function");
+    }
 
-        if (!missing_seqs.empty()) {
-            log_verbose("Resending data");
-            stream.clear();
-            stream.seekg(0, std::ios_base::beg);
-            com_send_data(stream, password, &missing_seqs);
-        }
+    if (input.stream == nullptr) {
+        EVP_DigestUpdate(ctx, input.data, input.len);
     } else {
-        log_warn("Unknown protocol message received");
-        return;
+        std::vector<char> buffer(S_BATCH_READ_BUFFER_SIZE);
+        std::streamsize read;
+        while ((read = input.stream->rdbuf()->sgetn(buffer.data(),
+                                                    static_cast<std::streamsize>(buffer.size()))) > 0) {
+            EVP_DigestUpdate(ctx, buffer.data(), static_cast<size_t>(read));
+        }
+
+        input.rewind();
+    }
+
+    unsigned int hash_len;
+    auto res = EVP_DigestFinal_ex(ctx, identity, &hash_len);
+    EVP_MD_CTX_free(ctx);
+    if (res != 1 || hash_len != PROTO_IDENTITY_LEN) {
+        throw std::runtime_error("Cannot compute the hash of the data");
     }
 }
 
-std::streamsize Sender::get_file_size(istream &stream) {
-    stream.ignore(std::numeric_limits<std::streamsize>::max());
-    auto len = stream.gcount();
-    stream.clear();
-    stream.seekg(0, std::ios_base::beg);
-    return len;
+std::string SendPath::name() const {
+    return interface + " to " + addr_to_string(&channel->dst_addr.sock);
 }
 
 Sender::~Sender() {
-    delete channel;
-    delete packet_buffer;
-    delete data_buffer;
+    delete stream_crypto;
+    delete recv_batch;
+    delete[] packet_buffer;
+    delete[] data_buffer;
 }
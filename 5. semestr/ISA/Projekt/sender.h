@@ -6,13 +6,67 @@
 
 #include <string>
 #include <istream>
+#include <future>
 #include <limits>
+#include <memory>
 #include <vector>
 
 #include "common.h"
+#include "encryption.h"
 #include "channel.h"
 #include "secure_string.h"
+#include "send_window.h"
+#include "rate_control.h"
+#include "chunk_tracker.h"
+#include "fec.h"
+#include "compression.h"
+#include "packet_utils.h"
+#include "send_pipeline.h"
 
+/**
+ * Sender settings, usually provided by the user.
+ */
+struct SenderOptions {
+    RateOptions rate; /**< The rate control settings. */
+    /** The highest protocol version to use. The receiver may only support a lower one. */
+    uint8_t protocol_version = PROTO_VERSION;
+    /** The number of chunks in a forward error correction group (K); see fec.h. */
+    uint8_t fec_group_size = 0;
+    /** The number of parity chunks sent for each group (M); zero disables forward error correction. */
+    uint8_t fec_parity_count = 0;
+    /** Makes the transfer resumable: the receiver keeps a journal and a repeated transfer only sends the missing
+     * chunks (protocol version 2). */
+    bool resumable = false;
+    /** Compresses the chunks that get smaller (protocol version 3). */
+    bool compress = false;
+    /** Stripes the chunks across all the paths to the receiver's addresses (IPv4 and IPv6, multiple interfaces);
+     * requires protocol version 2 and two-way mode. */
+    bool multipath = false;
+};
+
+/**
+ * A path to the receiver: a source interface and one of the receiver's addresses. A multipath transfer stripes
+ * the data chunks across multiple paths; each of them has its own maximum packet size, pacing and sliding window.
+ * The control messages are only exchanged over the first (primary) path.
+ */
+struct SendPath {
+    std::unique_ptr<Channel> channel; /**< Encapsulates the socket of the path. */
+    std::string interface; /**< The name of the source interface. */
+    std::unique_ptr<RateController> rate; /**< Paces the chunks sent over the path. */
+    /** A buffer for preparing the headers of a batch of packets sent blindly. */
+    std::unique_ptr<uint8_t[]> batch_buffer;
+    uint16_t packet_len = 0; /**< The maximum packet size of the path. */
+    uint16_t data_len = 0; /**< The maximum length of the data in a packet of the path. */
+    /** Signalises if chunks are sent using a sliding window (false when sending blindly). */
+    bool use_window = S_WINDOW_MODE == 1;
+    bool mps_cached = false; /**< Signalises if the maximum packet size has been taken from the MPSCache. */
+    uint32_t consecutive_losses = 0; /**< The number of chunks lost since the last acknowledgement. */
+    uint64_t chunks_sent = 0; /**< The number of data chunks sent over the path in the current pass. */
+    std::future<MPSResult> mps_probe; /**< The maximum packet size probed in the background (if started). */
+
+    /** @return A description of the path for the log messages. */
+    [[nodiscard]] std::string name() const;
+};
 
 class Sender {
 public:
@@ -21,20 +75,40 @@ public:
      * interface for this address. Discovers the maximum size of packet (MPS) that can be sent over the network to
      * the address. Initializes buffers and opens a raw socket for communication.
      *
+     * @remark In multipath mode, a path is added for each of the hostname's addresses reachable from another
+     * interface or using another address family (see InterfaceFinder::find_paths()). The chunk size is limited
+     * by the smallest maximum packet size of the paths.
+     *
      * @param [in] target_hostname The remote party hostname or IP address.
+     * @param [in] options The sender settings.
      * @throws std::runtime_error Thrown when a fatal error occurs when establishing the communication parameters.
      */
-    explicit Sender(const std::string &target_hostname);
+    explicit Sender(const std::string &target_hostname, const SenderOptions &options = {});
 
     /**
-     * Transfers the contents of an input stream to a file named @a file_name on the receiver side.
+     * Transfers the contents of a file to a file named @a file_name on the receiver side.
      *
-     * @param [in,out] stream The input stream to read transferred data from.
+     * @remark A regular file is memory-mapped and its chunks are encrypted straight from the mapping. Other files
+     * (pipes, devices) are read as streams in streaming mode: their length is only announced when they've been read
+     * and the lost chunks cannot be resent (requires protocol version 2).
+     * @param [in] path The path to the file to read transferred data from.
      * @param [in] file_name The file name to send to the receiver.
      * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
      * @throws std::runtime_error Thrown when a fatal error occurs during the transmission.
      */
-    void send(std::istream &stream, const std::string &file_name, const secure_string &password);
+    void send(const std::string &path, const std::string &file_name, const secure_string &password);
+
+    /**
+     * Transfers multiple files in one transmission (a batch, see batch_manifest.h; requires protocol version 2).
+     * The files keep their names on the receiver side; the directories are sent recursively and keep their
+     * structure.
+     *
+     * @param [in] paths The paths to the files and directories to send.
+     * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
+     * @throws std::runtime_error Thrown when a fatal error occurs during the transmission or when the receiver
+     * only supports protocol version 1.
+     */
+    void send_batch(const std::vector<std::string> &paths, const secure_string &password);
 
     /**
      * Closes the communication Channel and frees the memory allocated for the buffers.
@@ -43,19 +117,63 @@ public:
 
 private:
     TransmissionMode mode; /**< The current mode of transmission. */
-    Channel *channel; /**< Encapsulates the socket currently used for communication. */
-    std::string target_interface;  /**< The name of the interface to communicate on. */
-    uint8_t *packet_buffer; /**< A buffer for preparing packets to send. */
+    /** The paths to the receiver. The first one is the primary path (used for the control messages). */
+    std::vector<std::unique_ptr<SendPath>> paths;
+    Channel *channel; /**< Encapsulates the socket of the primary path (owned by the path). */
+    Crypto *stream_crypto = nullptr; /**< Encrypts the data stream (protocol version 1). */
+    /** Encrypt the data chunks, one for each pipeline worker (protocol version 2). */
+    std::vector<std::unique_ptr<ChunkCrypto>> chunk_cryptos;
+    std::unique_ptr<ChunkCrypto> fec_crypto; /**< Encrypts the parity chunks (protocol version 2). */
+    /** Compress the data chunks, one for each pipeline worker (protocol version 3). */
+    std::vector<std::unique_ptr<ChunkCompressor>> chunk_compressors;
+    /** A buffer for preparing packets to send and for receiving the control messages (see com_receive_control()).
+     * Its length is packet_len or R_RECV_BUFFER_SIZE, whichever is higher. */
+    uint8_t *packet_buffer;
+    RecvBatch *recv_batch; /**< Buffers for receiving Echo Replies in batches. */
     char *data_buffer; /**< A buffer for preparing data to send. */
-    uint16_t packet_len; /**< Length of packet_buffer. Dynamically decided based on the established MPS. */
-    uint16_t data_len; /**< Length of data_buffer. Dynamically decided based on the established MPS. */
+    /** The maximum packet size. Dynamically decided based on the established MPS (the highest one of the paths). */
+    uint16_t packet_len;
+    /** Length of data_buffer. Dynamically decided based on the established MPS (the lowest one of the paths). */
+    uint16_t data_len;
     uint16_t trans_id; /**< The current transaction ID. */
-    uint16_t max_seq = 0; /**< The largest chunk sequence number that has been sent. */
+    TransferSalt transfer_salt{}; /**< The random salt the keys of the transmission are derived from (version 4). */
+    uint8_t version; /**< The protocol version used in the current transmission. */
+    uint8_t fec_group_size; /**< The number of chunks in a forward error correction group. */
+    uint8_t fec_parity_count; /**< The number of parity chunks sent for each group; zero if disabled. */
+    bool resumable; /**< Signalises if the transfers are resumable. */
+    bool compress; /**< Signalises if the data chunks are compressed. */
+    uint64_t chunk_count = 0; /**< The number of data chunks (known after the first pass). */
+
+    /**
+     * Adds a path to the receiver: takes its maximum packet size from the MPSCache or discovers it, opens a raw
+     * socket for it and creates its RateController.
+     *
+     * @param [in] dst The destination address.
+     * @param [in] src The source (interface) address.
+     * @param [in] if_name The name of the source interface.
+     * @param [in] rate_options The rate control settings.
+     * @throws std::runtime_error Thrown when the maximum packet size cannot be found or the socket cannot be opened.
+     */
+    void add_path(sockaddr *dst, sockaddr *src, const std::string &if_name, const RateOptions &rate_options);
+
+    /**
+     * Performs the handshake, announces the stream and sends it.
+     *
+     * @param [in] input The input (in streaming mode if it's not seekable).
+     * @param [in] stream_size The number of bytes in the stream (ignored in streaming mode).
+     * @param [in] file_name The file name (or the batch name) to announce to the receiver.
+     * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
+     * @param [in] manifest_len The length of the manifest at the beginning of a batch stream; zero for a single file.
+     * @param [in] identity The identity of a resumable transfer (PROTO_IDENTITY_LEN bytes); nullptr if the transfer
+     * is not resumable.
+     */
+    void send_stream(const PipelineInput &input, std::streamsize stream_size, const std::string &file_name,
+                     const secure_string &password, uint64_t manifest_len, const uint8_t *identity);
 
     /**
      * Performs a protocol handshake: Sends a 'Hello' packet and waits for MODE_ESTAB_TIMEOUT_MS milliseconds to
-     * receive a 'Hello Back' packet from the receiver. If it does, sets the transmission mode to TWO_WAY and
-     * sends a 'Hello Back' packet to the receiver.
+     * receive a 'Hello Back' packet from the receiver. If it does, sets the transmission mode to TWO_WAY,
+     * lowers the protocol version to the one the receiver supports and sends a 'Hello Back' packet to the receiver.
      */
     void com_init();
 
@@ -63,44 +181,177 @@ private:
      * Sends a 'File Information' packet to the receiver with the specified file name (encrypted) and file length
      * information. In two-way mode, waits for a confirmation packet. If it arrives and signalises an error, throws.
      *
+     * @remark In protocol version 1, the length of the encrypted stream is sent. In version 2, the length of the file
+     * and the chunk size are sent. A batch is marked by PROTO_FILE_INFO_BATCH and its manifest length is sent too.
+     * A resumable transfer is marked by PROTO_FILE_INFO_RESUMABLE and its identity is sent too. In streaming mode,
+     * PROTO_FILE_INFO_STREAMING is set and the length is zero.
      * @param [in] file_name The file name to announce to the receiver.
      * @param [in] file_len The file length to announce to the receiver.
      * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
+     * @param [in] manifest_len The length of the manifest of a batch; zero for a single file.
+     * @param [in] identity The identity of a resumable transfer; nullptr if the transfer is not resumable.
+     * @param [in] streaming True if the length is not known yet (streaming mode).
+     */
+    void com_send_fileinfo(const std::string &file_name, std::streamsize file_len, const secure_string &password,
+                           uint64_t manifest_len = 0, const uint8_t *identity = nullptr, bool streaming = false);
+
+    /**
+     * Waits for the receiver's answer to the 'File Information' of a resumable transfer (protocol version 2,
+     * two-way mode).
+     *
+     * @param [out] indices A vector to save the indices of the chunks the receiver is missing to.
+     * @return True if the receiver resumes a previous transfer and only the chunks in @a indices should be sent.
+     * @throws std::runtime_error Thrown when the receiver signalises an error.
+     */
+    bool com_receive_resume(std::vector<uint64_t> &indices);
+
+    /**
+     * Sends a 'Join' message over each additional path of a multipath transfer and waits for the receiver to accept
+     * them (see PROTO_JOIN). Repeats the messages that are not answered (S_JOIN_ATTEMPTS times); the paths that
+     * don't join are removed.
+     *
+     * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
+     * @throws std::runtime_error Thrown when the receiver signalises an error.
      */
-    void com_send_fileinfo(const std::string &file_name, std::streamsize file_len, const secure_string &password);
+    void com_join_paths(const secure_string &password);
 
     /**
      * Reads the input stream, encrypts it and sends it to the receiver. When done, sends an 'All Data Sent'
-     * protocol packet (seq = UINT16_MAX).
+     * protocol packet (seq = UINT16_MAX) with the last seq (protocol version 1) or the number of chunks
+     * (protocol version 2), followed by the number of bytes read in streaming mode.
      *
-     * @remark Set S_WAIT_FOR_DATA_REPLIES to 1 to wait for an Echo Reply message to confirm delivery of each sent chunk.
-     * This is purely experimental and does not cause the packet to be resent.
-     * @param [in] stream The input stream.
+     * @remark When S_WINDOW_MODE is set to 1, the chunks are sent using a SendWindow: the Echo Reply messages
+     * acknowledge the chunks and the ones that are not acknowledged in time are retransmitted. Otherwise, the chunks
+     * are sent blindly. In both cases, the chunks are paced by the RateController.
+     * @remark With multiple paths, each chunk is sent over the path that may send it the soonest (each path has its
+     * own window and pacing); the receiver puts the chunks together by their positions.
+     * @remark The stream is read and encrypted by a SendPipeline. In protocol version 2, the chunks are encrypted
+     * in parallel and only the requested chunks are read when resending. The seqs of the chunks wrap around
+     * (see data_seq()).
+     * @remark If forward error correction is enabled (protocol version 2 only), parity chunks are sent after each
+     * group of chunks in the initial pass.
+     * @remark If compression is enabled (protocol version 3), the workers compress each chunk before encrypting it;
+     * the compressed chunks are sent in smaller packets and the pacing lets more of them through.
+     * @param [in] input The input.
      * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
-     * @param seq_whitelist If provided, only sends chunks the sequence number of which is present in the vector. This
-     * is used when resending missed chunks.
+     * @param resend_indices If provided, only sends chunks the index (seq - 2) of which is present in the vector.
+     * This is used when resending missed chunks.
+     * @param [in] resume If true, @a resend_indices are the chunks missing from a resumed transfer (they're sent
+     * at the full rate and without parity chunks).
+     */
+    void com_send_data(const PipelineInput &input, const secure_string &password,
+                       std::vector<uint64_t> *resend_indices = nullptr, bool resume = false);
+
+    /**
+     * Retransmits the chunks in the window the retransmission timers of which have expired and processes
+     * the received Echo Replies (acknowledges the corresponding chunks). If no reply arrives at all, sets
+     * the path's use_window to false.
+     *
+     * @param [in,out] path The path the chunks have been sent over.
+     * @param [in,out] window The window of chunks in flight.
+     */
+    void service_window(SendPath &path, SendWindow &window);
+
+    /**
+     * Services the windows of all paths that use one (see service_window()), then waits for an Echo Reply on any
+     * of them until the nearest retransmission timer expires or until @a max_wait_us passes.
+     *
+     * @param [in,out] windows The windows of chunks in flight, one for each path.
+     * @param [in] max_wait_us Maximum time to wait in microseconds (e.g. until the pacing allows sending another
+     * chunk). Negative value means waiting for the retransmission timers only (not at all if no chunk is in flight).
      */
-    void com_send_data(std::istream &stream, const secure_string &password,
-                       std::vector<uint16_t> *seq_whitelist = nullptr);
+    void service_windows(std::vector<std::unique_ptr<SendWindow>> &windows, int64_t max_wait_us);
 
     /**
-     * Waits for a protocol message from the receiver. If it requests resending some chunks, seeks stream to the
-     * beginning and calls com_send_data() to resend the specified chunks.
+     * Starts probing the maximum packet size of a path in a background thread (using a separate socket) when a drop
+     * of the path MTU is suspected. Does nothing if a probe has already been started.
+     *
+     * @param [in,out] path The path.
+     */
+    static void start_mps_probe(SendPath &path);
+
+    /**
+     * Waits for the background probes of the maximum packet size (if they have been started) and stores the results
+     * in the MPSCache. The packets of the current transmission keep their size (the chunk size cannot change),
+     * so the new size is only used by the next transmissions.
+     */
+    void finish_mps_probe();
+
+    /**
+     * Receives all Echo Replies waiting in the path socket's receive buffer and acknowledges the corresponding
+     * chunks in the window.
+     *
+     * @param [in,out] path The path the chunks have been sent over.
+     * @param [in,out] window The window of chunks in flight.
+     */
+    void receive_replies(SendPath &path, SendWindow &window);
+
+    /**
+     * Encrypts and sends the parity chunks of a group (see fec.h) and resets the encoder for the next group.
+     *
+     * @param [in,out] fec The encoder with the parity chunks of the group.
+     * @param [in] group The group number.
+     * @param [in,out] path The path to send the parity chunks over.
+     * @param [in,out] batch The batch of data chunks waiting to be sent over the path (it's sent first).
+     * @throws std::runtime_error Thrown when the packets cannot be sent.
+     */
+    void com_send_parity(FecEncoder &fec, uint64_t group, SendPath &path, SendBatch &batch);
+
+    /**
+     * Sends all packets in a batch and clears it.
+     *
+     * @param [in] path The path to send the packets over.
+     * @param [in,out] batch The batch of packets to send.
+     * @throws std::runtime_error Thrown when the packets cannot be sent.
+     */
+    static void flush_batch(const SendPath &path, SendBatch &batch);
+
+    /**
+     * Waits for a protocol message from the receiver. If it requests resending some chunks, rewinds the input
+     * and calls com_send_data() to resend the specified chunks.
      *
      * @remark This is only used in two-way mode.
-     * @param [in] stream The originally sent data input stream.
+     * @param [in] input The originally sent input.
      * @param [in] password The encryption password (a shared secret to generate the data encryption key from).
+     * @throws std::runtime_error Thrown when chunks of an input that is not seekable should be resent.
+     */
+    void com_receive_result(const PipelineInput &input, const secure_string &password);
+
+    /**
+     * Waits for a protocol message (seq = UINT16_MAX on the transaction ID) from the receiver.
+     *
+     * @param [out] data A pointer to the message data (in @a packet_buffer).
+     * @param [out] data_len Length of the message data (at least one byte).
+     * @param [in] timeout_ms Maximum time to wait.
+     * @return False if no message has arrived in time.
+     */
+    bool com_receive_control(uint8_t *&data, uint16_t &data_len, unsigned int timeout_ms);
+
+    /**
+     * Receives the remaining parts of a 'Request Resend Ranges' message (protocol version 2) and decodes
+     * the requested chunk indices.
+     *
+     * @param [in] data The data of the first received part.
+     * @param [in] data_len Length of the data.
+     * @param [out] indices A vector to save the requested chunk indices to.
+     * @return False if the message is malformed.
+     */
+    bool com_receive_resend_ranges(uint8_t *data, uint16_t data_len, std::vector<uint64_t> &indices);
+
+    /**
+     * @return The number of plain bytes sent in one data chunk.
      */
-    void com_receive_result(std::istream &stream, const secure_string &password);
+    [[nodiscard]] size_t chunk_size() const;
 
     /**
-     * Determines the number of bytes that can be read from the stream.
-     * Requires the stream to be seekable.
+     * Computes the identity of a resumable transfer: the SHA-256 hash of the input. Rewinds an input stream
+     * (it must be seekable).
      *
-     * @param [in,out] stream The input stream.
-     * @return The number of bytes that can be read from the stream.
+     * @param [in] input The input.
+     * @param [out] identity A buffer of PROTO_IDENTITY_LEN bytes to save the hash to.
+     * @throws std::runtime_error Thrown when the hash cannot be computed.
      */
-    static std::streamsize get_file_size(std::istream &stream);
+    static void compute_identity(const PipelineInput &input, uint8_t *identity);
 };
 
 #endif //ISA_SENDER_H
@@ -0,0 +1,76 @@
+// spsc_queue.h
+// Author: Ondřej Ondryáš (xondry02@stud.fit.vutbr.cz)
+
+
+#ifndef ISA_SPSC_QUEUE_H
+#define ISA_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * A bounded lock-free queue for exactly one producer thread and one consumer thread.
+ *
+ * @remark The capacity is rounded up to a power of two.
+ * @tparam T The type of the items. Should be cheap to copy (e.g. a pointer).
+ */
+template<typename T>
+class SpscQueue {
+public:
+    /**
+     * Creates an empty SpscQueue.
+     * @param [in] capacity The minimal number of items the queue can hold.
+     */
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+
+        items.resize(size);
+        mask = size - 1;
+    }
+
+    /**
+     * Adds an item to the end of the queue. May only be called from the producer thread.
+     * @param [in] item The item to add.
+     * @return True if the item has been added; false if the queue is full.
+     */
+    bool try_push(const T &item) {
+        auto current_tail = tail.load(std::memory_order_relaxed);
+        if (current_tail - head.load(std::memory_order_acquire) == items.size()) {
+            return false;
+        }
+
+        items[current_tail & mask] = item;
+        tail.store(current_tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Removes an item from the beginning of the queue. May only be called from the consumer thread.
+     * @param [out] item The removed item.
+     * @return True if an item has been removed; false if the queue is empty.
+     */
+    bool try_pop(T &item) {
+        auto current_head = head.load(std::memory_order_relaxed);
+        if (current_head == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        item = items[current_head & mask];
+        head.store(current_head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> items; /**< The ring buffer. */
+    size_t mask; /**< The ring buffer size minus one. */
+
+    // The indices are kept in separate cache lines so that the producer and the consumer don't interfere
+    alignas(64) std::atomic<size_t> head{0}; /**< Position of the first item (modified by the consumer). */
+    alignas(64) std::atomic<size_t> tail{0}; /**< Position after the last item (modified by the producer). */
+};
+
+#endif //ISA_SPSC_QUEUE_H
@@ -50,6 +50,30 @@ bool sockaddr_eq(const sockaddr *a, const sockaddr *b) {
     return false;
 }
 
+size_t addr_bytes(const sockaddr *address, const uint8_t *&bytes) {
+    if (address->sa_family == AF_INET) {
+        bytes = reinterpret_cast<const uint8_t *>(&reinterpret_cast<const sockaddr_in *>(address)->sin_addr);
+        return sizeof(in_addr);
+    } else if (address->sa_family == AF_INET6) {
+        bytes = reinterpret_cast<const uint8_t *>(&reinterpret_cast<const sockaddr_in6 *>(address)->sin6_addr);
+        return sizeof(in6_addr);
+    }
+
+    return 0;
+}
+
+uint64_t now_us() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 secure_string read_password() {
     termios termios_orig{};
     tcgetattr(STDIN_FILENO, &termios_orig);
@@ -50,6 +50,26 @@ std::string addr_to_string(const sockaddr *address);
  */
 bool sockaddr_eq(const sockaddr *a, const sockaddr *b);
 
+/**
+ * Returns the raw bytes of the specified IP address (in network byte order).
+ * @param address A pointer to sockaddr that contains an IPv4 or an IPv6 address.
+ * @param bytes Set to point to the bytes of the address (inside the sockaddr).
+ * @return The number of bytes of the address (4 or 16); 0 if it's not an IPv4 or an IPv6 address.
+ */
+size_t addr_bytes(const sockaddr *address, const uint8_t *&bytes);
+
+/**
+ * Returns the current value of the monotonic clock.
+ * @return Number of microseconds elapsed since an unspecified point in the past.
+ */
+uint64_t now_us();
+
+/**
+ * Returns the current value of the monotonic clock in nanoseconds (for measuring short durations).
+ * @return Number of nanoseconds elapsed since an unspecified point in the past.
+ */
+uint64_t now_ns();
+
 /**
  * Disables terminal echo, reads a password from the standard input and re-enables terminal echo.
  * @return The read password.